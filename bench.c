@@ -0,0 +1,561 @@
+/*
+ * bench.c - 壓力測試與延遲量測工具
+ * 功能：以 M 個執行緒開啟 N 條連線 (二進位協定)，依設定的比例送出 new/read/write/change，
+ *       可指定總請求速率 (未指定時每條連線收到回應後立刻送出下一個請求)。
+ *       結束時輸出吞吐量與各指令的延遲分佈 (HDR 風格的對數直方圖，p50/p99/p999)，
+ *       並另外統計在檔案鎖上排隊 (收到「正在被讀取/寫入」到「完成」) 的時間。
+ *
+ * 用法: ./bench [-h host] [-p port] [-u unix socket 路徑] [-c 連線數] [-j 執行緒數] [-d 秒數] [-r 每秒請求數]
+ *               [-m new:read:write:change 比例] [-n 檔案數] [-s 寫入 bytes] [-g 群組]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+
+#define PORT 8888
+#define BUFFER_SIZE 1024
+
+// 直方圖 (HDR 風格的對數線性區間)：小於 HIST_SUB_BUCKETS 的值各自一格；
+// 較大的值保留最高的 HIST_SUB_BITS 個位元 (相對誤差 < 1/32)，單位為微秒
+#define HIST_SUB_BITS 6
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_EXPONENTS 40
+#define HIST_BUCKETS (HIST_EXPONENTS * HIST_SUB_BUCKETS)
+
+enum
+{
+    KIND_NEW,
+    KIND_READ,
+    KIND_WRITE,
+    KIND_CHANGE,
+    KIND_LOCK_WAIT, // 在檔案鎖上排隊的時間 (不是一種請求)
+    KIND_COUNT
+};
+
+static const char *kind_names[KIND_COUNT] = {"new", "read", "write", "change", "lock-wait"};
+
+typedef struct
+{
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+    uint64_t errors; // 回應狀態不是 ST_OK 的請求數
+} Histogram;
+
+// 每條連線同時只有一個請求
+typedef struct
+{
+    int sock;
+    int busy;
+    int kind;
+    uint64_t start_us;      // 請求的預定送出時間 (指定速率時以排程時間計算，避免 coordinated omission)
+    uint64_t wait_start_us; // 收到 ST_WAITING 的時間 (0: 未在排隊)
+} BenchConn;
+
+typedef struct
+{
+    int id;
+    int nconns;
+    BenchConn *conns;
+    Histogram hist[KIND_COUNT];
+    unsigned seed;
+    uint64_t seq;
+} Worker;
+
+static const char *host = "127.0.0.1";
+static const char *unix_path; // 不為 NULL 時改連伺服器的 unix socket
+static int port = PORT;
+static int nconns = 16, nthreads = 4, duration = 10, nfiles = 16, write_size = 64;
+static double rate; // 總請求速率 (每秒)，0 表示不限速
+static int mix[4] = {5, 60, 25, 10};
+static const char *group = "AOS-group";
+static char write_data[PROTO_MAX_PAYLOAD];
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int hist_index(uint64_t v)
+{
+    if (v < HIST_SUB_BUCKETS)
+        return (int)v;
+    int exp = 63 - __builtin_clzll(v) - HIST_SUB_BITS + 1; // 右移 exp 位後剩下 HIST_SUB_BITS 位 (最高位為 1)
+    int idx = exp * HIST_SUB_BUCKETS + (int)(v >> exp);
+    return idx < HIST_BUCKETS ? idx : HIST_BUCKETS - 1;
+}
+
+// 區間的上限值 (回報百分位數時使用，偏向保守)
+static uint64_t hist_value(int idx)
+{
+    int exp = idx / HIST_SUB_BUCKETS, sub = idx % HIST_SUB_BUCKETS;
+    if (exp == 0)
+        return sub;
+    return ((uint64_t)(sub + 1) << exp) - 1;
+}
+
+static void hist_record(Histogram *h, uint64_t v)
+{
+    h->counts[hist_index(v)]++;
+    h->total++;
+    if (v > h->max)
+        h->max = v;
+}
+
+static uint64_t hist_percentile(const Histogram *h, double p)
+{
+    uint64_t target = (uint64_t)(h->total * p / 100.0 + 0.5), seen = 0;
+    if (target == 0)
+        target = 1;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += h->counts[i];
+        if (seen >= target)
+            return hist_value(i) < h->max ? hist_value(i) : h->max;
+    }
+    return h->max;
+}
+
+static void hist_merge(Histogram *dst, const Histogram *src)
+{
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        dst->counts[i] += src->counts[i];
+    dst->total += src->total;
+    dst->errors += src->errors;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+// 讀滿 len bytes，連線中斷回傳 -1
+static int read_full(int sock, void *buf, size_t len)
+{
+    size_t got = 0;
+    while (got < len)
+    {
+        ssize_t n = read(sock, (char *)buf + got, len - got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        got += n;
+    }
+    return 0;
+}
+
+static int send_all(int sock, const void *buf, size_t len)
+{
+    size_t sent = 0;
+    while (sent < len)
+    {
+        ssize_t n = send(sock, (const char *)buf + sent, len - sent, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        sent += n;
+    }
+    return 0;
+}
+
+// 送出一個 frame：payload 為 nfields 個字串欄位，之後接 data (可為 NULL)
+static int send_frame(int sock, uint8_t opcode, uint16_t flags, uint32_t req_id,
+                      int nfields, const char *fields[], const char *data, size_t data_len)
+{
+    static __thread unsigned char frame[PROTO_HEADER_SIZE + PROTO_MAX_PAYLOAD];
+    size_t off = PROTO_HEADER_SIZE;
+
+    for (int i = 0; i < nfields; i++)
+        proto_put_field(frame, sizeof(frame), &off, fields[i], strlen(fields[i]));
+    if (data)
+    {
+        memcpy(frame + off, data, data_len);
+        off += data_len;
+    }
+    FrameHeader h = {opcode, 0, flags, req_id, off - PROTO_HEADER_SIZE};
+    proto_encode_header(frame, &h);
+    return send_all(sock, frame, off);
+}
+
+// 讀掉 payload
+static int discard(int sock, size_t len)
+{
+    char buf[BUFFER_SIZE * 16];
+    while (len > 0)
+    {
+        size_t n = len < sizeof(buf) ? len : sizeof(buf);
+        if (read_full(sock, buf, n) < 0)
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+// 等待一個最終回應 (準備階段用)，回傳狀態碼；連線中斷回傳 -1
+static int wait_final(int sock)
+{
+    unsigned char header[PROTO_HEADER_SIZE];
+    FrameHeader h;
+    do
+    {
+        if (read_full(sock, header, PROTO_HEADER_SIZE) < 0 || proto_decode_header(header, &h) < 0 ||
+            discard(sock, h.length) < 0)
+            return -1;
+    } while (h.status < ST_FINAL);
+    return h.status;
+}
+
+static int connect_login(const char *user)
+{
+    int sock, one = 1;
+
+    if (unix_path)
+    {
+        struct sockaddr_un addr = {0};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, unix_path, sizeof(addr.sun_path) - 1);
+        sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+            perror("connect");
+            exit(1);
+        }
+    }
+    else
+    {
+        struct sockaddr_in addr = {0};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock < 0 || inet_pton(AF_INET, host, &addr.sin_addr) <= 0 ||
+            connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+            perror("connect");
+            exit(1);
+        }
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    const char *fields[] = {user, group};
+    if (send_frame(sock, OP_LOGIN, 0, 0, 2, fields, NULL, 0) < 0 || wait_final(sock) != ST_OK)
+    {
+        fprintf(stderr, "登入失敗 (%s %s)\n", user, group);
+        exit(1);
+    }
+    return sock;
+}
+
+// 依比例隨機選一種指令
+static int pick_kind(Worker *w)
+{
+    int total = mix[0] + mix[1] + mix[2] + mix[3];
+    int r = rand_r(&w->seed) % total;
+    for (int k = 0; k < 4; k++)
+    {
+        if (r < mix[k])
+            return k;
+        r -= mix[k];
+    }
+    return KIND_READ;
+}
+
+static int issue(Worker *w, BenchConn *bc, uint64_t start)
+{
+    char name[64];
+    int kind = pick_kind(w);
+    int rc;
+
+    bc->kind = kind;
+    bc->start_us = start;
+    bc->wait_start_us = 0;
+    bc->busy = 1;
+    snprintf(name, sizeof(name), "bench_%d", rand_r(&w->seed) % nfiles);
+
+    switch (kind)
+    {
+    case KIND_NEW:
+    {
+        // 每次建立不同的檔案，量測目錄新增的成本
+        char fresh[64];
+        snprintf(fresh, sizeof(fresh), "bench_new_%d_%llu", w->id, (unsigned long long)w->seq++);
+        const char *fields[] = {fresh, "rwrwrw"};
+        rc = send_frame(bc->sock, OP_NEW, 0, 0, 2, fields, NULL, 0);
+        break;
+    }
+    case KIND_READ:
+    {
+        const char *fields[] = {name};
+        rc = send_frame(bc->sock, OP_READ, 0, 0, 1, fields, NULL, 0);
+        break;
+    }
+    case KIND_WRITE:
+    {
+        const char *fields[] = {name, "a"};
+        rc = send_frame(bc->sock, OP_WRITE, FLAG_DATA, 0, 2, fields, write_data, write_size);
+        break;
+    }
+    default:
+    {
+        const char *fields[] = {name, "rwrwrw"};
+        rc = send_frame(bc->sock, OP_CHANGE, 0, 0, 2, fields, NULL, 0);
+        break;
+    }
+    }
+    return rc;
+}
+
+// 處理一個回應 frame
+static int handle_response(Worker *w, BenchConn *bc)
+{
+    unsigned char header[PROTO_HEADER_SIZE];
+    FrameHeader h;
+
+    if (read_full(bc->sock, header, PROTO_HEADER_SIZE) < 0 || proto_decode_header(header, &h) < 0 ||
+        discard(bc->sock, h.length) < 0)
+        return -1;
+
+    uint64_t t = now_us();
+    if (h.status == ST_WAITING)
+        bc->wait_start_us = t;
+    else if (h.status == ST_GRANTED && bc->wait_start_us)
+    {
+        hist_record(&w->hist[KIND_LOCK_WAIT], t - bc->wait_start_us);
+        bc->wait_start_us = 0;
+    }
+    else if (h.status >= ST_FINAL)
+    {
+        hist_record(&w->hist[bc->kind], t - bc->start_us);
+        if (h.status != ST_OK)
+            w->hist[bc->kind].errors++;
+        bc->busy = 0;
+    }
+    return 0;
+}
+
+static void *worker_main(void *arg)
+{
+    Worker *w = arg;
+    struct pollfd *pfds = calloc(w->nconns, sizeof(struct pollfd));
+    double per_thread = rate / nthreads;
+    uint64_t interval = per_thread > 0 ? (uint64_t)(1000000.0 / per_thread) : 0;
+    uint64_t begin = now_us(), end = begin + (uint64_t)duration * 1000000;
+    uint64_t next_send = begin;
+    int backlog = 0; // 指定速率時，已到預定時間但還沒有空閒連線可送的請求數
+
+    for (;;)
+    {
+        uint64_t t = now_us();
+        int busy = 0;
+
+        // 送出請求：不限速時所有空閒連線都送；限速時依排程時間送
+        if (t < end && interval)
+            while (next_send <= t && next_send < end)
+            {
+                backlog++;
+                next_send += interval;
+            }
+        for (int i = 0; i < w->nconns && t < end; i++)
+        {
+            BenchConn *bc = &w->conns[i];
+            if (bc->busy)
+                continue;
+            if (interval == 0)
+                issue(w, bc, t);
+            else if (backlog > 0)
+            {
+                // 以預定時間為起點計算延遲 (排程落後時等待空閒連線的時間也算在內)
+                issue(w, bc, next_send - (uint64_t)backlog * interval);
+                backlog--;
+            }
+        }
+        for (int i = 0; i < w->nconns; i++)
+        {
+            pfds[i].fd = w->conns[i].busy ? w->conns[i].sock : -1;
+            pfds[i].events = POLLIN;
+            busy += w->conns[i].busy;
+        }
+        if (t >= end && busy == 0)
+            break;
+
+        int timeout = 100;
+        if (interval && t < end)
+            timeout = next_send > t ? (int)((next_send - t) / 1000) : 0;
+        if (poll(pfds, w->nconns, timeout) < 0 && errno != EINTR)
+            break;
+        for (int i = 0; i < w->nconns; i++)
+            if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR))
+                if (handle_response(w, &w->conns[i]) < 0)
+                {
+                    fprintf(stderr, "連線中斷\n");
+                    exit(1);
+                }
+    }
+    free(pfds);
+    return NULL;
+}
+
+static void print_row(const char *name, const Histogram *h, double secs)
+{
+    if (h->total == 0)
+        return;
+    printf("%-10s %10llu %10.1f %8llu %10.3f %10.3f %10.3f %10.3f %10.3f\n", name,
+           (unsigned long long)h->total, h->total / secs, (unsigned long long)h->errors,
+           hist_percentile(h, 50) / 1000.0, hist_percentile(h, 90) / 1000.0,
+           hist_percentile(h, 99) / 1000.0, hist_percentile(h, 99.9) / 1000.0, h->max / 1000.0);
+}
+
+// 印出合併後直方圖的百分位分佈 (HdrHistogram 的 percentile distribution 格式)
+static void print_distribution(const Histogram *h)
+{
+    static const double pcts[] = {0, 50, 75, 90, 95, 99, 99.9, 99.99, 100};
+    printf("\n%12s %12s %10s\n", "Value(ms)", "Percentile", "TotalCount");
+    for (size_t i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i++)
+    {
+        double p = pcts[i];
+        uint64_t v = p == 0 ? hist_percentile(h, 0.0001) : p == 100 ? h->max : hist_percentile(h, p);
+        printf("%12.3f %12.6f %10llu\n", v / 1000.0, p / 100.0,
+               (unsigned long long)(h->total * p / 100.0 + 0.5));
+    }
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "用法: %s [-h host] [-p port] [-u unix socket 路徑] [-c 連線數] [-j 執行緒數] [-d 秒數] [-r 每秒請求數]\n"
+                    "          [-m new:read:write:change 比例] [-n 檔案數] [-s 寫入 bytes] [-g 群組]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    int ch;
+
+    while ((ch = getopt(argc, argv, "h:p:u:c:j:d:r:m:n:s:g:")) != -1)
+    {
+        switch (ch)
+        {
+        case 'h':
+            host = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'u':
+            unix_path = optarg;
+            break;
+        case 'c':
+            nconns = atoi(optarg);
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'm':
+            if (sscanf(optarg, "%d:%d:%d:%d", &mix[0], &mix[1], &mix[2], &mix[3]) != 4 ||
+                mix[0] < 0 || mix[1] < 0 || mix[2] < 0 || mix[3] < 0 || mix[0] + mix[1] + mix[2] + mix[3] == 0)
+                usage(argv[0]);
+            break;
+        case 'n':
+            nfiles = atoi(optarg);
+            break;
+        case 's':
+            write_size = atoi(optarg);
+            break;
+        case 'g':
+            group = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nconns < nthreads)
+        nconns = nthreads;
+    if (nfiles < 1)
+        nfiles = 1;
+    if (write_size < 1 || write_size > PROTO_MAX_PAYLOAD - 2 * BUFFER_SIZE)
+        write_size = 64;
+    memset(write_data, 'x', write_size - 1);
+    write_data[write_size - 1] = '\n';
+
+    // 準備階段：以同一個使用者建立共用的檔案 (所有連線都用同一個使用者，change 才有權限)
+    int setup = connect_login("bench");
+    for (int i = 0; i < nfiles; i++)
+    {
+        char name[64];
+        snprintf(name, sizeof(name), "bench_%d", i);
+        const char *fields[] = {name, "rwrwrw"};
+        if (send_frame(setup, OP_NEW, 0, 0, 2, fields, NULL, 0) < 0 || wait_final(setup) < 0)
+        {
+            fprintf(stderr, "建立測試檔案失敗\n");
+            return 1;
+        }
+    }
+    close(setup);
+
+    Worker *workers = calloc(nthreads, sizeof(Worker));
+    pthread_t *tids = calloc(nthreads, sizeof(pthread_t));
+    for (int i = 0; i < nthreads; i++)
+    {
+        Worker *w = &workers[i];
+        w->id = i;
+        w->seed = (unsigned)time(NULL) ^ (i * 2654435761u);
+        w->nconns = nconns / nthreads + (i < nconns % nthreads);
+        w->conns = calloc(w->nconns, sizeof(BenchConn));
+        for (int j = 0; j < w->nconns; j++)
+            w->conns[j].sock = connect_login("bench");
+    }
+
+    if (rate > 0)
+        printf("%d 條連線、%d 個執行緒、%d 秒，目標 %.0f req/s", nconns, nthreads, duration, rate);
+    else
+        printf("%d 條連線、%d 個執行緒、%d 秒，不限速", nconns, nthreads, duration);
+    printf("，比例 new:read:write:change = %d:%d:%d:%d\n", mix[0], mix[1], mix[2], mix[3]);
+
+    uint64_t begin = now_us();
+    for (int i = 0; i < nthreads; i++)
+        pthread_create(&tids[i], NULL, worker_main, &workers[i]);
+    for (int i = 0; i < nthreads; i++)
+        pthread_join(tids[i], NULL);
+    double secs = (now_us() - begin) / 1e6;
+
+    Histogram *merged = calloc(KIND_COUNT, sizeof(Histogram));
+    Histogram *all = calloc(1, sizeof(Histogram));
+    for (int i = 0; i < nthreads; i++)
+        for (int k = 0; k < KIND_COUNT; k++)
+            hist_merge(&merged[k], &workers[i].hist[k]);
+    for (int k = 0; k < KIND_LOCK_WAIT; k++)
+        hist_merge(all, &merged[k]);
+
+    printf("\n%-10s %10s %10s %8s %10s %10s %10s %10s %10s\n", "指令", "完成數", "req/s", "錯誤",
+           "p50(ms)", "p90(ms)", "p99(ms)", "p999(ms)", "max(ms)");
+    for (int k = 0; k < KIND_COUNT; k++)
+        print_row(kind_names[k], &merged[k], secs);
+    print_row("total", all, secs);
+    if (all->total)
+        print_distribution(all);
+
+    for (int i = 0; i < nthreads; i++)
+        for (int j = 0; j < workers[i].nconns; j++)
+            close(workers[i].conns[j].sock);
+    return 0;
+}
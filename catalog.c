@@ -0,0 +1,457 @@
+/*
+ * catalog.c - 檔案目錄 (分片 open addressing 雜湊表)
+ * 功能：雜湊值的高位元決定分片，低位元決定分片內的起始槽位 (linear probing)。
+ *       查詢與走訪不持有鎖 (RCU 風格：擴充時發布新陣列，舊陣列保留給仍在使用的讀取者)；
+ *       可變的權限欄位以 seqlock 保護，由寫入者 (new/change) 負擔同步成本。
+ *       另有一個依檔名排序的索引 (skip list) 給 list 分頁使用，第一次 list 時才建立。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "catalog.h"
+#include "principal.h"
+#include "store.h"
+
+#define CATALOG_SHARDS 64       // 分片數量 (2 的次方)
+#define CATALOG_SHARD_BITS 6    // log2(CATALOG_SHARDS)
+#define SHARD_INITIAL_SLOTS 64  // 每個分片的初始槽位數 (2 的次方)
+#define NAME_LEVELS 24          // 檔名索引 skip list 的最大層數 (足夠上千萬個檔案)
+
+// 槽位陣列：讀取者不持有鎖，以 acquire 讀取槽位指標
+typedef struct Table
+{
+    struct Table *retired;          // 已被取代的舊陣列 (串成清單，見 shard_grow)
+    size_t cap;                     // 槽位數 (2 的次方)
+    _Atomic(FileEntry *) slots[];   // NULL 代表空槽；沒有刪除操作，所以不需要墓碑
+} Table;
+
+typedef struct
+{
+    pthread_mutex_t lock;           // 只有新增、擴充與修改權限需要
+    _Atomic(Table *) table;         // 目前的槽位陣列
+    size_t count;                   // 已使用的槽位數
+} Shard;
+
+static Shard shards[CATALOG_SHARDS];
+static atomic_size_t total_files;
+static int persistent; // 1: 已開啟持久目錄
+
+// 檔名索引的節點：名稱建立後不再改變，權限在列出時才從記憶體項目或持久記錄讀取
+typedef struct NameNode
+{
+    char name[50];
+    int64_t rec;     // 持久記錄編號 (-1: 只在記憶體中)
+    FileEntry *file; // 記憶體中的項目 (NULL: 尚未載入，列出時讀取持久記錄)
+    struct NameNode *next[];
+} NameNode;
+
+static pthread_rwlock_t names_lock = PTHREAD_RWLOCK_INITIALIZER; // list 共用；新增與建立索引時獨佔
+static NameNode *names_head;                                     // 前導節點 (NAME_LEVELS 層)
+static int names_levels;                                         // 目前使用的層數
+static int names_built;                                          // 1: 已建立 (之後由 catalog_insert 維護)
+
+// FNV-1a 64-bit
+static uint64_t hash_name(const char *name)
+{
+    uint64_t h = 1469598103934665603ULL;
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++)
+    {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static Shard *shard_of(uint64_t hash)
+{
+    return &shards[hash >> (64 - CATALOG_SHARD_BITS)];
+}
+
+static Table *table_new(size_t cap)
+{
+    Table *t = calloc(1, sizeof(Table) + cap * sizeof(_Atomic(FileEntry *)));
+    t->cap = cap;
+    return t;
+}
+
+// 在陣列中找檔名所在的槽位，或應該插入的空槽位 (不需要任何鎖)
+static size_t probe(Table *t, const char *name, uint64_t hash)
+{
+    size_t mask = t->cap - 1;
+    size_t i = hash & mask;
+    FileEntry *e;
+    while ((e = atomic_load_explicit(&t->slots[i], memory_order_acquire)) != NULL)
+    {
+        if (e->hash == hash && strcmp(e->name, name) == 0)
+            break;
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// 負載超過 0.7 時容量加倍：在新陣列放好所有項目後才發布 (呼叫者需持有分片鎖)
+// 舊陣列可能仍有讀取者在查詢，所以不釋放而是留在 retired 清單；
+// 容量每次加倍，保留的舊陣列總大小不會超過目前的陣列
+static void shard_grow(Shard *s)
+{
+    Table *old = atomic_load_explicit(&s->table, memory_order_relaxed);
+    Table *t = table_new(old->cap * 2);
+
+    for (size_t i = 0; i < old->cap; i++)
+    {
+        FileEntry *e = atomic_load_explicit(&old->slots[i], memory_order_relaxed);
+        if (e == NULL)
+            continue;
+        size_t j = e->hash & (t->cap - 1);
+        while (atomic_load_explicit(&t->slots[j], memory_order_relaxed) != NULL)
+            j = (j + 1) & (t->cap - 1);
+        atomic_store_explicit(&t->slots[j], e, memory_order_relaxed);
+    }
+    t->retired = old;
+    atomic_store_explicit(&s->table, t, memory_order_release);
+}
+
+int catalog_init(const char *store_path, int sync)
+{
+    for (int i = 0; i < CATALOG_SHARDS; i++)
+    {
+        pthread_mutex_init(&shards[i].lock, NULL);
+        atomic_init(&shards[i].table, table_new(SHARD_INITIAL_SLOTS));
+        shards[i].count = 0;
+    }
+    if (!store_path)
+        return 0;
+
+    // 只 mmap 並重播 WAL，記錄等到被查詢時才載入
+    if (store_open(store_path, sync) < 0)
+        return -1;
+    persistent = 1;
+    atomic_store(&total_files, store_count());
+    return 0;
+}
+
+// 把項目放進槽位 i 並發布 (呼叫者持有分片鎖)
+static void publish(Shard *s, Table *t, size_t i, FileEntry *file)
+{
+    atomic_store_explicit(&t->slots[i], file, memory_order_release); // 發布給不持鎖的讀取者
+    s->count++;
+    if (s->count * 10 > t->cap * 7)
+        shard_grow(s);
+}
+
+// 從持久目錄載入一筆記錄到槽位 i (呼叫者持有分片鎖)：名稱在這次執行中轉成 ID，
+// 磁碟檔案存在時視為已提交的第一個版本
+static FileEntry *load_record(Shard *s, Table *t, size_t i, int64_t rec)
+{
+    StoreRecord r;
+    struct stat st;
+
+    if (store_get(rec, &r) < 0)
+    {
+        fprintf(stderr, "持久目錄記錄 %lld 損毀，略過\n", (long long)rec);
+        return NULL;
+    }
+    int bits = perm_compile(r.perms);
+
+    FileEntry *file = calloc(1, sizeof(FileEntry));
+    strcpy(file->name, r.name);
+    strcpy(file->owner, r.owner);
+    strcpy(file->group, r.group);
+    strcpy(file->perms, r.perms);
+    file->uid = principal_user_id(r.owner);
+    file->gid = principal_group_id(r.group);
+    atomic_init(&file->perm_bits, bits < 0 ? 0 : bits);
+    file->hash = r.hash;
+    file->rec = rec;
+    filelock_init(&file->lock, 0);
+    filelock_init(&file->inplace, 0);
+    pthread_mutex_init(&file->fd_lock, NULL);
+    if (stat(file->name, &st) == 0)
+    {
+        file->size = st.st_size;
+        atomic_init(&file->version, 1);
+    }
+    publish(s, t, i, file);
+    return file;
+}
+
+// 查詢不持有任何鎖：項目在完整初始化後才以 release 寫入槽位，且建立後位址與檔名都不再改變
+// 記憶體中找不到時才到持久目錄查詢 (持有分片鎖，避免同一筆記錄被載入兩次)
+FileEntry *catalog_find(const char *name)
+{
+    uint64_t hash = hash_name(name);
+    Shard *s = shard_of(hash);
+    Table *t = atomic_load_explicit(&s->table, memory_order_acquire);
+    FileEntry *file = atomic_load_explicit(&t->slots[probe(t, name, hash)], memory_order_acquire);
+
+    if (file || !persistent)
+        return file;
+
+    pthread_mutex_lock(&s->lock);
+    t = atomic_load_explicit(&s->table, memory_order_relaxed);
+    size_t i = probe(t, name, hash);
+    file = atomic_load_explicit(&t->slots[i], memory_order_relaxed);
+    int64_t rec;
+    if (!file && (rec = store_find(name, hash)) >= 0)
+        file = load_record(s, t, i, rec);
+    pthread_mutex_unlock(&s->lock);
+    return file;
+}
+
+static void names_add(const char *name, int64_t rec, FileEntry *file);
+
+FileEntry *catalog_insert(const char *name, const char *owner, const char *group, const char *perms,
+                          uint32_t uid, uint32_t gid, uint8_t perm_bits, int *created)
+{
+    uint64_t hash = hash_name(name);
+    Shard *s = shard_of(hash);
+
+    pthread_mutex_lock(&s->lock);
+    Table *t = atomic_load_explicit(&s->table, memory_order_relaxed);
+    size_t i = probe(t, name, hash);
+    FileEntry *existing = atomic_load_explicit(&t->slots[i], memory_order_relaxed);
+    int64_t rec;
+    if (!existing && persistent && (rec = store_find(name, hash)) >= 0)
+        existing = load_record(s, t, i, rec);
+    if (existing != NULL)
+    {
+        pthread_mutex_unlock(&s->lock);
+        *created = 0;
+        return existing;
+    }
+
+    // 複製變數到新的 FileEntry
+    FileEntry *file = calloc(1, sizeof(FileEntry));
+    strcpy(file->name, name);
+    strcpy(file->owner, owner);
+    strcpy(file->group, group);
+    strcpy(file->perms, perms);
+    file->uid = uid;
+    file->gid = gid;
+    atomic_init(&file->perm_bits, perm_bits);
+    file->hash = hash;
+    file->rec = -1;
+    filelock_init(&file->lock, 1);
+    filelock_init(&file->inplace, 0);
+    pthread_mutex_init(&file->fd_lock, NULL);
+
+    // 先寫進 WAL 再發布；寫入失敗時檔案仍可使用，只是重新啟動後不會保留
+    uint64_t lsn = 0;
+    if (persistent && (lsn = store_insert(name, hash, owner, group, perms, &file->rec)) == 0)
+        perror("store_insert");
+
+    publish(s, t, i, file);
+    pthread_mutex_unlock(&s->lock);
+
+    // 檔名索引建立之後由新增者維護 (發布之後才加入，建立索引的那一輪若已看到這個項目則只保留一個)
+    pthread_rwlock_wrlock(&names_lock);
+    if (names_built)
+        names_add(name, file->rec, file);
+    pthread_rwlock_unlock(&names_lock);
+
+    store_sync(lsn);
+    atomic_fetch_add(&total_files, 1);
+    *created = 1;
+    return file;
+}
+
+size_t catalog_size(void)
+{
+    return atomic_load(&total_files);
+}
+
+void catalog_foreach(void (*fn)(FileEntry *file, void *arg), void *arg)
+{
+    for (int i = 0; i < CATALOG_SHARDS; i++)
+    {
+        Table *t = atomic_load_explicit(&shards[i].table, memory_order_acquire);
+        for (size_t j = 0; j < t->cap; j++)
+        {
+            FileEntry *e = atomic_load_explicit(&t->slots[j], memory_order_acquire);
+            if (e != NULL)
+                fn(e, arg);
+        }
+    }
+}
+
+/* ---- 檔名索引 (skip list)：list 從 after 之後開始走，每頁只讀 limit + 1 筆 ---- */
+
+// 節點層數 (每層機率 1/4；只在持有 names_lock 寫鎖時呼叫)
+static int random_level(void)
+{
+    static unsigned seed = 2463534242u;
+    int level = 1;
+    for (;;)
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        if ((seed & 3) != 0 || level == NAME_LEVELS)
+            return level;
+        level++;
+    }
+}
+
+// 找出每一層最後一個檔名小於 name (inclusive = 1 時小於等於) 的節點，存進 prev (可為 NULL)，回傳第 0 層的那一個
+static NameNode *names_seek(const char *name, int inclusive, NameNode **prev)
+{
+    NameNode *n = names_head;
+    for (int level = names_levels - 1; level >= 0; level--)
+    {
+        NameNode *next;
+        while ((next = n->next[level]) != NULL)
+        {
+            int cmp = strcmp(next->name, name);
+            if (cmp > 0 || (cmp == 0 && !inclusive))
+                break;
+            n = next;
+        }
+        if (prev)
+            prev[level] = n;
+    }
+    return n;
+}
+
+// 加入一個檔名 (持有 names_lock 寫鎖)；已存在時只補上記憶體項目
+// (建立索引的那一輪與同時新增的 catalog_insert 可能加入同一個檔名)
+static void names_add(const char *name, int64_t rec, FileEntry *file)
+{
+    NameNode *prev[NAME_LEVELS];
+    for (int level = names_levels; level < NAME_LEVELS; level++)
+        prev[level] = names_head;
+    names_seek(name, 0, prev);
+
+    NameNode *found = prev[0]->next[0];
+    if (found && strcmp(found->name, name) == 0)
+    {
+        if (!found->file)
+            found->file = file;
+        return;
+    }
+
+    int height = random_level();
+    NameNode *n = malloc(sizeof(NameNode) + height * sizeof(NameNode *));
+    snprintf(n->name, sizeof(n->name), "%s", name);
+    n->rec = rec;
+    n->file = file;
+    for (int level = 0; level < height; level++)
+    {
+        n->next[level] = prev[level]->next[level];
+        prev[level]->next[level] = n;
+    }
+    if (height > names_levels)
+        names_levels = height;
+}
+
+static void names_add_record(int64_t rec, const StoreRecord *r, void *arg)
+{
+    (void)arg;
+    names_add(r->name, rec, NULL);
+}
+
+static void names_add_entry(FileEntry *file, void *arg)
+{
+    (void)arg;
+    if (file->rec < 0)
+        names_add(file->name, -1, file);
+}
+
+// 第一次 list 時建立索引：持久目錄的記錄不必載入記憶體，只記下編號
+// 走訪期間新增的檔案由 catalog_insert 在建立完成後補上 (重複的檔名只保留一個)
+static void names_build(void)
+{
+    pthread_rwlock_wrlock(&names_lock);
+    if (!names_built)
+    {
+        names_head = calloc(1, sizeof(NameNode) + NAME_LEVELS * sizeof(NameNode *));
+        names_levels = 1;
+        if (persistent)
+            store_foreach(names_add_record, NULL);
+        catalog_foreach(names_add_entry, NULL);
+        names_built = 1;
+    }
+    pthread_rwlock_unlock(&names_lock);
+}
+
+// 依序走過 after 之後的節點，讀出其中符合 prefix 的前 limit + 1 筆 (檔名排序，不需要再排序)
+int catalog_list(const char *prefix, const char *after, CatalogInfo *out, int limit, int *more)
+{
+    size_t prefix_len = strlen(prefix);
+    int n = 0;
+
+    if (!names_built)
+        names_build();
+
+    pthread_rwlock_rdlock(&names_lock);
+    // prefix 排在 after 之後時從 prefix 開始 (第一個 >= prefix 的檔名)，否則從第一個 > after 的檔名開始
+    NameNode *node = strcmp(prefix, after) > 0 ? names_seek(prefix, 0, NULL) : names_seek(after, 1, NULL);
+    *more = 0;
+    for (node = node->next[0]; node && strncmp(node->name, prefix, prefix_len) == 0; node = node->next[0])
+    {
+        if (n == limit)
+        {
+            *more = 1;
+            break;
+        }
+        CatalogInfo *info = &out[n];
+        if (node->file)
+        {
+            uint8_t bits;
+            snprintf(info->owner, sizeof(info->owner), "%s", node->file->owner);
+            snprintf(info->group, sizeof(info->group), "%s", node->file->group);
+            catalog_get_perms(node->file, info->perms, &bits);
+        }
+        else
+        {
+            StoreRecord r;
+            if (store_get(node->rec, &r) < 0)
+                continue; // 損毀的記錄 (載入時也會略過)
+            snprintf(info->owner, sizeof(info->owner), "%s", r.owner);
+            snprintf(info->group, sizeof(info->group), "%s", r.group);
+            snprintf(info->perms, sizeof(info->perms), "%s", r.perms);
+        }
+        snprintf(info->name, sizeof(info->name), "%s", node->name);
+        n++;
+    }
+    pthread_rwlock_unlock(&names_lock);
+    return n;
+}
+
+void catalog_set_perms(FileEntry *file, const char *perms, uint8_t perm_bits)
+{
+    Shard *s = shard_of(file->hash);
+
+    // 寫入者之間以分片鎖互斥；序號為奇數期間讀取者會重試
+    pthread_mutex_lock(&s->lock);
+    unsigned seq = atomic_load_explicit(&file->meta_seq, memory_order_relaxed);
+    atomic_store_explicit(&file->meta_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    snprintf(file->perms, sizeof(file->perms), "%s", perms);
+    atomic_store_explicit(&file->perm_bits, perm_bits, memory_order_release);
+    atomic_store_explicit(&file->meta_seq, seq + 2, memory_order_release);
+
+    uint64_t lsn = 0;
+    if (file->rec >= 0 && (lsn = store_set_perms(file->rec, perms)) == 0)
+        perror("store_set_perms");
+    pthread_mutex_unlock(&s->lock);
+
+    store_sync(lsn);
+}
+
+void catalog_get_perms(FileEntry *file, char *perms, uint8_t *perm_bits)
+{
+    unsigned seq;
+    do
+    {
+        while ((seq = atomic_load_explicit(&file->meta_seq, memory_order_acquire)) & 1)
+            ; // 寫入者正在修改 (只有幾個 bytes，很快完成)
+        memcpy(perms, file->perms, sizeof(file->perms));
+        *perm_bits = atomic_load_explicit(&file->perm_bits, memory_order_relaxed);
+        atomic_thread_fence(memory_order_acquire);
+    } while (atomic_load_explicit(&file->meta_seq, memory_order_relaxed) != seq);
+}
@@ -0,0 +1,89 @@
+/*
+ * catalog.h - 檔案目錄 (檔名 -> FileEntry 的雜湊索引)
+ * 功能：open addressing 雜湊表，依雜湊值切成多個分片 (lock striping)，
+ *       每個分片有自己的 mutex 並各自動態擴充，查詢為 O(1) 且不持有任何鎖。
+ *       啟用持久目錄 (store.h) 時，new/change 同時寫進磁碟，重新啟動後的檔案在第一次被查詢時才載入記憶體。
+ */
+
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "filelock.h"
+
+// 檔案資訊結構：用來記錄伺服器上管理的檔案狀態
+// 建立後位址固定不變 (雜湊表只存指標)，因此可以在不持有分片鎖的情況下使用
+// 名稱、擁有者與群組建立後不再改變；權限只能透過 catalog_set_perms / catalog_get_perms 存取
+typedef struct FileEntry
+{
+    char name[50];         // 檔案名稱
+    char owner[50];        // 擁有者名稱
+    char group[50];        // 所屬群組
+    uint32_t uid;          // 擁有者 ID (principal.h)
+    uint32_t gid;          // 所屬群組 ID
+    atomic_uchar perm_bits; // 編譯後的權限位元 (perm_compile)，存取檢查只需要一次 atomic 讀取
+    atomic_uint meta_seq;  // perms 的 seqlock 序號 (奇數: 修改中)
+    char perms[10];        // 權限字串 (6碼，格式如 "rwrnnn"，代表 擁有者/群組/其他人 的 讀/寫 權限)
+    uint64_t hash;         // 檔名的雜湊值 (擴充時不必重新計算)
+    int64_t rec;           // 持久目錄中的記錄編號 (-1: 未持久化)
+    FileLock lock;         // 讀寫鎖：允許多個讀取者，寫入時獨佔 (取不到時排隊，不佔用執行緒)
+    FileLock inplace;      // 原地寫入與讀取的互斥範圍 (fdcache.h)：讀取者持有到回應送完
+
+    // fd 快取與已提交的版本 (fdcache.c 管理，由每個檔案自己的 fd_lock 保護；LRU 鏈結由 fdcache 的 LRU 鎖保護)
+    // 讀取者看到的內容是目前 inode 的前 size bytes；覆蓋寫入會換成新的 inode
+    pthread_mutex_t fd_lock;
+    struct FdHandle *fdh;  // 已開啟的 fd (NULL: 未快取)
+    struct FileEntry *lru_prev, *lru_next;
+    atomic_int lru_ref;    // 1: 上次逐出檢查之後被使用過 (命中時設定，不需要 LRU 鎖)
+    uint64_t size;         // 已提交的長度 (之後附加中的資料讀取者看不到)
+    atomic_uint version;   // 每次提交加 1 (0: 磁碟檔案尚未建立)；在 fd_lock 內修改，只讀版本號時不需要鎖
+    int replacing;         // 1: 正在 rename 成新的 inode，依檔名開檔可能拿到尚未提交的版本
+    struct ContentEntry *content; // 內容快取的槽位 (content.c 管理，由其 mutex 保護；NULL: 未快取)
+
+    _Atomic(struct CommitQueue *) commit; // 附加寫入的 group commit 佇列 (commit.c 管理，第一次 append 時以 CAS 發布)
+} FileEntry;
+
+// 初始化所有分片；store_path 不為 NULL 時開啟持久目錄 (sync = 1: new/change 回傳前等待 WAL 落地)
+// 開啟持久目錄失敗回傳 -1
+int catalog_init(const char *store_path, int sync);
+
+// 依檔名查詢，找不到回傳 NULL (尚未載入的持久記錄在此載入)
+FileEntry *catalog_find(const char *name);
+
+// 新增檔案；若檔名已存在則不修改，回傳既有的項目並將 *created 設為 0
+// 新項目回傳時檔案鎖已被呼叫者以整個檔案的寫鎖持有，建立磁碟檔案後再以 filelock_release(&file->lock, NULL) 釋放，
+// 避免其他執行緒在檔案尚未建立時就讀寫它
+FileEntry *catalog_insert(const char *name, const char *owner, const char *group, const char *perms,
+                          uint32_t uid, uint32_t gid, uint8_t perm_bits, int *created);
+
+// 目前管理的檔案數量 (包含尚未載入的持久記錄)
+size_t catalog_size(void);
+
+// 逐一走訪已載入記憶體的檔案 (不持有鎖，走訪期間新增的檔案可能不會出現)
+void catalog_foreach(void (*fn)(FileEntry *file, void *arg), void *arg);
+
+// catalog_list 的一筆結果
+typedef struct
+{
+    char name[50];
+    char owner[50];
+    char group[50];
+    char perms[10];
+} CatalogInfo;
+
+// 依檔名順序列出名稱以 prefix 開頭、且排在 after 之後的檔案 (after 為空字串時從頭開始)，最多 limit 筆
+// 包含尚未載入的持久記錄；結果依檔名排序寫入 out，回傳筆數，*more 設為之後是否還有符合的檔案
+// (下一頁以這一頁最後一個檔名作為 after，期間新增的檔案只要排在後面就會出現)
+int catalog_list(const char *prefix, const char *after, CatalogInfo *out, int limit, int *more);
+
+// 變更權限字串與編譯後的位元 (寫入者之間互斥)
+void catalog_set_perms(FileEntry *file, const char *perms, uint8_t perm_bits);
+
+// 讀取一致的權限字串 (perms 至少 10 bytes) 與位元，不持有鎖，不會讀到修改到一半的字串
+void catalog_get_perms(FileEntry *file, char *perms, uint8_t *perm_bits);
+
+#endif
@@ -1,71 +1,140 @@
 /*
  * client.c - 客戶端程式
  * 功能：連線至伺服器，發送使用者身分，並提供互動式指令介面。
+ *       建立在非同步客戶端函式庫 (fsclient.h) 之上：每個指令送出後以 FsFuture 等待最終回應，
+ *       中途通知 (正在被讀取/寫入、完成) 與 mread / mwrite 的每個檔案結果在收到時就顯示。
+ *       同一台機器上可以改連伺服器的 unix socket (-u)，並加上 -m 改用共享記憶體 ring 收送 frame。
+ *
+ * 用法: ./client [-h host] [-p port] [-u unix socket 路徑] [-m]
  */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <sys/socket.h>
-#include <arpa/inet.h>
+
+#include "fsclient.h"
 
 #define PORT 8888
 #define BUFFER_SIZE 1024
 
-int main()
+// mread / mwrite 其中一個檔案的結果 (ST_PART)：[檔名] 欄位、1 byte 狀態碼，之後為檔案內容或訊息
+static void print_part(const FsReply *r)
 {
-    int sock = 0;
-    struct sockaddr_in serv_addr;
-    char buffer[BUFFER_SIZE] = {0};
-    char user[50], group[50];
-
-    // 建立 Socket
-    if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    const unsigned char *p = (const unsigned char *)r->data;
+
+    if (r->len < 3)
+        return;
+    size_t nlen = (p[0] << 8) | p[1];
+    if (r->len < 3 + nlen)
+        return;
+    unsigned char file_status = p[2 + nlen];
+    size_t rest = r->len - 3 - nlen;
+    if (r->opcode == OP_MREAD && file_status == ST_OK)
+        printf("伺服器: %.*s 的內容 (%zu bytes):\n", (int)nlen, (const char *)p + 2, rest);
+    else
+        printf("伺服器: %.*s: ", (int)nlen, (const char *)p + 2);
+    fwrite(p + 3 + nlen, 1, rest, stdout);
+    printf("\n");
+}
+
+// list 的結果：每行一個檔案；FLAG_MORE 表示還有下一頁，以最後一個檔名作為 cursor
+static void print_list(const FsReply *r, const char *prefix)
+{
+    printf("%.*s", (int)r->len, r->len > 0 ? r->data : "(沒有符合的檔案)\n");
+    if ((r->flags & FLAG_MORE) && r->len > 0)
     {
-        printf("\n Socket creation error \n");
-        return -1;
+        // 最後一行的最後一個欄位是檔名
+        const char *end = r->data + r->len - 1, *name = end;
+        while (name > r->data && name[-1] != ' ')
+            name--;
+        printf("(還有更多檔案: list %s %.*s)\n", prefix[0] ? prefix : "*", (int)(end - name), name);
     }
+}
 
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(PORT);
-
-    // 將 IP 字串轉換為網路二進位格式
-    // 若要在不同電腦執行，請將 "127.0.0.1" 改為伺服器的實際 IP
-    if (inet_pton(AF_INET, "127.0.0.1", &serv_addr.sin_addr) <= 0)
+// 顯示一則回應 (在函式庫的 I/O 執行緒上執行，主執行緒此時在等這個請求完成)；arg 為 list 的前綴
+static void print_reply(const FsReply *r, void *arg)
+{
+    if (r->status == FS_ERR_CLOSED)
+        return;
+    if (r->status == ST_PART)
+        print_part(r);
+    else if (r->opcode == OP_LIST && r->status == ST_OK)
+        print_list(r, arg);
+    else if ((r->opcode == OP_READ || r->opcode == OP_STATS) && r->status == ST_OK)
     {
-        printf("\nInvalid address/ Address not supported \n");
-        return -1;
+        // 檔案內容與統計直接輸出，不受 buffer 大小限制
+        if (r->opcode == OP_READ)
+            printf("伺服器: 讀取內容 (%zu bytes):\n", r->len);
+        fwrite(r->data, 1, r->len, stdout);
+        printf("\n");
     }
+    else if (r->status == ST_ERR_REDIRECT) // 連到唯讀的複本：payload 為主伺服器的位址
+        printf("伺服器: 這是唯讀的複本，寫入請改連主伺服器 %.*s\n", (int)r->len, r->data);
+    else if (r->status == ST_ERR_STALE)
+        printf("伺服器: 複本的資料落後太久，請改連主伺服器 %.*s 讀取\n", (int)r->len, r->data);
+    else
+        printf("伺服器: %.*s\n", (int)r->len, r->data);
+}
+
+int main(int argc, char *argv[])
+{
+    char buffer[BUFFER_SIZE] = {0};
+    char user[50], group[50];
+    FsConfig cfg = {0};
+    int ch;
 
-    // 發起連線
-    if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+    cfg.host = "127.0.0.1";
+    cfg.port = PORT;
+    cfg.connections = 1; // 互動式介面一次只有一個指令
+    while ((ch = getopt(argc, argv, "h:p:u:m")) != -1)
     {
-        printf("\nConnection Failed \n");
-        return -1;
+        switch (ch)
+        {
+        case 'h':
+            cfg.host = optarg;
+            break;
+        case 'p':
+            cfg.port = atoi(optarg);
+            break;
+        case 'u':
+            cfg.unix_path = optarg;
+            break;
+        case 'm':
+            cfg.shm = 1;
+            break;
+        default:
+            fprintf(stderr, "用法: %s [-h host] [-p port] [-u unix socket 路徑] [-m 使用共享記憶體]\n", argv[0]);
+            return 1;
+        }
     }
 
     // 輸入使用者身分
     printf("請輸入你的名字: ");
-    scanf("%s", user);
+    scanf("%49s", user);
     printf("請輸入你的群組 (例如 AOS-group, CSE-group): ");
-    scanf("%s", group);
-
-    // 1. 傳送登入資訊給伺服器
-    sprintf(buffer, "%s %s", user, group);
-    send(sock, buffer, strlen(buffer), 0);
+    scanf("%49s", group);
 
-    // 2. 接收登入結果 (成功或失敗)
-    memset(buffer, 0, BUFFER_SIZE);
-    read(sock, buffer, BUFFER_SIZE);
+    // 連線並登入，顯示登入結果 (成功或失敗)
+    cfg.user = user;
+    cfg.group = group;
+    FsClient *cl = fs_client_open(&cfg, buffer, BUFFER_SIZE);
     printf("伺服器回應: %s\n", buffer);
+    if (!cl)
+        return -1;
 
     // 顯示操作說明
     printf("\n=== 指令說明 ===\n");
     printf("1. 建立檔案: new [檔名] [權限: rwrnnn]\n");
-    printf("2. 讀取檔案: read [檔名]\n");
-    printf("3. 寫入檔案: write [檔名] [模式: o(覆蓋)/a(附加)]\n");
+    printf("2. 讀取檔案: read [檔名] [起始位置] [長度] (省略位置與長度時讀取整個檔案)\n");
+    printf("3. 寫入檔案: write [檔名] [模式: o(覆蓋)/a(附加)] [資料] (省略資料時寫入一行簽名)\n");
+    printf("   原地寫入: write [檔名] p [起始位置] [資料] (只鎖定寫入的範圍，不同區段可以同時寫入)\n");
     printf("4. 變更權限: change [檔名] [權限]\n");
+    printf("5. 伺服器統計: stats\n");
+    printf("6. 列出檔案: list [前綴 (* 代表全部)] [cursor] (cursor 為上一頁最後一個檔名)\n");
+    printf("7. 檔案資訊: stat [檔名]\n");
+    printf("8. 多檔讀取: mread [檔名] [檔名] ...\n");
+    printf("9. 多檔寫入: mwrite [模式: o/a] [檔名] [檔名] ... (每個檔案寫入一行簽名)\n");
     printf("範例: new test.c rwrnnn\n");
     printf("輸入 'exit' 離開程式。\n\n");
 
@@ -78,7 +147,8 @@ int main()
         printf("> ");
         memset(buffer, 0, BUFFER_SIZE);
         // 使用 fgets 讀取整行，允許參數間有空格
-        fgets(buffer, BUFFER_SIZE, stdin);
+        if (!fgets(buffer, BUFFER_SIZE, stdin))
+            break;
 
         // 移除字串末端的換行符號
         buffer[strcspn(buffer, "\n")] = 0;
@@ -88,44 +158,86 @@ int main()
             break;
         }
 
-        // 傳送指令至伺服器
-        send(sock, buffer, strlen(buffer), 0);
-        printf("等待伺服器回應...\n");
+        // 解析指令：Cmd [Arg1] [Arg2]
+        char cmd[10] = "", arg1[50] = "", arg2[50] = "";
+        sscanf(buffer, "%9s %49s %49s", cmd, arg1, arg2);
 
-        // 接收並顯示執行結果
-        memset(buffer, 0, BUFFER_SIZE);
-        int valread = read(sock, buffer, BUFFER_SIZE);
-        if (valread > 0)
+        // 每個指令以 FsFuture 等待最終回應，收到的每則回應 (包含中途通知) 由 print_reply 顯示
+        FsFuture f;
+        int id;
+        fs_future_init(&f, print_reply, arg1);
+        printf("等待伺服器回應...\n");
+        if (strcmp(cmd, "new") == 0)
+            id = fs_new(cl, arg1, arg2, fs_future_resolve, &f);
+        else if (strcmp(cmd, "read") == 0)
         {
-            printf("伺服器: %s\n", buffer);
-            
-            // 檢查是否需要等待 (檔案正在被讀取或寫入)
-            if (strstr(buffer, "該檔案正在被讀取") != NULL || strstr(buffer, "該檔案正在被寫入") != NULL)
+            // read [檔名] [offset] [length]：省略時讀取整個檔案
+            unsigned long long offset = 0, length = 0;
+            sscanf(buffer, "%*s %*s %llu %llu", &offset, &length);
+            id = fs_read(cl, arg1, offset, length, fs_future_resolve, &f);
+        }
+        else if (strcmp(cmd, "write") == 0)
+        {
+            // write [檔名] [模式] [資料...]：模式之後的整行文字為寫入資料 (加上換行)
+            // write [檔名] p [offset] [資料...]：原地寫入模式在資料前多一個寫入位置
+            char line[BUFFER_SIZE + 1];
+            int data_pos = 0;
+            unsigned long long offset = 0;
+            if (strcmp(arg2, "p") == 0)
+                sscanf(buffer, "%*s %*s %*s %llu %n", &offset, &data_pos);
+            else
+                sscanf(buffer, "%*s %*s %*s %n", &data_pos);
+
+            if (data_pos > 0 && buffer[data_pos] != '\0')
             {
-                // 等待第二次回應 (讀取完成或寫入完成)
-                memset(buffer, 0, BUFFER_SIZE);
-                valread = read(sock, buffer, BUFFER_SIZE);
-                if (valread > 0)
-                {
-                    printf("伺服器: %s\n", buffer);
-                    
-                    // 接收最終的執行結果
-                    memset(buffer, 0, BUFFER_SIZE);
-                    valread = read(sock, buffer, BUFFER_SIZE);
-                    if (valread > 0)
-                    {
-                        printf("伺服器: %s\n", buffer);
-                    }
-                }
+                int n = snprintf(line, sizeof(line), "%s\n", buffer + data_pos);
+                id = fs_write(cl, arg1, arg2, offset, line, n, fs_future_resolve, &f);
             }
+            else
+                id = fs_write(cl, arg1, arg2, offset, NULL, 0, fs_future_resolve, &f);
+        }
+        else if (strcmp(cmd, "change") == 0)
+            id = fs_change(cl, arg1, arg2, fs_future_resolve, &f);
+        else if (strcmp(cmd, "stats") == 0)
+            id = fs_stats(cl, fs_future_resolve, &f);
+        else if (strcmp(cmd, "list") == 0)
+        {
+            // list [前綴] [cursor]：* 代表不過濾
+            if (strcmp(arg1, "*") == 0)
+                arg1[0] = '\0';
+            id = fs_list(cl, arg1, arg2, 0, fs_future_resolve, &f);
+        }
+        else if (strcmp(cmd, "stat") == 0)
+            id = fs_stat(cl, arg1, fs_future_resolve, &f);
+        else if (strcmp(cmd, "mread") == 0 || strcmp(cmd, "mwrite") == 0)
+        {
+            // mread [檔名...]；mwrite [模式] [檔名...] (每個檔案寫入一行簽名)
+            const char *names[BUFFER_SIZE / 2], *mode = NULL;
+            int n = 0, mwrite = cmd[1] == 'w';
+            char *save, *tok = strtok_r(buffer, " ", &save);
+            if (mwrite)
+                mode = strtok_r(NULL, " ", &save);
+            while ((tok = strtok_r(NULL, " ", &save)) != NULL)
+                names[n++] = tok;
+            id = mwrite ? fs_mwrite(cl, mode, n, names, NULL, NULL, fs_future_resolve, &f)
+                        : fs_mread(cl, n, names, fs_future_resolve, &f);
         }
         else
+        {
+            printf("無效指令。\n");
+            fs_future_destroy(&f);
+            continue;
+        }
+
+        int status = id < 0 ? FS_ERR_CLOSED : fs_future_wait(&f);
+        fs_future_destroy(&f);
+        if (status == FS_ERR_CLOSED)
         {
             printf("伺服器已斷線。\n");
             break;
         }
     }
 
-    close(sock);
+    fs_client_close(cl);
     return 0;
-}
\ No newline at end of file
+}
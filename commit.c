@@ -0,0 +1,334 @@
+/*
+ * commit.c - 附加寫入的 group commit
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+#include "commit.h"
+#include "fdcache.h"
+#include "pool.h"
+#include "replica.h"
+
+// 每個檔案一個 commit 佇列 (第一次 append 時建立，之後不釋放)
+typedef struct CommitQueue
+{
+    pthread_mutex_t lock;
+    CommitItem *head, *tail; // 等待下一批的請求
+    int running;             // 1: 已有 leader 在處理，新請求只需排隊
+    CommitItem *batch;       // 正在處理 (等待檔案鎖或寫入中) 的一批
+    LockWaiter waiter;       // 等待檔案寫鎖的 continuation (範圍為要求時的檔尾到檔案結尾)
+    PoolNode task;           // 把下一批交給工作執行緒時使用的節點
+} CommitQueue;
+
+// 寫完、等待 fdatasync 的一批請求 (DURABILITY_INTERVAL)
+typedef struct SyncBatch
+{
+    struct SyncBatch *next;
+    FdHandle *fdh;
+    CommitItem *items;
+    int ok; // 同步結果
+} SyncBatch;
+
+static Durability policy = DURABILITY_NONE;
+static int interval_ms = COMMIT_DEFAULT_INTERVAL_MS;
+static int write_delay;
+
+static pthread_mutex_t sync_mutex = PTHREAD_MUTEX_INITIALIZER;
+static SyncBatch *sync_head; // 下一輪要同步的批次
+
+static void finish_items(CommitItem *items, int ok)
+{
+    while (items)
+    {
+        CommitItem *next = items->next; // on_done 之後 item 可能已被釋放
+        if (!ok)
+            items->ok = 0;
+        items->on_done(items);
+        items = next;
+    }
+}
+
+// DURABILITY_INTERVAL：每隔 interval_ms 同步一次這段期間寫過的檔案，同一個 fd 每輪只同步一次
+static void *sync_thread(void *arg)
+{
+    (void)arg;
+    for (;;)
+    {
+        usleep(interval_ms * 1000);
+
+        pthread_mutex_lock(&sync_mutex);
+        SyncBatch *list = sync_head;
+        sync_head = NULL;
+        pthread_mutex_unlock(&sync_mutex);
+
+        for (SyncBatch *b = list; b; b = b->next)
+        {
+            SyncBatch *p = list;
+            while (p != b && p->fdh != b->fdh)
+                p = p->next;
+            b->ok = p != b ? p->ok : fdatasync(b->fdh->fd) == 0; // 同一輪已同步過的 fd 沿用結果
+            finish_items(b->items, b->ok);
+        }
+        while (list)
+        {
+            SyncBatch *next = list->next;
+            fdcache_release(list->fdh);
+            free(list);
+            list = next;
+        }
+    }
+    return NULL;
+}
+
+void commit_init(Durability p, int ms, int delay)
+{
+    policy = p;
+    interval_ms = ms > 0 ? ms : COMMIT_DEFAULT_INTERVAL_MS;
+    write_delay = delay;
+    if (policy == DURABILITY_INTERVAL)
+    {
+        pthread_t tid;
+        pthread_create(&tid, NULL, sync_thread, NULL);
+        pthread_detach(tid);
+    }
+}
+
+int commit_parse_policy(const char *name)
+{
+    if (strcmp(name, "none") == 0)
+        return DURABILITY_NONE;
+    if (strcmp(name, "batch") == 0)
+        return DURABILITY_BATCH;
+    if (strcmp(name, "interval") == 0)
+        return DURABILITY_INTERVAL;
+    return -1;
+}
+
+// 已建立時只需要一次 atomic 讀取；同時建立的執行緒以 CAS 決定誰的佇列生效，輸的一方釋放自己的
+static CommitQueue *queue_of(FileEntry *file)
+{
+    CommitQueue *q = atomic_load_explicit(&file->commit, memory_order_acquire);
+    if (q)
+        return q;
+
+    CommitQueue *fresh = calloc(1, sizeof(CommitQueue));
+    pthread_mutex_init(&fresh->lock, NULL);
+    if (atomic_compare_exchange_strong_explicit(&file->commit, &q, fresh, memory_order_acq_rel,
+                                                memory_order_acquire))
+        return fresh;
+    pthread_mutex_destroy(&fresh->lock);
+    free(fresh);
+    return q;
+}
+
+// 把一批請求寫到已提交長度之後：記憶體中的資料合併成一次 pwritev，已存入暫存檔的資料在核心內複製
+// 成功時 *end 為新的長度 (失敗時不提交，下一批會覆蓋寫了一半的資料)
+static int write_batch(CommitItem *items, int fd, off_t off, uint64_t *end)
+{
+    struct iovec *iov = NULL;
+    int cnt = 0, cap = 0;
+    size_t pending = 0;
+    int ret = 0;
+
+    for (CommitItem *it = items; it && ret == 0; it = it->next)
+    {
+        struct iovec *uiov;
+        int ucnt;
+        if (!upload_memory_iov(it->upload, &uiov, &ucnt))
+        {
+            // 先寫出前面累積的資料，維持請求的順序
+            if (cnt > 0 && pwritev_full(fd, iov, cnt, off) < 0)
+                ret = -1;
+            off += pending;
+            cnt = 0;
+            pending = 0;
+            if (ret == 0 && upload_write_at(it->upload, fd, off) < 0)
+                ret = -1;
+            off += upload_size(it->upload);
+            continue;
+        }
+        if (cnt + ucnt > cap)
+        {
+            cap = (cnt + ucnt) * 2;
+            iov = realloc(iov, cap * sizeof(struct iovec));
+        }
+        memcpy(iov + cnt, uiov, ucnt * sizeof(struct iovec));
+        cnt += ucnt;
+        pending += upload_size(it->upload);
+    }
+    if (ret == 0 && cnt > 0 && pwritev_full(fd, iov, cnt, off) < 0)
+        ret = -1;
+    free(iov);
+    *end = off + pending;
+    return ret;
+}
+
+// 寫完的一批依持久化策略落地後呼叫每個 on_done (fdh 的參考由此釋放；ok = 0 時直接回報失敗)
+static void sync_batch(FdHandle *fdh, CommitItem *items, int ok)
+{
+    if (ok && policy == DURABILITY_INTERVAL)
+    {
+        SyncBatch *b = malloc(sizeof(SyncBatch));
+        b->fdh = fdh;
+        b->items = items;
+        pthread_mutex_lock(&sync_mutex);
+        b->next = sync_head;
+        sync_head = b;
+        pthread_mutex_unlock(&sync_mutex);
+        return;
+    }
+    if (ok && policy == DURABILITY_BATCH)
+        ok = fdatasync(fdh->fd) == 0;
+    if (fdh)
+        fdcache_release(fdh);
+    finish_items(items, ok);
+}
+
+void commit_sync(FdHandle *fdh, CommitItem *items)
+{
+    for (CommitItem *it = items; it; it = it->next)
+        it->ok = 1;
+    sync_batch(fdh, items, 1);
+}
+
+static void drain_task(void *arg);
+
+// 取得寫鎖後處理一批請求，完成後繼續處理期間排進來的請求
+static void batch_locked(FileEntry *file)
+{
+    CommitQueue *q = file->commit;
+    CommitItem *items = q->batch;
+
+    // 鎖定範圍從要求鎖時的檔尾開始；等待期間被覆蓋成較短的內容時，改要求涵蓋新檔尾的範圍
+    uint64_t committed;
+    fdcache_version(file, &committed);
+    if (committed < q->waiter.start)
+    {
+        filelock_release(&file->lock, &q->waiter);
+        q->waiter.start = committed;
+        if (filelock_acquire(&file->lock, &q->waiter) == 0)
+            batch_locked(file);
+        return;
+    }
+
+    int n = 0;
+    for (CommitItem *it = items; it; it = it->next)
+        n++;
+
+    printf("[Write] %s 批次寫入 %d 筆... (模擬延遲耗時 %d 秒)\n", file->name, n, write_delay);
+    sleep(write_delay); // 模擬寫入耗時，整批只等一次
+
+    time_t now = time(NULL);
+    struct tm t;
+    char time_str[64];
+    localtime_r(&now, &t);
+    strftime(time_str, sizeof(time_str), "%Y/%m/%d-%H:%M:%S", &t);
+
+    // 沒有客戶端資料：寫入的資訊格式: xxx wrote here at xx/xx/xx-xx:xx:xx.
+    for (CommitItem *it = items; it; it = it->next)
+    {
+        snprintf(it->time_str, sizeof(it->time_str), "%s", time_str);
+        it->ok = 1;
+        if (!it->upload)
+        {
+            char line[128];
+            int len = snprintf(line, sizeof(line), "%s wrote here at %s.\n", it->user, time_str);
+            it->upload = upload_new(file->name);
+            upload_append(it->upload, line, len);
+        }
+    }
+
+    // 寫完後才提交新長度，讀取者在那之前只會看到上一個版本
+    uint64_t size, end;
+    FdHandle *fdh = fdcache_snapshot(file, &size, NULL);
+    int ok = fdh && write_batch(items, fdh->fd, size, &end) == 0;
+    if (ok)
+    {
+        fdcache_commit(file, end);
+        replica_log_write(file, size, end - size); // 在釋放鎖之前記錄，與同一檔案其他寫入的順序一致
+    }
+    filelock_release(&file->lock, &q->waiter); // 釋放鎖，同步在鎖外進行
+    sync_batch(fdh, items, ok);
+
+    // 處理期間又有新請求排進來：交給工作執行緒處理下一批 (不在目前的執行緒繼續，這裡可能是鎖的 continuation)
+    pthread_mutex_lock(&q->lock);
+    if (!q->head)
+    {
+        q->running = 0;
+        pthread_mutex_unlock(&q->lock);
+        return;
+    }
+    pthread_mutex_unlock(&q->lock);
+    pool_continue(&q->task, drain_task, file);
+}
+
+// 這一批開始等待檔案鎖：通知每個請求目前的排隊順位
+static void batch_queued(void *arg, int position, int behind_writer)
+{
+    FileEntry *file = arg;
+    for (CommitItem *it = file->commit->batch; it; it = it->next)
+        if (it->on_wait)
+            it->on_wait(it, position, behind_writer);
+}
+
+// 等待的檔案鎖已授予 (在工作執行緒上)
+static void batch_granted(void *arg)
+{
+    FileEntry *file = arg;
+    for (CommitItem *it = file->commit->batch; it; it = it->next)
+        if (it->on_wait)
+            it->on_wait(it, 0, 0);
+    batch_locked(file);
+}
+
+// leader 取出佇列中目前所有的請求作為一批，並要求從目前檔尾到檔案結尾的寫鎖
+// (檔尾之前的原地寫入與讀取不受影響)；鎖被佔用時整批排進檔案鎖的等待佇列，不佔用目前的執行緒
+static void drain_task(void *arg)
+{
+    FileEntry *file = arg;
+    CommitQueue *q = file->commit;
+
+    pthread_mutex_lock(&q->lock);
+    q->batch = q->head;
+    q->head = q->tail = NULL;
+    pthread_mutex_unlock(&q->lock);
+
+    q->waiter.exclusive = 1;
+    fdcache_version(file, &q->waiter.start);
+    q->waiter.end = FILELOCK_EOF;
+    q->waiter.granted = batch_granted;
+    q->waiter.queued = batch_queued;
+    q->waiter.arg = file;
+    if (filelock_acquire(&file->lock, &q->waiter) == 0)
+        batch_locked(file);
+}
+
+void commit_append(FileEntry *file, CommitItem *item)
+{
+    CommitQueue *q = queue_of(file);
+
+    item->next = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->tail)
+        q->tail->next = item;
+    else
+        q->head = item;
+    q->tail = item;
+    if (q->running)
+    {
+        // 已有 leader：會在下一批處理這個請求
+        pthread_mutex_unlock(&q->lock);
+        return;
+    }
+    q->running = 1;
+    pthread_mutex_unlock(&q->lock);
+
+    drain_task(file);
+}
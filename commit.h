@@ -0,0 +1,55 @@
+/*
+ * commit.h - 附加寫入的 group commit
+ * 功能：同一個檔案上同時等待的 append 請求合併成一批，由一個執行緒 (leader) 取得寫鎖後
+ *       以一次 pwritev 寫到檔尾，再依持久化策略決定何時 fdatasync 並回覆每個請求。
+ *       其他請求 (follower) 只把資料排進佇列就返回；leader 等待檔案鎖時也不佔用工作執行緒 (filelock.h)。
+ */
+
+#ifndef COMMIT_H
+#define COMMIT_H
+
+#include "catalog.h"
+#include "fdcache.h"
+#include "upload.h"
+
+// 持久化策略：回覆客戶端「寫入成功」之前資料要落地到什麼程度
+typedef enum
+{
+    DURABILITY_NONE,    // 寫進 page cache 就回覆 (不 fdatasync)
+    DURABILITY_BATCH,   // 每一批寫入後 fdatasync 一次再回覆
+    DURABILITY_INTERVAL // 由背景執行緒每隔固定時間 fdatasync 所有寫過的檔案，之後再回覆這段期間的請求
+} Durability;
+
+#define COMMIT_DEFAULT_INTERVAL_MS 10 // DURABILITY_INTERVAL 預設的同步間隔
+
+// 一個 append 請求 (由呼叫者配置，on_done 被呼叫之前不可釋放)
+typedef struct CommitItem
+{
+    struct CommitItem *next;
+    Upload *upload;     // 要附加的資料；NULL 表示寫入簽名行 "user wrote here at 時間."
+    const char *user;   // 簽名行的使用者名稱
+    void *arg;          // 呼叫者自訂資料
+
+    // 檔案鎖被佔用時呼叫：position > 0 為排隊順位 (behind_writer = 1 表示目前由寫入者持有)，0 表示已取得鎖
+    void (*on_wait)(struct CommitItem *item, int position, int behind_writer);
+    // 請求完成 (可能在任何執行緒上，包含 commit_append 返回之前)
+    void (*on_done)(struct CommitItem *item);
+
+    int ok;             // 結果：1 成功、0 I/O 錯誤
+    char time_str[64];  // 寫入時間
+} CommitItem;
+
+// 設定持久化策略、同步間隔與模擬的寫入延遲 (秒，每批一次)
+void commit_init(Durability policy, int interval_ms, int write_delay);
+
+// 把 item 排進檔案的 commit 佇列；沒有其他 leader 時由目前的執行緒處理整批
+void commit_append(FileEntry *file, CommitItem *item);
+
+// 呼叫者已自行寫完並提交 items 的資料 (例如持有整個檔案寫鎖的 mwrite)：依同樣的持久化策略落地後呼叫每個 on_done
+// fdh 是寫入的 fd，參考交給此函式 (同步完成後釋放)；應在釋放檔案鎖之後呼叫
+void commit_sync(FdHandle *fdh, CommitItem *items);
+
+// 解析策略名稱 "none" / "batch" / "interval"，不認識時回傳 -1
+int commit_parse_policy(const char *name);
+
+#endif
@@ -0,0 +1,162 @@
+/*
+ * content.c - 熱門小檔案的內容快取 (CLOCK 淘汰)
+ * 功能：固定數量的槽位排成環狀，讀取命中時只設定 referenced；需要空間時指針繞行，
+ *       referenced 的項目清除標記給第二次機會，沒有的就淘汰。檔案內容的讀取在鎖外執行。
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "content.h"
+#include "fdcache.h"
+
+#define CONTENT_SLOTS 4096 // 最多同時快取的檔案數
+
+typedef struct ContentEntry
+{
+    FileEntry *file; // NULL: 空槽位
+    ContentBuf *buf;
+    int referenced;  // CLOCK 的參考位元
+} ContentEntry;
+
+static pthread_mutex_t content_mutex = PTHREAD_MUTEX_INITIALIZER;
+static ContentEntry slots[CONTENT_SLOTS];
+static int hand;                                      // CLOCK 指針
+static size_t used, capacity = CONTENT_DEFAULT_CAPACITY; // 目前與上限的 bytes 數
+static atomic_uint_least64_t hits, misses;
+
+void content_init(size_t cap)
+{
+    capacity = cap;
+}
+
+void content_release(void *buf)
+{
+    ContentBuf *cb = buf;
+    if (atomic_fetch_sub_explicit(&cb->refs, 1, memory_order_acq_rel) == 1)
+        free(cb);
+}
+
+// 移除槽位中的項目，回傳要在鎖外釋放的緩衝區 (呼叫者持有 content_mutex)
+static ContentBuf *drop_locked(ContentEntry *e)
+{
+    ContentBuf *cb = e->buf;
+
+    e->file->content = NULL;
+    e->file = NULL;
+    e->buf = NULL;
+    used -= cb->len;
+    return cb;
+}
+
+ContentBuf *content_get(FileEntry *file)
+{
+    ContentBuf *cb = NULL;
+
+    if (capacity == 0)
+        return NULL;
+    pthread_mutex_lock(&content_mutex);
+    ContentEntry *e = file->content;
+    if (e)
+    {
+        e->referenced = 1;
+        cb = e->buf;
+        atomic_fetch_add_explicit(&cb->refs, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&content_mutex);
+
+    atomic_fetch_add_explicit(cb ? &hits : &misses, 1, memory_order_relaxed);
+    return cb;
+}
+
+ContentBuf *content_load(FileEntry *file, int fd, uint64_t size, uint32_t version)
+{
+    if (capacity == 0 || size > CONTENT_MAX_FILE || size > capacity)
+        return NULL;
+
+    // 在鎖外讀入：快照的 inode 前 size bytes 在這個版本內不會改變
+    ContentBuf *cb = malloc(sizeof(ContentBuf) + size);
+    atomic_init(&cb->refs, 1);
+    cb->version = version;
+    cb->len = size;
+    for (size_t done = 0; done < size;)
+    {
+        ssize_t n = pread(fd, cb->data + done, size - done, done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            free(cb);
+            return NULL;
+        }
+        done += n;
+    }
+
+    ContentBuf *victims[CONTENT_SLOTS + 1];
+    int nvictims = 0;
+
+    pthread_mutex_lock(&content_mutex);
+    // 讀取期間已提交新版本：這份內容已經過時，只給這次讀取使用
+    // (提交者在改版本之後才呼叫 content_invalidate，所以先檢查版本再放入不會留下過時的內容；
+    //  只讀版本號是一次 atomic 讀取，不會在 content_mutex 內再取得其他鎖)
+    if (fdcache_version(file, NULL) != version || (file->content && file->content->buf->version >= version))
+    {
+        pthread_mutex_unlock(&content_mutex);
+        return cb;
+    }
+    if (file->content)
+        victims[nvictims++] = drop_locked(file->content);
+
+    // CLOCK：繞行直到空出足夠的 bytes 並找到空槽位 (最多兩圈：第一圈清除參考位元，第二圈淘汰)
+    ContentEntry *e;
+    for (;;)
+    {
+        e = &slots[hand];
+        hand = (hand + 1) % CONTENT_SLOTS;
+        if (e->file && e->referenced)
+        {
+            e->referenced = 0;
+            continue;
+        }
+        if (e->file)
+            victims[nvictims++] = drop_locked(e);
+        if (used + size <= capacity)
+            break;
+    }
+    e->file = file;
+    e->buf = cb;
+    e->referenced = 1;
+    file->content = e;
+    used += size;
+    atomic_fetch_add_explicit(&cb->refs, 1, memory_order_relaxed); // 快取持有的參考
+    pthread_mutex_unlock(&content_mutex);
+
+    for (int i = 0; i < nvictims; i++)
+        content_release(victims[i]);
+    return cb;
+}
+
+void content_invalidate(FileEntry *file)
+{
+    ContentBuf *cb = NULL;
+
+    pthread_mutex_lock(&content_mutex);
+    if (file->content)
+        cb = drop_locked(file->content);
+    pthread_mutex_unlock(&content_mutex);
+
+    // 仍在送出舊內容的回應各自持有參考，送完才釋放
+    if (cb)
+        content_release(cb);
+}
+
+void content_stats(uint64_t *hit, uint64_t *miss, size_t *bytes)
+{
+    *hit = atomic_load_explicit(&hits, memory_order_relaxed);
+    *miss = atomic_load_explicit(&misses, memory_order_relaxed);
+    pthread_mutex_lock(&content_mutex);
+    *bytes = used;
+    pthread_mutex_unlock(&content_mutex);
+}
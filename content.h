@@ -0,0 +1,50 @@
+/*
+ * content.h - 熱門小檔案的內容快取 (CLOCK 淘汰)
+ * 功能：read 未命中時把最後提交的版本整個讀進一塊不可變的緩衝區，之後的讀取直接從記憶體送出，
+ *       不必再 open / sendfile。緩衝區以參考計數共用：同一個檔案的所有讀取者 (包含尚未送完的回應)
+ *       共用同一份資料，最多只複製一次。
+ *       寫入在持有檔案寫鎖、提交新版本時 (fdcache.c) 讓快取失效，下一次讀取再載入新內容。
+ *       快取總大小有上限，超過時以 CLOCK 演算法淘汰最近沒被讀取的檔案。
+ */
+
+#ifndef CONTENT_H
+#define CONTENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "catalog.h"
+
+#define CONTENT_DEFAULT_CAPACITY (64 << 20) // 預設快取總大小 (bytes)
+#define CONTENT_MAX_FILE (1 << 20)          // 超過這個大小的檔案不快取 (直接 sendfile)
+
+// 一個檔案版本的完整內容 (建立後不再修改)
+typedef struct ContentBuf
+{
+    atomic_int refs;  // 快取本身 1 個 + 每個使用者各 1 個
+    uint32_t version; // 對應 FileEntry.version
+    size_t len;
+    char data[];
+} ContentBuf;
+
+// 設定快取總大小 (0: 停用)
+void content_init(size_t capacity);
+
+// 查詢檔案目前快取的內容，命中時回傳一個參考 (用完以 content_release 釋放)，未命中回傳 NULL
+ContentBuf *content_get(FileEntry *file);
+
+// 從 fd 讀入版本 version 的前 size bytes 並放進快取，回傳一個參考
+// 停用、檔案太大或讀取失敗時回傳 NULL (呼叫者改用 sendfile)
+ContentBuf *content_load(FileEntry *file, int fd, uint64_t size, uint32_t version);
+
+// 釋放參考 (參數型別為 void * 以便作為輸出佇列的 ReleaseFunc)
+void content_release(void *buf);
+
+// 讓檔案的快取失效 (提交新版本時呼叫，呼叫者持有檔案寫鎖)
+void content_invalidate(FileEntry *file);
+
+// 統計：命中、未命中次數與目前快取的 bytes 數
+void content_stats(uint64_t *hits, uint64_t *misses, size_t *bytes);
+
+#endif
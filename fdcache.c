@@ -0,0 +1,278 @@
+/*
+ * fdcache.c - 已開啟檔案描述元的 LRU 快取
+ * 功能：雙向鏈結串列，最近使用的在前端；所有操作的臨界區都只有幾個指標操作，close 在鎖外執行。
+ *       每個檔案的 fd 與版本由 FileEntry.fd_lock 保護，lru_mutex 只保護鏈結串列與計數；
+ *       命中時不取得 lru_mutex，只設定 lru_ref，逐出時被設定的項目移回前端 (第二次機會)。
+ *       同時需要兩個鎖時的順序：lru_mutex -> fd_lock。
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "fdcache.h"
+#include "content.h"
+
+static pthread_mutex_t lru_mutex = PTHREAD_MUTEX_INITIALIZER;
+static FileEntry *lru_head, *lru_tail; // 前端為最近使用
+static atomic_int cached;              // 快取中的 fd 數 (在 lru_mutex 內修改)
+static int capacity = FDCACHE_DEFAULT_CAPACITY;
+
+void fdcache_init(int cap)
+{
+    capacity = cap > 0 ? cap : 1;
+}
+
+static void lru_unlink(FileEntry *file)
+{
+    if (file->lru_prev)
+        file->lru_prev->lru_next = file->lru_next;
+    else
+        lru_head = file->lru_next;
+    if (file->lru_next)
+        file->lru_next->lru_prev = file->lru_prev;
+    else
+        lru_tail = file->lru_prev;
+    file->lru_prev = file->lru_next = NULL;
+}
+
+static void lru_push_front(FileEntry *file)
+{
+    file->lru_prev = NULL;
+    file->lru_next = lru_head;
+    if (lru_head)
+        lru_head->lru_prev = file;
+    lru_head = file;
+    if (!lru_tail)
+        lru_tail = file;
+}
+
+// 從快取移除檔案的 fd，回傳需要在鎖外關閉的 handle (仍有使用者時回傳 NULL)
+// 呼叫者持有 lru_mutex 與 file->fd_lock
+static FdHandle *detach_locked(FileEntry *file)
+{
+    FdHandle *h = file->fdh;
+
+    if (!h)
+        return NULL;
+    lru_unlink(file);
+    file->fdh = NULL;
+    atomic_fetch_sub_explicit(&cached, 1, memory_order_relaxed);
+    return atomic_fetch_sub_explicit(&h->refs, 1, memory_order_acq_rel) == 1 ? h : NULL;
+}
+
+static void handle_close(FdHandle *h)
+{
+    if (h)
+    {
+        close(h->fd);
+        free(h);
+    }
+}
+
+// 逐出最久未使用的 n 個 fd (每批最多 64 個，close 在鎖外執行)
+// 尾端的項目上次檢查之後被使用過時清除標記、移回前端；每批最多走過兩倍快取數量的項目
+static void evict(int n)
+{
+    while (n > 0)
+    {
+        FdHandle *victims[64];
+        int cnt = 0, dropped = 0;
+
+        pthread_mutex_lock(&lru_mutex);
+        int steps = 2 * atomic_load_explicit(&cached, memory_order_relaxed);
+        while (dropped < n && dropped < 64 && lru_tail && steps-- > 0)
+        {
+            FileEntry *file = lru_tail;
+            if (atomic_exchange_explicit(&file->lru_ref, 0, memory_order_relaxed))
+            {
+                lru_unlink(file);
+                lru_push_front(file);
+                continue;
+            }
+            pthread_mutex_lock(&file->fd_lock);
+            FdHandle *h = detach_locked(file);
+            pthread_mutex_unlock(&file->fd_lock);
+            if (h)
+                victims[cnt++] = h;
+            dropped++;
+        }
+        pthread_mutex_unlock(&lru_mutex);
+
+        for (int i = 0; i < cnt; i++)
+            handle_close(victims[i]);
+        if (dropped == 0)
+            break; // 快取已空
+        n -= dropped;
+    }
+}
+
+// 放入快取並回傳一個給呼叫者的參考 (呼叫者持有 lru_mutex 與 file->fd_lock)
+static FdHandle *install_locked(FileEntry *file, FdHandle *h, FdHandle **old)
+{
+    *old = detach_locked(file);
+    atomic_init(&h->refs, 2); // 快取 1 + 呼叫者 1
+    file->fdh = h;
+    lru_push_front(file);
+    atomic_fetch_add_explicit(&cached, 1, memory_order_relaxed);
+    return h;
+}
+
+// 取得目前版本的 fd 與長度：命中時只取得這個檔案的鎖並增加參考計數；未命中時依檔名開檔
+static FdHandle *acquire(FileEntry *file, uint64_t *size, uint32_t *version_out)
+{
+    FdHandle *h, *old;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&file->fd_lock);
+        uint32_t version = atomic_load_explicit(&file->version, memory_order_relaxed);
+        if (version == 0)
+        {
+            pthread_mutex_unlock(&file->fd_lock);
+            errno = ENOENT;
+            return NULL;
+        }
+        if ((h = file->fdh) != NULL)
+        {
+            // 命中：只標記最近使用過，不需要 LRU 鎖或任何系統呼叫
+            atomic_fetch_add_explicit(&h->refs, 1, memory_order_relaxed);
+            *size = file->size;
+            *version_out = version;
+            pthread_mutex_unlock(&file->fd_lock);
+            if (!atomic_load_explicit(&file->lru_ref, memory_order_relaxed))
+                atomic_store_explicit(&file->lru_ref, 1, memory_order_relaxed);
+            return h;
+        }
+        int replacing = file->replacing;
+        pthread_mutex_unlock(&file->fd_lock);
+
+        if (replacing)
+        {
+            // rename 很快就會完成，稍等後重新取得
+            sched_yield();
+            continue;
+        }
+
+        // 未命中：在鎖外開檔；fd 用完時先逐出一半的快取再試一次
+        int fd = open(file->name, O_RDWR | O_CLOEXEC);
+        if (fd < 0 && (errno == EMFILE || errno == ENFILE))
+        {
+            evict(atomic_load_explicit(&cached, memory_order_relaxed) / 2 + 1);
+            fd = open(file->name, O_RDWR | O_CLOEXEC);
+        }
+        if (fd < 0)
+            return NULL;
+
+        pthread_mutex_lock(&lru_mutex);
+        pthread_mutex_lock(&file->fd_lock);
+        if (file->fdh != NULL || atomic_load_explicit(&file->version, memory_order_relaxed) != version ||
+            file->replacing)
+        {
+            // 其他執行緒同時開好了，或開檔期間換了版本 (可能開到新 inode)：重新取得
+            pthread_mutex_unlock(&file->fd_lock);
+            pthread_mutex_unlock(&lru_mutex);
+            close(fd);
+            continue;
+        }
+        h = malloc(sizeof(FdHandle));
+        h->fd = fd;
+        install_locked(file, h, &old);
+        *size = file->size;
+        *version_out = version;
+        pthread_mutex_unlock(&file->fd_lock);
+        int over = atomic_load_explicit(&cached, memory_order_relaxed) - capacity;
+        pthread_mutex_unlock(&lru_mutex);
+
+        handle_close(old);
+        if (over > 0)
+            evict(over);
+        return h;
+    }
+}
+
+FdHandle *fdcache_acquire(FileEntry *file)
+{
+    uint64_t size;
+    uint32_t version;
+    return acquire(file, &size, &version);
+}
+
+FdHandle *fdcache_snapshot(FileEntry *file, uint64_t *size, uint32_t *version)
+{
+    uint32_t v;
+    return acquire(file, size, version ? version : &v);
+}
+
+uint32_t fdcache_version(FileEntry *file, uint64_t *size)
+{
+    if (!size)
+        return atomic_load_explicit(&file->version, memory_order_acquire);
+
+    pthread_mutex_lock(&file->fd_lock);
+    uint32_t version = atomic_load_explicit(&file->version, memory_order_relaxed);
+    *size = file->size;
+    pthread_mutex_unlock(&file->fd_lock);
+    return version;
+}
+
+void fdcache_release(void *handle)
+{
+    FdHandle *h = (FdHandle *)handle;
+
+    if (atomic_fetch_sub_explicit(&h->refs, 1, memory_order_acq_rel) == 1)
+        handle_close(h);
+}
+
+void fdcache_commit(FileEntry *file, uint64_t size)
+{
+    pthread_mutex_lock(&file->fd_lock);
+    if (size > file->size)
+        file->size = size;
+    atomic_fetch_add_explicit(&file->version, 1, memory_order_release);
+    pthread_mutex_unlock(&file->fd_lock);
+    content_invalidate(file);
+}
+
+void fdcache_begin_replace(FileEntry *file)
+{
+    pthread_mutex_lock(&file->fd_lock);
+    file->replacing = 1;
+    atomic_fetch_add_explicit(&file->version, 1, memory_order_release);
+    pthread_mutex_unlock(&file->fd_lock);
+    content_invalidate(file);
+}
+
+void fdcache_abort_replace(FileEntry *file)
+{
+    pthread_mutex_lock(&file->fd_lock);
+    file->replacing = 0;
+    pthread_mutex_unlock(&file->fd_lock);
+}
+
+void fdcache_install(FileEntry *file, int fd, uint64_t size)
+{
+    FdHandle *h, *old = NULL;
+
+    // 舊版本的 fd 由快取移除，仍在讀取舊內容的使用者釋放參考後才關閉
+    h = malloc(sizeof(FdHandle));
+    h->fd = fd;
+    pthread_mutex_lock(&lru_mutex);
+    pthread_mutex_lock(&file->fd_lock);
+    file->replacing = 0;
+    atomic_fetch_add_explicit(&file->version, 1, memory_order_release);
+    install_locked(file, h, &old);
+    atomic_fetch_sub_explicit(&h->refs, 1, memory_order_relaxed); // 呼叫者不保留參考
+    file->size = size;
+    pthread_mutex_unlock(&file->fd_lock);
+    int over = atomic_load_explicit(&cached, memory_order_relaxed) - capacity;
+    pthread_mutex_unlock(&lru_mutex);
+
+    content_invalidate(file);
+    handle_close(old);
+    if (over > 0)
+        evict(over);
+}
@@ -0,0 +1,64 @@
+/*
+ * fdcache.h - 已開啟檔案描述元的 LRU 快取
+ * 功能：每個 FileEntry 最多快取一個以 O_RDWR 開啟的 fd，讀寫都用 pread/pwrite/sendfile (不移動檔案位置)，
+ *       熱門檔案不必每次 open/close。快取數量有上限，超過或 fd 不足時關閉最久未使用的 fd。
+ *       fd 以參考計數保護：被逐出的 fd 會等到最後一個使用者 (例如尚未送完的 sendfile) 釋放後才關閉。
+ *       命中只取得該檔案自己的鎖並設定「最近使用」標記，LRU 順序在逐出時才調整 (第二次機會)。
+ *       同時管理檔案已提交的版本 (inode + 長度)：讀取者取得快照後不需要任何鎖，
+ *       覆蓋寫入換成新的 inode，舊版本在最後一個讀取者釋放 fd 時由核心回收。
+ *       每次提交新版本都讓內容快取 (content.h) 失效。
+ *
+ * 讀取者看到的一致性：覆蓋寫入與附加寫入不影響已提交的內容，讀取者不必等待；
+ * 原地寫入 (write p) 則直接修改目前的 inode，因此較弱：與它重疊的讀取以 FileEntry.inplace 互斥，
+ * 讀取者在送出的範圍取得讀鎖 (持有到回應送完)，原地寫入在寫入的範圍取得寫鎖，
+ * 重疊的讀取會等待進行中的原地寫入 (反之亦然)，不會讀到寫到一半的區段，
+ * 但不再是完全不等待 (只等待重疊的原地寫入，與覆蓋、附加及不重疊的寫入無關)。
+ * 快照在取得讀鎖之後才取得；內容快取載入整個檔案，因此可能載入時讀鎖涵蓋整個檔案。
+ * 持有讀鎖送出的區段以 pread 複製進 socket (sendfile 只放進頁面的參考，送出前仍會被原地寫入改變)。
+ */
+
+#ifndef FDCACHE_H
+#define FDCACHE_H
+
+#include "catalog.h"
+
+#define FDCACHE_DEFAULT_CAPACITY 1024 // 預設最多快取的 fd 數量
+
+typedef struct FdHandle
+{
+    int fd;
+    atomic_int refs; // 快取本身持有 1 個參考，每個使用者各 1 個
+} FdHandle;
+
+// 設定快取容量
+void fdcache_init(int capacity);
+
+// 取得檔案目前 inode 的 fd (未快取時開啟並放入快取)，失敗回傳 NULL
+FdHandle *fdcache_acquire(FileEntry *file);
+
+// 取得最後提交的版本：fd 與當時的長度 (*size) 一致，不受之後的寫入影響；version 不為 NULL 時傳回版本號
+// 檔案尚未建立完成時回傳 NULL 並設定 errno = ENOENT
+FdHandle *fdcache_snapshot(FileEntry *file, uint64_t *size, uint32_t *version);
+
+// 目前提交的版本號 (0: 磁碟檔案尚未建立)；size 不為 NULL 時傳回提交的長度
+// 只要版本號 (size 為 NULL) 時是一次 atomic 讀取，可以在其他鎖內呼叫
+uint32_t fdcache_version(FileEntry *file, uint64_t *size);
+
+// 釋放 fdcache_acquire 取得的參考 (參數型別為 void * 以便作為輸出佇列的 ReleaseFunc)
+void fdcache_release(void *handle);
+
+// 附加或原地寫入完成 (持有涵蓋寫入範圍的寫鎖)：寫到 size 為止，提交新版本
+// 長度只會變長：寫在已提交範圍內的原地寫入不改變長度
+void fdcache_commit(FileEntry *file, uint64_t size);
+
+// 覆蓋寫入 rename 之前呼叫 (持有檔案寫鎖)，之後必須以 fdcache_install 提交新版本，
+// rename 失敗時則以 fdcache_abort_replace 結束
+void fdcache_begin_replace(FileEntry *file);
+
+// rename 失敗：維持原本的版本 (不提交任何東西)
+void fdcache_abort_replace(FileEntry *file);
+
+// 提交新的 inode：把剛建立或 rename 好的檔案 fd (必須 >= 0) 放進快取 (取代舊的快取)，所有權交給快取
+void fdcache_install(FileEntry *file, int fd, uint64_t size);
+
+#endif
@@ -0,0 +1,325 @@
+/*
+ * filelock.c - 檔案的位元組範圍鎖 (非阻塞、FIFO 等待佇列)
+ */
+
+#include <string.h>
+
+#include "filelock.h"
+#include "pool.h"
+#include "stats.h"
+
+static LockPolicy policy = LOCK_FIFO;
+
+void filelock_set_policy(LockPolicy p)
+{
+    policy = p;
+}
+
+int filelock_parse_policy(const char *name)
+{
+    if (strcmp(name, "fifo") == 0)
+        return LOCK_FIFO;
+    if (strcmp(name, "read") == 0)
+        return LOCK_PREFER_READERS;
+    if (strcmp(name, "write") == 0)
+        return LOCK_PREFER_WRITERS;
+    return -1;
+}
+
+void filelock_init(FileLock *l, int held_exclusive)
+{
+    pthread_mutex_init(&l->mutex, NULL);
+    l->initial = held_exclusive;
+    l->held = NULL;
+    l->head = NULL;
+    atomic_init(&l->acquires, held_exclusive);
+    atomic_init(&l->waits, 0);
+    atomic_init(&l->wait_us, 0);
+}
+
+// 計數只在持有 mutex 時修改
+static void count(atomic_uint_least64_t *v, uint64_t n)
+{
+    atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+// 兩個範圍是否互斥：重疊且至少一方是寫鎖
+static int conflicts(const LockWaiter *a, const LockWaiter *b)
+{
+    return (a->exclusive || b->exclusive) && a->start < b->end && b->start < a->end;
+}
+
+/* ---- 區間樹 (treap)：以 start 排序，節點記錄子樹中最大的 end ---- */
+
+// treap 的優先值 (每個執行緒各自的 xorshift，不需要同步)
+static unsigned next_prio(void)
+{
+    static __thread unsigned seed = 2463534242u;
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static void update(LockWaiter *n)
+{
+    n->max_end = n->end;
+    n->max_excl_end = n->exclusive ? n->end : 0;
+    for (int i = 0; i < 2; i++)
+    {
+        LockWaiter *c = i ? n->right : n->left;
+        if (!c)
+            continue;
+        if (c->max_end > n->max_end)
+            n->max_end = c->max_end;
+        if (c->max_excl_end > n->max_excl_end)
+            n->max_excl_end = c->max_excl_end;
+    }
+}
+
+static LockWaiter *rotate_right(LockWaiter *n)
+{
+    LockWaiter *l = n->left;
+    n->left = l->right;
+    l->right = n;
+    update(n);
+    update(l);
+    return l;
+}
+
+static LockWaiter *rotate_left(LockWaiter *n)
+{
+    LockWaiter *r = n->right;
+    n->right = r->left;
+    r->left = n;
+    update(n);
+    update(r);
+    return r;
+}
+
+static LockWaiter *tree_insert(LockWaiter *n, LockWaiter *w)
+{
+    if (!n)
+    {
+        w->left = w->right = NULL;
+        update(w);
+        return w;
+    }
+    if (w->start < n->start)
+    {
+        n->left = tree_insert(n->left, w);
+        if (n->left->prio > n->prio)
+            return rotate_right(n);
+    }
+    else
+    {
+        n->right = tree_insert(n->right, w);
+        if (n->right->prio > n->prio)
+            return rotate_left(n);
+    }
+    update(n);
+    return n;
+}
+
+// 合併兩棵樹 (a 的 start 全部不大於 b 的)
+static LockWaiter *tree_merge(LockWaiter *a, LockWaiter *b)
+{
+    if (!a)
+        return b;
+    if (!b)
+        return a;
+    if (a->prio > b->prio)
+    {
+        a->right = tree_merge(a->right, b);
+        update(a);
+        return a;
+    }
+    b->left = tree_merge(a, b->left);
+    update(b);
+    return b;
+}
+
+static LockWaiter *tree_remove(LockWaiter *n, LockWaiter *w, int *found)
+{
+    if (!n)
+        return NULL;
+    if (n == w)
+    {
+        *found = 1;
+        return tree_merge(n->left, n->right);
+    }
+    // start 相同的節點經過旋轉後可能在任一邊
+    if (w->start <= n->start)
+        n->left = tree_remove(n->left, w, found);
+    if (!*found && w->start >= n->start)
+        n->right = tree_remove(n->right, w, found);
+    update(n);
+    return n;
+}
+
+// 找一個和 w 互斥的持有者 (沒有時回傳 NULL)
+static LockWaiter *tree_conflict(LockWaiter *n, const LockWaiter *w)
+{
+    while (n)
+    {
+        // 子樹中 (可能互斥的) 範圍都在 w 開始之前結束
+        if ((w->exclusive ? n->max_end : n->max_excl_end) <= w->start)
+            return NULL;
+        LockWaiter *hit = tree_conflict(n->left, w);
+        if (hit)
+            return hit;
+        if (conflicts(n, w))
+            return n;
+        if (n->start >= w->end) // 右子樹都從 w 結束之後開始
+            return NULL;
+        n = n->right;
+    }
+    return NULL;
+}
+
+/* ---- 授予規則 ---- */
+
+// w 是否被持有中的範圍擋住 (by_writer 設為擋住它的是否為寫鎖，呼叫者持有 mutex)
+static int blocked_by_holders(FileLock *l, const LockWaiter *w, int *by_writer)
+{
+    if (l->initial)
+    {
+        *by_writer = 1;
+        return 1;
+    }
+    LockWaiter *h = tree_conflict(l->held, w);
+    *by_writer = h && h->exclusive;
+    return h != NULL;
+}
+
+// 佇列中排在 stop 之前是否有和 w 互斥的等待者 (讀取者優先時讀鎖不理會佇列)
+static int blocked_by_queue(FileLock *l, const LockWaiter *w, const LockWaiter *stop)
+{
+    if (!w->exclusive && policy == LOCK_PREFER_READERS)
+        return 0;
+    for (LockWaiter *p = l->head; p != stop; p = p->next)
+        if (conflicts(p, w))
+            return 1;
+    return 0;
+}
+
+static void hold(FileLock *l, LockWaiter *w)
+{
+    w->prio = next_prio();
+    l->held = tree_insert(l->held, w);
+}
+
+// 把 continuation 交給工作執行緒 (不會失敗；不在目前的執行緒執行，呼叫者可能持有其他鎖)
+static void dispatch(LockWaiter *w)
+{
+    pool_continue(&w->task, w->granted, w->arg);
+}
+
+int filelock_acquire(FileLock *l, LockWaiter *w)
+{
+    pthread_mutex_lock(&l->mutex);
+
+    // 找插入位置：寫入者優先時排在第一個等待中的讀取者前面，否則排在最後
+    LockWaiter **pp = &l->head;
+    int position = 1;
+    int jump = policy == LOCK_PREFER_WRITERS && w->exclusive;
+    while (*pp && (!jump || (*pp)->exclusive))
+    {
+        pp = &(*pp)->next;
+        position++;
+    }
+
+    // 沒有互斥的持有者、也沒有排在前面的互斥等待者時立即取得
+    int by_writer;
+    if (!blocked_by_holders(l, w, &by_writer) && !blocked_by_queue(l, w, *pp))
+    {
+        hold(l, w);
+        count(&l->acquires, 1);
+        pthread_mutex_unlock(&l->mutex);
+        return 0;
+    }
+
+    w->next = *pp;
+    w->queued_at = stats_now_us();
+    w->notifying = w->queued != NULL;
+    w->deferred = 0;
+    *pp = w;
+    pthread_mutex_unlock(&l->mutex);
+    if (!w->queued)
+        return 1;
+
+    // 在 mutex 外通知 (queued 會送出回應，取得連線的輸出鎖；輸出鎖的持有者可能正在釋放這個鎖)
+    // 通知期間就被授予時由 filelock_release 標記 deferred，通知完才交出 continuation
+    w->queued(w->arg, position, by_writer);
+    pthread_mutex_lock(&l->mutex);
+    w->notifying = 0;
+    int grant = w->deferred;
+    pthread_mutex_unlock(&l->mutex);
+    if (grant)
+        dispatch(w);
+    return 1;
+}
+
+void filelock_release(FileLock *l, LockWaiter *w)
+{
+    LockWaiter *grant = NULL, **grant_tail = &grant;
+
+    pthread_mutex_lock(&l->mutex);
+    if (w)
+    {
+        int found = 0;
+        l->held = tree_remove(l->held, w, &found);
+    }
+    else
+        l->initial = 0;
+
+    // 依佇列順序檢查每個等待者：沒有被持有者或前面仍在等待的互斥請求擋住的都可以取得
+    // (不同區段的寫入者可以同時取得；授予的範圍立即放進樹中，擋住後面與它重疊的等待者)
+    LockWaiter **pp = &l->head;
+    while (*pp)
+    {
+        LockWaiter *c = *pp;
+        int by_writer;
+        if (blocked_by_holders(l, c, &by_writer) || blocked_by_queue(l, c, c))
+        {
+            pp = &c->next;
+            continue;
+        }
+        *pp = c->next;
+        hold(l, c);
+        c->next = NULL;
+        *grant_tail = c;
+        grant_tail = &c->next;
+    }
+
+    // 記錄被授予者的等待時間
+    uint64_t now = grant ? stats_now_us() : 0;
+    for (LockWaiter *g = grant; g; g = g->next)
+    {
+        count(&l->acquires, 1);
+        count(&l->waits, 1);
+        count(&l->wait_us, now - g->queued_at);
+        stats_record(STAT_LOCK_WAIT, now - g->queued_at, 0);
+    }
+
+    // 還在呼叫 queued 的等待者由 filelock_acquire 在通知完之後交出 continuation
+    for (LockWaiter **gp = &grant; *gp;)
+    {
+        if ((*gp)->notifying)
+        {
+            (*gp)->deferred = 1;
+            *gp = (*gp)->next;
+        }
+        else
+            gp = &(*gp)->next;
+    }
+    pthread_mutex_unlock(&l->mutex);
+
+    // 在鎖外交出 continuation (等待者可能在 granted 中立即釋放並重新使用 LockWaiter)
+    while (grant)
+    {
+        LockWaiter *next = grant->next;
+        dispatch(grant);
+        grant = next;
+    }
+}
@@ -0,0 +1,84 @@
+/*
+ * filelock.h - 檔案的位元組範圍鎖 (非阻塞、FIFO 等待佇列)
+ * 功能：取代 pthread_rwlock：取不到鎖的請求不佔用執行緒等待，而是把「取得鎖之後要做的事」
+ *       (continuation) 排進每個檔案自己的等待佇列；鎖釋放時依公平性策略依序授予，
+ *       並把 continuation 交給工作執行緒執行。呼叫者可以告訴客戶端目前的排隊順位。
+ *       每個鎖涵蓋一段位元組範圍 [start, end)：範圍重疊且至少一方是寫鎖才互斥，
+ *       寫入不同區段的請求可以同時進行。持有中的範圍放在區間樹 (以 start 排序的 treap，
+ *       每個節點記錄子樹中最大的 end) 裡，衝突檢查只走過可能重疊的節點。
+ */
+
+#ifndef FILELOCK_H
+#define FILELOCK_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+#include "pool.h"
+
+// 公平性策略
+typedef enum
+{
+    LOCK_FIFO,           // 依到達順序授予 (預設)：讀取者不會插隊到等待中的寫入者前面
+    LOCK_PREFER_READERS, // 沒有寫入者持有鎖時，讀取者直接取得 (可能讓寫入者長時間等待)
+    LOCK_PREFER_WRITERS  // 寫入者排在所有等待中的讀取者前面
+} LockPolicy;
+
+#define FILELOCK_EOF UINT64_MAX // 範圍結尾：直到檔案結尾 (包含之後附加的部分)
+
+// 一個等待中的請求 (由呼叫者配置，授予前不可釋放)
+typedef struct LockWaiter
+{
+    struct LockWaiter *next;
+    int exclusive;              // 1: 寫鎖；0: 讀鎖
+    uint64_t start, end;        // 鎖定範圍 [start, end)；整個檔案為 [0, FILELOCK_EOF)
+    void (*granted)(void *arg); // 取得鎖後在工作執行緒上呼叫
+    // 排進佇列時呼叫 (可為 NULL)：position 為排隊順位 (1 起算)，behind_writer = 1 表示被持有中的寫鎖擋住
+    // 在 filelock_acquire 的執行緒上、鎖的 mutex 之外呼叫 (可以送出回應)；期間被授予時 granted 延到它返回之後
+    void (*queued)(void *arg, int position, int behind_writer);
+    void *arg;
+    uint64_t queued_at;         // 排進佇列的時間 (微秒，計算等待時間用)
+    int notifying;              // 1: 正在呼叫 queued (filelock.c 使用)
+    int deferred;               // 1: 呼叫 queued 期間已被授予，返回後才交出 granted
+    PoolNode task;              // 交給工作執行緒時使用的節點 (filelock.c 使用)
+
+    // 持有期間的區間樹節點 (filelock.c 使用)
+    struct LockWaiter *left, *right;
+    uint64_t max_end;      // 子樹中最大的 end
+    uint64_t max_excl_end; // 子樹中寫鎖最大的 end (0: 沒有寫鎖)
+    unsigned prio;         // treap 的優先值
+} LockWaiter;
+
+typedef struct FileLock
+{
+    pthread_mutex_t mutex; // 只保護以下欄位，持有時間只有幾個指標操作
+    int initial;           // 1: 建立者持有整個檔案的寫鎖 (filelock_init 的 held_exclusive)
+    LockWaiter *held;      // 持有中的範圍 (區間樹的根)
+    LockWaiter *head;      // 等待佇列 (依授予順序排列)
+
+    // 統計 (在 mutex 內更新，stats.c 不持有鎖讀取)
+    atomic_uint_least64_t acquires; // 取得鎖的次數
+    atomic_uint_least64_t waits;    // 其中需要排隊的次數
+    atomic_uint_least64_t wait_us;  // 累計排隊時間 (微秒)
+} FileLock;
+
+// 設定公平性策略 (啟動時呼叫一次)
+void filelock_set_policy(LockPolicy policy);
+
+// 解析策略名稱 "fifo" / "read" / "write"，不認識時回傳 -1
+int filelock_parse_policy(const char *name);
+
+// 初始化；held_exclusive = 1 時由呼叫者持有整個檔案的寫鎖 (例如正在建立的檔案)，
+// 之後以 filelock_release(l, NULL) 釋放
+void filelock_init(FileLock *l, int held_exclusive);
+
+// 要求 w->start ~ w->end 範圍的鎖：可以立即取得時回傳 0 (不會呼叫 w->granted)；
+// 否則排進等待佇列 (呼叫 w->queued) 並回傳 1，取得鎖時以 w->arg 呼叫 w->granted
+// 回傳 1 之後請求可能已在其他執行緒上完成，呼叫者不可再使用 w->arg
+int filelock_acquire(FileLock *l, LockWaiter *w);
+
+// 釋放 w 持有的範圍 (NULL: filelock_init 時持有的寫鎖) 並授予所有因此可以取得的等待者
+void filelock_release(FileLock *l, LockWaiter *w);
+
+#endif
@@ -0,0 +1,962 @@
+/*
+ * fsclient.c - 非同步客戶端函式庫
+ * 功能：每條連線有一個輸出緩衝區與處理中請求的表 (request id -> 回呼)。
+ *       送出請求的執行緒把 frame 附加到輸出緩衝區，若沒有人正在送就由它負責送出；
+ *       送出期間其他執行緒附加的 frame 累積起來，下一輪以一次系統呼叫 (或一次 ring 複製) 一起送出。
+ *       I/O 執行緒以 epoll 等待回應 (共享記憶體連線等待門鈴)，解析 frame 後呼叫對應的回呼，
+ *       也在 socket 重新可寫 (或 ring 有空間) 時送出剩下的資料。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "fsclient.h"
+#include "shmring.h"
+
+#define FS_DEFAULT_PORT 8888
+#define PENDING_BUCKETS 1024 // 每條連線處理中請求表的雜湊桶數
+#define RECV_CHUNK 65536     // 每次 recv 至少準備的空間
+#define MAX_EVENTS 64
+#define SHM_SPIN (1 << 14)   // 共享記憶體連線有處理中的請求時，I/O 執行緒睡眠前先輪詢 ring 的次數
+#define STOP_TAG UINT64_MAX  // epoll 事件：結束 I/O 執行緒
+#define WAKE_TAG (UINT64_MAX - 1) // epoll 事件：有連線在其他執行緒上送出失敗 (conn_break)
+
+typedef struct Pending
+{
+    struct Pending *next;
+    uint32_t req_id;
+    uint8_t opcode;
+    FsCallback cb;
+    void *arg;
+} Pending;
+
+typedef struct FsConn
+{
+    FsClient *cl;
+    int sock;
+    ShmChannel *shm; // NULL: 經由 socket 收送
+    int io;          // 負責的 I/O 執行緒
+
+    pthread_mutex_t lock;     // 保護以下欄位
+    int dead;                 // 1: 連線已中斷，不再接受請求
+    int flushing;             // 1: 有執行緒正在送出
+    int flush_again;          // 送出期間 I/O 執行緒收到可寫事件，送出者結束前要再試一次
+    char *out;                // 累積中的 frame
+    size_t outlen, outcap;
+    char *sending;            // 送出者正在送的一批 (sendoff 之前已送出)
+    size_t sendlen, sendoff, sendcap;
+    Pending *pending[PENDING_BUCKETS];
+    atomic_int inflight;      // 處理中的請求數 (選擇連線用)
+
+    char *in;                 // 尚未解析的回應 (只由 I/O 執行緒存取)
+    size_t inlen, incap;
+    size_t inwant;            // 共享記憶體：正在累積的大回應的 frame 長度 (0: 沒有)
+} FsConn;
+
+typedef struct IoThread
+{
+    FsClient *cl;
+    int index;
+    int epfd;
+    int wakefd; // eventfd：送出失敗的連線交給這個 I/O 執行緒結束 (conn_break)
+    pthread_t tid;
+} IoThread;
+
+struct FsClient
+{
+    FsConn *conns;
+    int nconns;
+    IoThread *io;
+    int nio;
+    int stopfd;              // eventfd：通知 I/O 執行緒結束
+    int spin;                // 睡眠前輪詢的次數 (只有一個 CPU 時為 0)
+    atomic_uint next_id;
+    atomic_uint next_conn;
+
+    pthread_mutex_t drain_lock;
+    pthread_cond_t drain_cond;
+    int inflight;            // 全部連線處理中的請求數 (受 drain_lock 保護)
+};
+
+// ---- 請求 frame 的編碼 ----
+
+typedef struct Msg
+{
+    unsigned char *buf;
+    size_t len, cap;
+    size_t start; // 目前 frame 的標頭位置
+    FrameHeader h;
+    uint32_t req_id; // 第一個 frame 的 request id 與 opcode (write 之後可能接著 OP_WRITE_DATA frame)
+    uint8_t opcode;
+    int failed;   // 欄位太長等錯誤
+} Msg;
+
+static void msg_reserve(Msg *m, size_t n)
+{
+    if (m->len + n <= m->cap)
+        return;
+    while (m->cap < m->len + n)
+        m->cap = m->cap ? m->cap * 2 : 1024;
+    m->buf = realloc(m->buf, m->cap);
+}
+
+static void msg_begin(Msg *m, uint8_t opcode, uint16_t flags, uint32_t req_id)
+{
+    msg_reserve(m, PROTO_HEADER_SIZE);
+    m->start = m->len;
+    m->len += PROTO_HEADER_SIZE;
+    m->h = (FrameHeader){opcode, 0, flags, req_id, 0};
+    if (m->start == 0)
+    {
+        m->req_id = req_id;
+        m->opcode = opcode;
+    }
+}
+
+static void msg_field(Msg *m, const void *data, size_t n)
+{
+    msg_reserve(m, 2 + n);
+    if (proto_put_field(m->buf, m->cap, &m->len, data, n) < 0)
+        m->failed = 1;
+}
+
+static void msg_string(Msg *m, const char *s)
+{
+    msg_field(m, s ? s : "", s ? strlen(s) : 0);
+}
+
+static void msg_u64(Msg *m, uint64_t v)
+{
+    msg_reserve(m, 10);
+    proto_put_u64(m->buf, m->cap, &m->len, v);
+}
+
+static void msg_data(Msg *m, const void *data, size_t n)
+{
+    msg_reserve(m, n);
+    memcpy(m->buf + m->len, data, n);
+    m->len += n;
+}
+
+// 填入標頭的 payload 長度 (超過 PROTO_MAX_PAYLOAD 的 frame 伺服器會直接斷線)
+static void msg_end(Msg *m)
+{
+    m->h.length = m->len - m->start - PROTO_HEADER_SIZE;
+    if (m->h.length > PROTO_MAX_PAYLOAD)
+        m->failed = 1;
+    proto_encode_header(m->buf + m->start, &m->h);
+}
+
+// ---- 連線 ----
+
+static void client_request_done(FsClient *cl)
+{
+    pthread_mutex_lock(&cl->drain_lock);
+    if (--cl->inflight == 0)
+        pthread_cond_broadcast(&cl->drain_cond);
+    pthread_mutex_unlock(&cl->drain_lock);
+}
+
+// 連線中斷：之後不再接受請求，所有處理中的請求以 FS_ERR_CLOSED 結束
+// 只在負責的 I/O 執行緒 (或 I/O 執行緒結束之後) 呼叫，才不會與 conn_dispatch 同時呼叫同一個請求的回呼
+static void conn_fail(FsConn *c)
+{
+    Pending *list = NULL;
+
+    pthread_mutex_lock(&c->lock);
+    c->dead = 1;
+    for (int i = 0; i < PENDING_BUCKETS; i++)
+    {
+        while (c->pending[i])
+        {
+            Pending *p = c->pending[i];
+            c->pending[i] = p->next;
+            p->next = list;
+            list = p;
+        }
+    }
+    c->outlen = c->sendlen = c->sendoff = 0;
+    pthread_mutex_unlock(&c->lock);
+
+    while (list)
+    {
+        Pending *p = list;
+        list = p->next;
+        FsReply r = {p->req_id, p->opcode, FS_ERR_CLOSED, 0, "", 0, 1};
+        atomic_fetch_sub(&c->inflight, 1);
+        if (p->cb)
+            p->cb(&r, p->arg);
+        free(p);
+        client_request_done(c->cl);
+    }
+}
+
+// 送出失敗 (可能在提交請求的執行緒上)：先標記中斷、不再接受請求，再喚醒 I/O 執行緒以 conn_fail 結束處理中的請求
+static void conn_break(FsConn *c)
+{
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&c->lock);
+    c->dead = 1;
+    c->outlen = c->sendlen = c->sendoff = 0;
+    pthread_mutex_unlock(&c->lock);
+    if (write(c->cl->io[c->io].wakefd, &one, sizeof(one)) < 0)
+        perror("eventfd write");
+}
+
+// 非阻塞寫出：socket 以 send；共享記憶體複製進請求 ring，ring 滿時表明在等空間 (伺服器讀取後敲門鈴)
+static ssize_t conn_write(FsConn *c, const char *buf, size_t len)
+{
+    if (!c->shm)
+        return send(c->sock, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+    for (;;)
+    {
+        char *dst;
+        ssize_t room = shm_writable(c->shm, &dst);
+        if (room < 0)
+        {
+            errno = EPROTO;
+            return -1;
+        }
+        if (room > 0)
+        {
+            size_t n = len < (size_t)room ? len : (size_t)room;
+            memcpy(dst, buf, n);
+            shm_produce(c->shm, n);
+            return n;
+        }
+        if (!shm_wait_space(c->shm))
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+}
+
+// 送出累積的 frame：同時只有一個送出者，其他執行緒附加的資料在下一輪一起送出
+static void conn_flush(FsConn *c)
+{
+    int failed = 0;
+
+    pthread_mutex_lock(&c->lock);
+    if (c->flushing)
+    {
+        c->flush_again = 1;
+        pthread_mutex_unlock(&c->lock);
+        return;
+    }
+    c->flushing = 1;
+    while (!c->dead)
+    {
+        if (c->sendoff == c->sendlen)
+        {
+            if (c->outlen == 0)
+                break;
+            // 交換兩個緩衝區：累積的資料成為這一批，送出期間的新資料附加到另一個
+            char *tmp = c->sending;
+            size_t cap = c->sendcap;
+            c->sending = c->out;
+            c->sendcap = c->outcap;
+            c->sendlen = c->outlen;
+            c->sendoff = 0;
+            c->out = tmp;
+            c->outcap = cap;
+            c->outlen = 0;
+        }
+        pthread_mutex_unlock(&c->lock);
+        ssize_t n = conn_write(c, c->sending + c->sendoff, c->sendlen - c->sendoff);
+        int err = errno;
+        pthread_mutex_lock(&c->lock);
+        if (n > 0)
+            c->sendoff += n;
+        else if (err == EINTR)
+            continue;
+        else if (err == EAGAIN || err == EWOULDBLOCK)
+        {
+            // 等 I/O 執行緒收到可寫事件 (或門鈴)；期間已經收到的話自己再試一次
+            if (!c->flush_again)
+                break;
+            c->flush_again = 0;
+        }
+        else
+        {
+            failed = 1;
+            break;
+        }
+    }
+    c->flushing = 0;
+    pthread_mutex_unlock(&c->lock);
+    if (failed)
+        conn_break(c);
+}
+
+// 登記回呼並把 frame 附加到輸出緩衝區，再嘗試送出
+static int conn_submit(FsConn *c, const Msg *m, FsCallback cb, void *arg)
+{
+    uint32_t req_id = m->req_id;
+    Pending *p = malloc(sizeof(Pending));
+    p->req_id = req_id;
+    p->opcode = m->opcode;
+    p->cb = cb;
+    p->arg = arg;
+
+    pthread_mutex_lock(&c->cl->drain_lock);
+    c->cl->inflight++;
+    pthread_mutex_unlock(&c->cl->drain_lock);
+
+    pthread_mutex_lock(&c->lock);
+    if (c->dead)
+    {
+        pthread_mutex_unlock(&c->lock);
+        free(p);
+        client_request_done(c->cl);
+        return -1;
+    }
+    Pending **bucket = &c->pending[req_id % PENDING_BUCKETS];
+    p->next = *bucket;
+    *bucket = p;
+    atomic_fetch_add(&c->inflight, 1);
+    if (c->outlen + m->len > c->outcap)
+    {
+        while (c->outcap < c->outlen + m->len)
+            c->outcap = c->outcap ? c->outcap * 2 : 4096;
+        c->out = realloc(c->out, c->outcap);
+    }
+    memcpy(c->out + c->outlen, m->buf, m->len);
+    c->outlen += m->len;
+    int busy = c->flushing;
+    pthread_mutex_unlock(&c->lock);
+
+    if (!busy)
+        conn_flush(c);
+    return 0;
+}
+
+// 處理一個完整的回應 frame
+static void conn_dispatch(FsConn *c, const char *frame, const FrameHeader *h)
+{
+    Pending *p, **pp;
+    FsReply r = {h->req_id, h->opcode, h->status, h->flags, frame + PROTO_HEADER_SIZE, h->length,
+                 h->status >= ST_FINAL};
+
+    pthread_mutex_lock(&c->lock);
+    for (pp = &c->pending[h->req_id % PENDING_BUCKETS]; (p = *pp) && p->req_id != h->req_id; pp = &p->next)
+        ;
+    if (p && r.final)
+        *pp = p->next;
+    pthread_mutex_unlock(&c->lock);
+
+    if (!p)
+        return; // 不認得的 request id
+    if (p->cb)
+        p->cb(&r, p->arg);
+    if (r.final)
+    {
+        free(p);
+        atomic_fetch_sub(&c->inflight, 1);
+        client_request_done(c->cl);
+    }
+}
+
+// 共享記憶體：回應直接在 ring 中解析 (mirror 映射讓 frame 總是連續)，處理完才讓出空間
+// 比 ring 還大的回應 (例如大檔案的內容) 無法一次放進 ring，邊讀邊搬到 in 累積
+static int conn_read_shm(FsConn *c)
+{
+    for (;;)
+    {
+        const char *data;
+        FrameHeader h;
+        ssize_t avail = shm_readable(c->shm, &data);
+
+        if (avail < 0)
+            return -1;
+        if (avail == 0 || (c->inwant == 0 && avail < PROTO_HEADER_SIZE))
+        {
+            if (shm_idle(c->shm))
+                continue;
+            return 0;
+        }
+        if (c->inwant > 0)
+        {
+            size_t n = (size_t)avail < c->inwant - c->inlen ? (size_t)avail : c->inwant - c->inlen;
+            memcpy(c->in + c->inlen, data, n);
+            c->inlen += n;
+            shm_consume(c->shm, n);
+            if (c->inlen == c->inwant)
+            {
+                proto_decode_header((unsigned char *)c->in, &h);
+                conn_dispatch(c, c->in, &h);
+                c->inlen = c->inwant = 0;
+            }
+            continue;
+        }
+
+        if (proto_decode_header((const unsigned char *)data, &h) < 0)
+            return -1;
+        size_t frame_len = PROTO_HEADER_SIZE + h.length;
+        if (frame_len > SHM_RING_SIZE)
+        {
+            if (c->incap < frame_len)
+            {
+                c->incap = frame_len;
+                c->in = realloc(c->in, c->incap);
+            }
+            c->inwant = frame_len;
+            continue;
+        }
+        if ((size_t)avail < frame_len)
+        {
+            if (shm_idle(c->shm))
+                continue;
+            return 0;
+        }
+        conn_dispatch(c, data, &h);
+        shm_consume(c->shm, frame_len);
+    }
+}
+
+// socket：讀到 EAGAIN，解析緩衝區中所有完整的 frame
+static int conn_read_socket(FsConn *c)
+{
+    for (;;)
+    {
+        if (c->incap - c->inlen < RECV_CHUNK)
+        {
+            c->incap = c->inlen + RECV_CHUNK;
+            c->in = realloc(c->in, c->incap);
+        }
+        ssize_t n = recv(c->sock, c->in + c->inlen, c->incap - c->inlen, MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (n <= 0)
+            return -1;
+        c->inlen += n;
+
+        size_t off = 0;
+        FrameHeader h;
+        while (c->inlen - off >= PROTO_HEADER_SIZE)
+        {
+            if (proto_decode_header((unsigned char *)c->in + off, &h) < 0)
+                return -1;
+            if (c->inlen - off < PROTO_HEADER_SIZE + h.length)
+            {
+                // 大的回應：一次準備好整個 frame 的空間
+                if (c->incap - off < PROTO_HEADER_SIZE + h.length + RECV_CHUNK)
+                {
+                    c->incap = off + PROTO_HEADER_SIZE + h.length + RECV_CHUNK;
+                    c->in = realloc(c->in, c->incap);
+                }
+                break;
+            }
+            conn_dispatch(c, c->in + off, &h);
+            off += PROTO_HEADER_SIZE + h.length;
+        }
+        memmove(c->in, c->in + off, c->inlen - off);
+        c->inlen -= off;
+    }
+}
+
+// 共享記憶體連線的 socket 只用來偵測斷線：交握之後伺服器不會在上面送資料
+static int conn_check_socket(FsConn *c)
+{
+    char b;
+    ssize_t n = recv(c->sock, &b, 1, MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+}
+
+static void *io_main(void *arg)
+{
+    IoThread *t = arg;
+    FsClient *cl = t->cl;
+    struct epoll_event events[MAX_EVENTS];
+
+    for (;;)
+    {
+        // 共享記憶體連線有處理中的請求時先輪詢一陣子，回應通常在幾微秒內到達，省下門鈴與 epoll 喚醒
+        for (int spin = 0; spin < cl->spin; spin++)
+        {
+            int waiting = 0, got = 0;
+            for (int i = t->index; i < cl->nconns; i += cl->nio)
+            {
+                FsConn *c = &cl->conns[i];
+                const char *data;
+                if (!c->shm || c->dead || atomic_load(&c->inflight) == 0)
+                    continue;
+                waiting = 1;
+                if (shm_readable(c->shm, &data) != 0)
+                {
+                    got = 1;
+                    if (conn_read_shm(c) < 0)
+                        conn_fail(c);
+                }
+            }
+            if (!waiting)
+                break;
+            if (got)
+                spin = 0;
+        }
+
+        int n = epoll_wait(t->epfd, events, MAX_EVENTS, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            return NULL;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            if (events[i].data.u64 == STOP_TAG)
+                return NULL;
+            if (events[i].data.u64 == WAKE_TAG)
+            {
+                uint64_t cnt;
+                if (read(t->wakefd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+                    perror("eventfd read");
+                for (int k = t->index; k < cl->nconns; k += cl->nio)
+                    if (cl->conns[k].dead)
+                        conn_fail(&cl->conns[k]); // 已結束的連線沒有處理中的請求，再呼叫也沒有影響
+                continue;
+            }
+            // data.u64 = 連線編號 * 2 (+ 1 表示共享記憶體的門鈴)
+            FsConn *c = &cl->conns[events[i].data.u64 >> 1];
+            int bell = events[i].data.u64 & 1;
+            int failed = 0;
+
+            if (c->dead)
+                continue;
+            if (bell)
+            {
+                uint64_t cnt;
+                if (read(c->shm->bell, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+                    failed = 1;
+                conn_flush(c); // 門鈴也代表伺服器讓出了請求 ring 的空間
+                failed = failed || conn_read_shm(c) < 0;
+            }
+            else if (c->shm)
+                failed = conn_check_socket(c) < 0;
+            else
+            {
+                if (events[i].events & EPOLLOUT)
+                    conn_flush(c);
+                if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    failed = conn_read_socket(c) < 0;
+            }
+            if (failed)
+                conn_fail(c);
+        }
+    }
+}
+
+static int connect_socket(const FsConfig *cfg)
+{
+    const char *unix_path = cfg->unix_path ? cfg->unix_path : cfg->shm ? PROTO_UNIX_PATH : NULL;
+    int sock, one = 1;
+
+    if (unix_path)
+    {
+        struct sockaddr_un addr;
+        if (strlen(unix_path) >= sizeof(addr.sun_path))
+            return -1;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, unix_path);
+        if ((sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+            return -1;
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+            close(sock);
+            return -1;
+        }
+        return sock;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(cfg->port > 0 ? cfg->port : FS_DEFAULT_PORT);
+    if (inet_pton(AF_INET, cfg->host ? cfg->host : "127.0.0.1", &addr.sin_addr) <= 0)
+        return -1;
+    if ((sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(sock);
+        return -1;
+    }
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return sock;
+}
+
+// 建立一條連線並交給 I/O 執行緒 (登入由呼叫者送出)
+static int conn_open(FsClient *cl, FsConn *c, int index, const FsConfig *cfg)
+{
+    struct epoll_event ev;
+
+    c->cl = cl;
+    c->io = index % cl->nio;
+    pthread_mutex_init(&c->lock, NULL);
+    if ((c->sock = connect_socket(cfg)) < 0)
+    {
+        c->dead = 1;
+        return -1;
+    }
+    if (cfg->shm)
+    {
+        c->shm = malloc(sizeof(ShmChannel));
+        if (shm_connect(c->sock, c->shm) < 0)
+        {
+            free(c->shm);
+            c->shm = NULL;
+            c->dead = 1;
+            return -1;
+        }
+    }
+    fcntl(c->sock, F_SETFL, fcntl(c->sock, F_GETFL) | O_NONBLOCK);
+
+    int epfd = cl->io[c->io].epfd;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.u64 = (uint64_t)index << 1;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->sock, &ev);
+    if (c->shm)
+    {
+        shm_idle(c->shm); // 回應寫入時敲門鈴
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.u64 = ((uint64_t)index << 1) | 1;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, c->shm->bell, &ev);
+    }
+    return 0;
+}
+
+FsClient *fs_client_open(const FsConfig *cfg, char *msg, size_t msglen)
+{
+    FsClient *cl = calloc(1, sizeof(FsClient));
+    struct epoll_event ev;
+
+    cl->nconns = cfg->connections > 0 ? cfg->connections : FS_DEFAULT_CONNECTIONS;
+    cl->nio = cfg->io_threads > 0 ? cfg->io_threads : 1;
+    if (cl->nio > cl->nconns)
+        cl->nio = cl->nconns;
+    // 只有一個 CPU 時輪詢只會搶走伺服器的執行時間
+    cl->spin = cfg->shm && sysconf(_SC_NPROCESSORS_ONLN) > 1 ? SHM_SPIN : 0;
+    atomic_init(&cl->next_id, 1);
+    pthread_mutex_init(&cl->drain_lock, NULL);
+    pthread_cond_init(&cl->drain_cond, NULL);
+    cl->stopfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    cl->io = calloc(cl->nio, sizeof(IoThread));
+    for (int i = 0; i < cl->nio; i++)
+    {
+        cl->io[i].cl = cl;
+        cl->io[i].index = i;
+        cl->io[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+        ev.events = EPOLLIN;
+        ev.data.u64 = STOP_TAG;
+        epoll_ctl(cl->io[i].epfd, EPOLL_CTL_ADD, cl->stopfd, &ev);
+        cl->io[i].wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        ev.data.u64 = WAKE_TAG;
+        epoll_ctl(cl->io[i].epfd, EPOLL_CTL_ADD, cl->io[i].wakefd, &ev);
+    }
+
+    cl->conns = calloc(cl->nconns, sizeof(FsConn));
+    int failed = 0;
+    for (int i = 0; i < cl->nconns; i++)
+        if (conn_open(cl, &cl->conns[i], i, cfg) < 0)
+            failed = 1;
+    for (int i = 0; i < cl->nio; i++)
+        pthread_create(&cl->io[i].tid, NULL, io_main, &cl->io[i]);
+    if (failed)
+    {
+        if (msg)
+            snprintf(msg, msglen, "無法連線至伺服器: %s", strerror(errno));
+        fs_client_close(cl);
+        return NULL;
+    }
+
+    // 每條連線都要登入；任何一條失敗就整個關閉
+    FsFuture *logins = calloc(cl->nconns, sizeof(FsFuture));
+    for (int i = 0; i < cl->nconns; i++)
+    {
+        Msg m = {0};
+        uint32_t id = atomic_fetch_add(&cl->next_id, 1);
+        msg_begin(&m, OP_LOGIN, 0, id);
+        msg_string(&m, cfg->user);
+        msg_string(&m, cfg->group);
+        msg_end(&m);
+        fs_future_init(&logins[i], NULL, NULL);
+        if (m.failed || conn_submit(&cl->conns[i], &m, fs_future_resolve, &logins[i]) < 0)
+            fs_future_resolve(&(FsReply){id, OP_LOGIN, FS_ERR_CLOSED, 0, "", 0, 1}, &logins[i]);
+        free(m.buf);
+    }
+    int ok = 1;
+    for (int i = 0; i < cl->nconns; i++)
+    {
+        int status = fs_future_wait(&logins[i]);
+        if (msg && (i == 0 || (ok && status != ST_OK)))
+            snprintf(msg, msglen, "%s", status == FS_ERR_CLOSED ? "伺服器已斷線。" : logins[i].data);
+        ok = ok && status == ST_OK;
+        fs_future_destroy(&logins[i]);
+    }
+    free(logins);
+    if (!ok)
+    {
+        fs_client_close(cl);
+        return NULL;
+    }
+    return cl;
+}
+
+void fs_client_close(FsClient *cl)
+{
+    uint64_t one = 1;
+
+    if (write(cl->stopfd, &one, sizeof(one)) < 0)
+        perror("eventfd write");
+    for (int i = 0; i < cl->nio; i++)
+    {
+        pthread_join(cl->io[i].tid, NULL);
+        close(cl->io[i].epfd);
+        close(cl->io[i].wakefd);
+    }
+    for (int i = 0; i < cl->nconns; i++)
+    {
+        FsConn *c = &cl->conns[i];
+        conn_fail(c);
+        if (c->shm)
+        {
+            shm_close(c->shm);
+            free(c->shm);
+        }
+        if (c->sock >= 0)
+            close(c->sock);
+        pthread_mutex_destroy(&c->lock);
+        free(c->out);
+        free(c->sending);
+        free(c->in);
+    }
+    close(cl->stopfd);
+    pthread_mutex_destroy(&cl->drain_lock);
+    pthread_cond_destroy(&cl->drain_cond);
+    free(cl->conns);
+    free(cl->io);
+    free(cl);
+}
+
+void fs_client_drain(FsClient *cl)
+{
+    pthread_mutex_lock(&cl->drain_lock);
+    while (cl->inflight > 0)
+        pthread_cond_wait(&cl->drain_cond, &cl->drain_lock);
+    pthread_mutex_unlock(&cl->drain_lock);
+}
+
+// 選擇處理中請求最少的連線 (從輪流的起點開始找，負載相同時分散到不同連線)
+static FsConn *pick_conn(FsClient *cl)
+{
+    unsigned start = atomic_fetch_add_explicit(&cl->next_conn, 1, memory_order_relaxed);
+    FsConn *best = NULL;
+    int best_load = 0;
+
+    for (int k = 0; k < cl->nconns; k++)
+    {
+        FsConn *c = &cl->conns[(start + k) % cl->nconns];
+        int load = atomic_load_explicit(&c->inflight, memory_order_relaxed);
+        if (c->dead)
+            continue;
+        if (!best || load < best_load)
+        {
+            best = c;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+// 送出編碼好的請求 (m 由呼叫者以 msg_begin 開始，這裡結束最後一個 frame 並釋放)
+static int submit(FsClient *cl, Msg *m, FsCallback cb, void *arg)
+{
+    FsConn *c;
+    int ret = -1;
+
+    msg_end(m);
+    if (!m->failed && (c = pick_conn(cl)) != NULL && conn_submit(c, m, cb, arg) == 0)
+        ret = m->req_id;
+    free(m->buf);
+    return ret;
+}
+
+static uint32_t new_id(FsClient *cl)
+{
+    uint32_t id = atomic_fetch_add_explicit(&cl->next_id, 1, memory_order_relaxed);
+    return id ? id : atomic_fetch_add_explicit(&cl->next_id, 1, memory_order_relaxed); // 跳過 0
+}
+
+int fs_new(FsClient *cl, const char *name, const char *perms, FsCallback cb, void *arg)
+{
+    Msg m = {0};
+    msg_begin(&m, OP_NEW, 0, new_id(cl));
+    msg_string(&m, name);
+    msg_string(&m, perms);
+    return submit(cl, &m, cb, arg);
+}
+
+int fs_read(FsClient *cl, const char *name, uint64_t offset, uint64_t length, FsCallback cb, void *arg)
+{
+    Msg m = {0};
+    msg_begin(&m, OP_READ, 0, new_id(cl));
+    msg_string(&m, name);
+    msg_u64(&m, offset);
+    msg_u64(&m, length);
+    return submit(cl, &m, cb, arg);
+}
+
+int fs_write(FsClient *cl, const char *name, const char *mode, uint64_t offset, const void *data, size_t len,
+             FsCallback cb, void *arg)
+{
+    Msg m = {0};
+    uint32_t id = new_id(cl);
+    const char *p = data;
+
+    msg_begin(&m, OP_WRITE, data ? FLAG_DATA : 0, id);
+    msg_string(&m, name);
+    msg_string(&m, mode);
+    if (strcmp(mode, "p") == 0)
+        msg_u64(&m, offset);
+
+    // 第一個 frame 放得下的資料接在欄位之後，其餘分成 OP_WRITE_DATA frame (除了最後一個都設定 FLAG_MORE)
+    size_t room = PROTO_MAX_PAYLOAD - (m.len - m.start - PROTO_HEADER_SIZE);
+    size_t n = data && len < room ? len : data ? room : 0;
+    msg_data(&m, p, n);
+    for (size_t off = n; off < len && data; off += n)
+    {
+        m.h.flags |= FLAG_MORE;
+        msg_end(&m);
+        n = len - off < PROTO_MAX_PAYLOAD ? len - off : PROTO_MAX_PAYLOAD;
+        msg_begin(&m, OP_WRITE_DATA, 0, id);
+        msg_data(&m, p + off, n);
+    }
+    return submit(cl, &m, cb, arg);
+}
+
+int fs_change(FsClient *cl, const char *name, const char *perms, FsCallback cb, void *arg)
+{
+    Msg m = {0};
+    msg_begin(&m, OP_CHANGE, 0, new_id(cl));
+    msg_string(&m, name);
+    msg_string(&m, perms);
+    return submit(cl, &m, cb, arg);
+}
+
+int fs_stats(FsClient *cl, FsCallback cb, void *arg)
+{
+    Msg m = {0};
+    msg_begin(&m, OP_STATS, 0, new_id(cl));
+    return submit(cl, &m, cb, arg);
+}
+
+int fs_list(FsClient *cl, const char *prefix, const char *cursor, uint64_t limit, FsCallback cb, void *arg)
+{
+    Msg m = {0};
+    msg_begin(&m, OP_LIST, 0, new_id(cl));
+    msg_string(&m, prefix);
+    msg_string(&m, cursor);
+    if (limit > 0)
+        msg_u64(&m, limit);
+    return submit(cl, &m, cb, arg);
+}
+
+int fs_stat(FsClient *cl, const char *name, FsCallback cb, void *arg)
+{
+    Msg m = {0};
+    msg_begin(&m, OP_STAT, 0, new_id(cl));
+    msg_string(&m, name);
+    return submit(cl, &m, cb, arg);
+}
+
+int fs_mread(FsClient *cl, int n, const char *names[], FsCallback cb, void *arg)
+{
+    Msg m = {0};
+    msg_begin(&m, OP_MREAD, 0, new_id(cl));
+    for (int i = 0; i < n; i++)
+        msg_string(&m, names[i]);
+    return submit(cl, &m, cb, arg);
+}
+
+int fs_mwrite(FsClient *cl, const char *mode, int n, const char *names[], const void *data[], const size_t lens[],
+              FsCallback cb, void *arg)
+{
+    Msg m = {0};
+    msg_begin(&m, OP_MWRITE, 0, new_id(cl));
+    msg_string(&m, mode);
+    for (int i = 0; i < n; i++)
+    {
+        msg_string(&m, names[i]);
+        if (data && data[i])
+            msg_field(&m, data[i], lens[i]);
+        else
+            msg_field(&m, "", 0);
+    }
+    return submit(cl, &m, cb, arg);
+}
+
+// ---- 同步等待 ----
+
+void fs_future_init(FsFuture *f, FsCallback notify, void *notify_arg)
+{
+    memset(f, 0, sizeof(*f));
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->cond, NULL);
+    f->notify = notify;
+    f->notify_arg = notify_arg;
+}
+
+void fs_future_resolve(const FsReply *reply, void *future)
+{
+    FsFuture *f = future;
+
+    if (f->notify)
+        f->notify(reply, f->notify_arg);
+    if (!reply->final)
+        return;
+    pthread_mutex_lock(&f->lock);
+    f->status = reply->status;
+    f->flags = reply->flags;
+    f->len = reply->len;
+    f->data = malloc(reply->len + 1);
+    memcpy(f->data, reply->data, reply->len);
+    f->data[reply->len] = '\0';
+    f->done = 1;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+}
+
+int fs_future_wait(FsFuture *f)
+{
+    pthread_mutex_lock(&f->lock);
+    while (!f->done)
+        pthread_cond_wait(&f->cond, &f->lock);
+    pthread_mutex_unlock(&f->lock);
+    return f->status;
+}
+
+void fs_future_destroy(FsFuture *f)
+{
+    free(f->data);
+    pthread_mutex_destroy(&f->lock);
+    pthread_cond_destroy(&f->cond);
+}
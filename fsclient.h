@@ -0,0 +1,107 @@
+/*
+ * fsclient.h - 非同步客戶端函式庫 (libfsclient.a / libfsclient.so)
+ * 功能：以一組連線 (connection pool) 與少數 I/O 執行緒服務大量同時進行的檔案操作。
+ *       每條連線可以同時有許多處理中的請求 (pipelining)，回應依 request id 交給各自的回呼；
+ *       多個執行緒同時送出的請求先放進連線的輸出緩衝區，由其中一個執行緒一次送出 (batched sends)。
+ *       連線可以是 TCP、unix socket 或共享記憶體 ring (shmring.h)，使用方式相同。
+ *
+ * 回呼在 I/O 執行緒上執行，不可阻塞；需要同步等待結果時使用 FsFuture。
+ */
+
+#ifndef FSCLIENT_H
+#define FSCLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "protocol.h"
+
+#define FS_DEFAULT_CONNECTIONS 4
+#define FS_ERR_CLOSED (-1) // 回應的狀態碼：連線中斷或客戶端關閉，請求沒有結果
+
+typedef struct FsClient FsClient;
+
+typedef struct FsConfig
+{
+    const char *host;      // TCP 伺服器位址 (NULL: 127.0.0.1)
+    int port;              // 0: 預設的 8888
+    const char *unix_path; // 不為 NULL 時改連這個 unix socket
+    int shm;               // 1: 經由 unix socket 建立共享記憶體通道 (未指定 unix_path 時使用 PROTO_UNIX_PATH)
+    const char *user;      // 登入身分
+    const char *group;
+    int connections;       // 連線數 (0: FS_DEFAULT_CONNECTIONS)
+    int io_threads;        // I/O 執行緒數 (0: 1)
+} FsConfig;
+
+// 一則回應：中途通知 (ST_WAITING / ST_GRANTED / ST_PART) 與最終回應各呼叫一次回呼
+typedef struct FsReply
+{
+    uint32_t req_id;
+    uint8_t opcode;
+    int status;       // ST_*；FS_ERR_CLOSED 表示連線中斷
+    uint16_t flags;
+    const char *data; // payload (只在回呼期間有效)
+    size_t len;
+    int final;        // 1: 這個請求的最後一則回應
+} FsReply;
+
+typedef void (*FsCallback)(const FsReply *reply, void *arg);
+
+// 建立所有連線並登入，失敗回傳 NULL；msg 不為 NULL 時放入伺服器的登入回應 (或連線錯誤的說明)
+FsClient *fs_client_open(const FsConfig *cfg, char *msg, size_t msglen);
+
+// 關閉所有連線並結束 I/O 執行緒，尚未完成的請求以 FS_ERR_CLOSED 通知
+void fs_client_close(FsClient *cl);
+
+// 等待目前所有處理中的請求完成
+void fs_client_drain(FsClient *cl);
+
+// 送出請求：成功回傳 request id (> 0)，沒有可用的連線時回傳 -1 (不會呼叫回呼)
+int fs_new(FsClient *cl, const char *name, const char *perms, FsCallback cb, void *arg);
+
+// length = 0 表示讀到檔案結尾
+int fs_read(FsClient *cl, const char *name, uint64_t offset, uint64_t length, FsCallback cb, void *arg);
+
+// mode: "o" 覆蓋、"a" 附加、"p" 從 offset 原地寫入；data 為 NULL 時伺服器寫入一行簽名
+// 超過單一 frame 的資料自動分成多個 OP_WRITE_DATA frame
+int fs_write(FsClient *cl, const char *name, const char *mode, uint64_t offset, const void *data, size_t len,
+             FsCallback cb, void *arg);
+
+int fs_change(FsClient *cl, const char *name, const char *perms, FsCallback cb, void *arg);
+
+int fs_stats(FsClient *cl, FsCallback cb, void *arg);
+
+// prefix / cursor 可為 NULL；limit = 0 使用伺服器的預設筆數
+int fs_list(FsClient *cl, const char *prefix, const char *cursor, uint64_t limit, FsCallback cb, void *arg);
+
+int fs_stat(FsClient *cl, const char *name, FsCallback cb, void *arg);
+
+int fs_mread(FsClient *cl, int n, const char *names[], FsCallback cb, void *arg);
+
+// data[i] 為 NULL (或 lens[i] 為 0) 時該檔案寫入一行簽名；data 整個為 NULL 時全部寫入簽名
+int fs_mwrite(FsClient *cl, const char *mode, int n, const char *names[], const void *data[], const size_t lens[],
+              FsCallback cb, void *arg);
+
+// 同步等待一個請求：以 fs_future_resolve 作為回呼、future 作為參數，再呼叫 fs_future_wait
+typedef struct FsFuture
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int done;
+    int status;         // 最終狀態碼
+    uint16_t flags;     // 最終回應的 flags
+    char *data;         // 最終回應的 payload (以 '\0' 結尾)
+    size_t len;
+    FsCallback notify;  // 不為 NULL 時每則回應 (包含中途通知) 也轉給它
+    void *notify_arg;
+} FsFuture;
+
+void fs_future_init(FsFuture *f, FsCallback notify, void *notify_arg);
+void fs_future_resolve(const FsReply *reply, void *future);
+
+// 等到最終回應，回傳狀態碼
+int fs_future_wait(FsFuture *f);
+void fs_future_destroy(FsFuture *f);
+
+#endif
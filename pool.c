@@ -0,0 +1,233 @@
+/*
+ * pool.c - 背景工作執行緒池 (work stealing)
+ * 功能：每個工作執行緒擁有一個環狀 deque。
+ *       自己從底端 (bottom) 取最新的工作，其他執行緒從頂端 (top) 偷最舊的工作；
+ *       外部 (事件迴圈) 送進來的工作輪流分配到各 deque。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "pool.h"
+
+typedef struct
+{
+    TaskFunc fn;
+    void *arg;
+} Task;
+
+// 每個工作執行緒的 deque (以 mutex 保護，臨界區只有幾個指令)
+typedef struct
+{
+    pthread_mutex_t lock;
+    Task *ring;    // 環狀陣列，容量為 ring_cap
+    size_t top;    // 下一個被偷的位置
+    size_t bottom; // 下一個放入的位置
+} Worker;
+
+static Worker *workers;
+static int worker_count;
+static size_t ring_cap;
+static int queue_limit;
+
+static atomic_int queued;      // 所有 deque 中排隊的工作總數 (用於 admission control)
+static atomic_ulong rejected;  // 因佇列已滿而拒絕的工作數 (統計用)
+static atomic_int sleepers;    // 正在休眠的工作執行緒數
+static atomic_uint next_worker; // 外部送入工作時輪流選擇 deque
+static pthread_mutex_t idle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+static pthread_mutex_t overflow_mutex = PTHREAD_MUTEX_INITIALIZER;
+static PoolNode *overflow_head, *overflow_tail; // pool_continue 在佇列已滿時放進來的工作 (FIFO)
+static atomic_int overflowed;                    // 溢出佇列中的工作數 (不持鎖檢查用)
+
+static __thread int self_id = -1; // 目前執行緒在池中的編號 (非工作執行緒為 -1)
+
+static int deque_push(Worker *w, TaskFunc fn, void *arg)
+{
+    int ok = 0;
+    pthread_mutex_lock(&w->lock);
+    if (w->bottom - w->top < ring_cap)
+    {
+        w->ring[w->bottom % ring_cap] = (Task){fn, arg};
+        w->bottom++;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return ok;
+}
+
+// 擁有者從底端取 (LIFO，快取較熱)
+static int deque_pop(Worker *w, Task *out)
+{
+    int ok = 0;
+    pthread_mutex_lock(&w->lock);
+    if (w->bottom != w->top)
+    {
+        w->bottom--;
+        *out = w->ring[w->bottom % ring_cap];
+        ok = 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return ok;
+}
+
+// 其他執行緒從頂端偷 (FIFO，先到的工作先被執行)
+static int deque_steal(Worker *w, Task *out)
+{
+    int ok = 0;
+    if (pthread_mutex_trylock(&w->lock) != 0)
+        return 0; // 對方正忙著操作 deque，換下一個目標
+    if (w->bottom != w->top)
+    {
+        *out = w->ring[w->top % ring_cap];
+        w->top++;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return ok;
+}
+
+static int overflow_pop(Task *out)
+{
+    pthread_mutex_lock(&overflow_mutex);
+    PoolNode *n = overflow_head;
+    if (n)
+    {
+        overflow_head = n->next;
+        if (!overflow_head)
+            overflow_tail = NULL;
+        atomic_fetch_sub(&overflowed, 1);
+        *out = (Task){n->fn, n->arg};
+    }
+    pthread_mutex_unlock(&overflow_mutex);
+    return n != NULL;
+}
+
+// 溢出佇列中的工作屬於已經在處理中的請求，先於 deque 中的新工作執行
+static int find_task(int id, Task *out)
+{
+    if (atomic_load_explicit(&overflowed, memory_order_relaxed) > 0 && overflow_pop(out))
+        return 1;
+    if (deque_pop(&workers[id], out))
+        return 1;
+    for (int i = 1; i < worker_count; i++)
+        if (deque_steal(&workers[(id + i) % worker_count], out))
+            return 1;
+    return 0;
+}
+
+static void *worker_main(void *arg)
+{
+    int id = (int)(long)arg;
+    Task t;
+
+    self_id = id;
+    while (1)
+    {
+        if (find_task(id, &t))
+        {
+            atomic_fetch_sub(&queued, 1);
+            t.fn(t.arg);
+            continue;
+        }
+
+        // 沒有工作：登記為休眠者後再確認一次，避免與 pool_submit 錯過喚醒
+        pthread_mutex_lock(&idle_mutex);
+        atomic_fetch_add(&sleepers, 1);
+        while (atomic_load(&queued) == 0)
+            pthread_cond_wait(&idle_cond, &idle_mutex);
+        atomic_fetch_sub(&sleepers, 1);
+        pthread_mutex_unlock(&idle_mutex);
+    }
+    return NULL;
+}
+
+void pool_init(int nthreads, int max_queued)
+{
+    worker_count = nthreads;
+    queue_limit = max_queued;
+    ring_cap = max_queued; // 每個 deque 都能放下全部排隊的工作，push 只會被總量限制擋下
+    workers = calloc(nthreads, sizeof(Worker));
+
+    for (int i = 0; i < nthreads; i++)
+    {
+        pthread_mutex_init(&workers[i].lock, NULL);
+        workers[i].ring = malloc(ring_cap * sizeof(Task));
+    }
+    for (int i = 0; i < nthreads; i++)
+    {
+        pthread_t tid;
+        pthread_create(&tid, NULL, worker_main, (void *)(long)i);
+        pthread_detach(tid);
+    }
+}
+
+static void wake_one(void)
+{
+    if (atomic_load(&sleepers) > 0)
+    {
+        pthread_mutex_lock(&idle_mutex);
+        pthread_cond_signal(&idle_cond);
+        pthread_mutex_unlock(&idle_mutex);
+    }
+}
+
+// 放進 deque；超過上限時回傳 -1
+static int submit(TaskFunc fn, void *arg)
+{
+    // admission control：先預留名額，超過上限就拒絕
+    if (atomic_fetch_add(&queued, 1) >= queue_limit)
+    {
+        atomic_fetch_sub(&queued, 1);
+        return -1;
+    }
+
+    // 工作執行緒自己產生的工作放在自己的 deque；外部工作輪流分配
+    int id = self_id >= 0 ? self_id : (int)(atomic_fetch_add(&next_worker, 1) % worker_count);
+    while (!deque_push(&workers[id], fn, arg))
+        id = (id + 1) % worker_count;
+
+    wake_one();
+    return 0;
+}
+
+int pool_submit(TaskFunc fn, void *arg)
+{
+    if (submit(fn, arg) == 0)
+        return 0;
+    atomic_fetch_add_explicit(&rejected, 1, memory_order_relaxed);
+    return -1;
+}
+
+void pool_continue(PoolNode *node, TaskFunc fn, void *arg)
+{
+    if (submit(fn, arg) == 0)
+        return;
+
+    atomic_fetch_add(&queued, 1); // 超過上限也計入，讓新請求在消化完之前被拒絕 (先計入，取出時才扣除)
+    node->next = NULL;
+    node->fn = fn;
+    node->arg = arg;
+    pthread_mutex_lock(&overflow_mutex);
+    if (overflow_tail)
+        overflow_tail->next = node;
+    else
+        overflow_head = node;
+    overflow_tail = node;
+    atomic_fetch_add(&overflowed, 1);
+    pthread_mutex_unlock(&overflow_mutex);
+    wake_one();
+}
+
+int pool_queued(void)
+{
+    return atomic_load_explicit(&queued, memory_order_relaxed);
+}
+
+unsigned long pool_rejected(void)
+{
+    return atomic_load_explicit(&rejected, memory_order_relaxed);
+}
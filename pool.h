@@ -0,0 +1,41 @@
+/*
+ * pool.h - 背景工作執行緒池
+ * 功能：事件迴圈不能阻塞，會睡眠或等待讀寫鎖的指令交給固定數量的工作執行緒執行。
+ *       每個工作執行緒有自己的 deque，閒置時向其他執行緒偷工作；
+ *       佇列總長度有上限，超過時拒絕新工作 (由呼叫者回覆「忙碌」)。
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#define POOL_THREADS_PER_CORE 4 // 預設每個 CPU 核心的工作執行緒數
+#define POOL_DEFAULT_QUEUE 1024 // 預設最多排隊的工作數
+
+typedef void (*TaskFunc)(void *arg);
+
+// 建立 nthreads 個工作執行緒，最多允許 max_queued 個工作排隊等待
+void pool_init(int nthreads, int max_queued);
+
+// 把工作放進佇列，由任一工作執行緒執行
+// 回傳 0 表示已接受；-1 表示佇列已滿 (過載)，工作不會被執行
+int pool_submit(TaskFunc fn, void *arg);
+
+// pool_continue 的工作節點 (由呼叫者配置，工作開始執行前不可釋放)
+typedef struct PoolNode
+{
+    struct PoolNode *next;
+    TaskFunc fn;
+    void *arg;
+} PoolNode;
+
+// 已接受請求的後續工作 (例如取得檔案鎖之後的 continuation)：不受佇列上限限制、不會失敗，
+// 呼叫者不必 (也不可) 在目前的執行緒上自己執行；佇列已滿時放進以 node 串起的溢出佇列，由工作執行緒優先取出
+void pool_continue(PoolNode *node, TaskFunc fn, void *arg);
+
+// 目前排隊中的工作數 (統計用)
+int pool_queued(void);
+
+// 啟動以來因佇列已滿而被拒絕的工作數
+unsigned long pool_rejected(void);
+
+#endif
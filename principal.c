@@ -0,0 +1,207 @@
+/*
+ * principal.c - 使用者、群組與權限位元
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "principal.h"
+
+#define USER_BUCKETS 1024
+#define NAME_LEN 50
+
+// 使用者名稱 -> ID (只在登入時查詢，以單一 mutex 保護的鏈結雜湊表即可)
+typedef struct UserName
+{
+    struct UserName *next;
+    uint32_t id;
+    char name[NAME_LEN];
+} UserName;
+
+// 群組 (ID 為在表中的索引，啟動時載入後不再變動)
+typedef struct
+{
+    char name[NAME_LEN];
+    int any;        // 1: 成員 *，任何使用者都可以用這個群組登入
+    char **members; // 明確列出的成員 (也會成為他們用其他群組登入時的附加群組)
+    int nmembers;
+} Group;
+
+static pthread_mutex_t user_mutex = PTHREAD_MUTEX_INITIALIZER;
+static UserName *users[USER_BUCKETS];
+static uint32_t next_uid = 1;
+
+static Group groups[PRINCIPAL_MAX_GROUPS];
+static int ngroups;
+static char group_list[PRINCIPAL_MAX_GROUPS * (NAME_LEN + 6)];
+
+static uint32_t hash_name(const char *s)
+{
+    uint32_t h = 2166136261u; // FNV-1a
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+static int add_group(const char *name)
+{
+    if (ngroups == PRINCIPAL_MAX_GROUPS || strlen(name) >= NAME_LEN)
+        return -1;
+    snprintf(groups[ngroups].name, NAME_LEN, "%s", name);
+    return ngroups++;
+}
+
+static void add_member(Group *g, const char *user)
+{
+    if (strcmp(user, "*") == 0)
+    {
+        g->any = 1;
+        return;
+    }
+    g->members = realloc(g->members, (g->nmembers + 1) * sizeof(char *));
+    g->members[g->nmembers++] = strdup(user);
+}
+
+static int is_member(const Group *g, const char *user)
+{
+    for (int i = 0; i < g->nmembers; i++)
+        if (strcmp(g->members[i], user) == 0)
+            return 1;
+    return 0;
+}
+
+static void build_group_list(void)
+{
+    size_t len = 0;
+    group_list[0] = '\0';
+    for (int i = 0; i < ngroups; i++)
+    {
+        const char *sep = i == 0 ? "" : i == ngroups - 1 ? " or " : ", ";
+        len += snprintf(group_list + len, sizeof(group_list) - len, "%s'%s'", sep, groups[i].name);
+    }
+}
+
+int principal_load_groups(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+    {
+        if (errno != ENOENT)
+            return -1;
+        // 沒有設定檔：沿用原本只允許 AOS-group、CSE-group 的規則
+        add_member(&groups[add_group("AOS-group")], "*");
+        add_member(&groups[add_group("CSE-group")], "*");
+        build_group_list();
+        return 0;
+    }
+
+    char line[1024];
+    int ret = 0;
+    while (ret == 0 && fgets(line, sizeof(line), fp))
+    {
+        char *colon = strchr(line, ':');
+        char *name = strtok(line, " \t\r\n:");
+        if (!name || name[0] == '#')
+            continue; // 空行或註解
+        int gid;
+        if (!colon || (gid = add_group(name)) < 0)
+        {
+            ret = -1;
+            break;
+        }
+        for (char *m = strtok(colon + 1, " \t\r\n,"); m; m = strtok(NULL, " \t\r\n,"))
+            add_member(&groups[gid], m);
+    }
+    fclose(fp);
+    build_group_list();
+    return ret;
+}
+
+// 取得使用者 ID，第一次出現的名稱配置新的 ID
+static uint32_t intern_user(const char *name)
+{
+    uint32_t b = hash_name(name) % USER_BUCKETS, id;
+
+    pthread_mutex_lock(&user_mutex);
+    UserName *u = users[b];
+    while (u && strcmp(u->name, name) != 0)
+        u = u->next;
+    if (!u)
+    {
+        u = calloc(1, sizeof(UserName));
+        snprintf(u->name, NAME_LEN, "%s", name);
+        u->id = next_uid++;
+        u->next = users[b];
+        users[b] = u;
+    }
+    id = u->id;
+    pthread_mutex_unlock(&user_mutex);
+    return id;
+}
+
+int principal_login(const char *user, const char *group, Principal *p)
+{
+    int gid = -1;
+
+    for (int i = 0; i < ngroups; i++)
+        if (strcmp(groups[i].name, group) == 0)
+            gid = i;
+    if (user[0] == '\0' || gid < 0 || !(groups[gid].any || is_member(&groups[gid], user)))
+        return -1;
+
+    // 登入的群組加上設定檔中明確列出這個使用者的其他群組
+    p->uid = intern_user(user);
+    p->gid = gid;
+    p->groups = 1ULL << gid;
+    for (int i = 0; i < ngroups; i++)
+        if (is_member(&groups[i], user))
+            p->groups |= 1ULL << i;
+    return 0;
+}
+
+uint32_t principal_user_id(const char *user)
+{
+    return intern_user(user);
+}
+
+uint32_t principal_group_id(const char *group)
+{
+    for (int i = 0; i < ngroups; i++)
+        if (strcmp(groups[i].name, group) == 0)
+            return i;
+    return PRINCIPAL_NO_GROUP;
+}
+
+const char *principal_group_list(void)
+{
+    return group_list;
+}
+
+int perm_compile(const char *perms)
+{
+    int bits = 0;
+
+    if (strlen(perms) != 6)
+        return -1;
+    for (int i = 0; i < 6; i++)
+    {
+        char want = i % 2 == 0 ? 'r' : 'w'; // 偶數索引為讀取位元，奇數索引為寫入位元
+        if (perms[i] == want)
+            bits |= 1 << i;
+        else if (perms[i] != 'n')
+            return -1;
+    }
+    return bits;
+}
+
+int perm_check(uint8_t bits, uint32_t owner, uint32_t gid, const Principal *p, int mode)
+{
+    int member = gid < PRINCIPAL_MAX_GROUPS && ((p->groups >> gid) & 1);
+    int shift = owner == p->uid ? PERM_SHIFT_OWNER
+                : member        ? PERM_SHIFT_GROUP
+                                : PERM_SHIFT_OTHER;
+    return (bits >> shift) & mode;
+}
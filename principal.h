@@ -0,0 +1,53 @@
+/*
+ * principal.h - 使用者、群組與權限位元
+ * 功能：登入時把使用者與群組名稱轉成整數 ID (intern)，群組成員由設定檔載入；
+ *       權限字串在 new/change 時編譯成位元遮罩，每次存取檢查只需要幾個整數運算。
+ */
+
+#ifndef PRINCIPAL_H
+#define PRINCIPAL_H
+
+#include <stdint.h>
+
+#define PRINCIPAL_MAX_GROUPS 64             // 群組數上限 (使用者所屬群組以 64 位元遮罩表示)
+#define PRINCIPAL_NO_GROUP PRINCIPAL_MAX_GROUPS // 設定檔中已不存在的群組 (沒有任何使用者屬於它)
+#define PRINCIPAL_DEFAULT_CONFIG "groups.conf"
+
+// 權限位元：每個身分 2 個位元 (讀、寫)，依 擁有者/群組/其他人 排列，對應權限字串的 6 碼
+#define PERM_READ 1
+#define PERM_WRITE 2
+#define PERM_SHIFT_OWNER 0
+#define PERM_SHIFT_GROUP 2
+#define PERM_SHIFT_OTHER 4
+
+// 登入成功後連線的身分
+typedef struct
+{
+    uint32_t uid;    // 使用者 ID (從 1 開始)
+    uint32_t gid;    // 登入時選擇的群組 (新檔案的所屬群組)
+    uint64_t groups; // 所屬的所有群組 (第 gid 個位元)
+} Principal;
+
+// 載入群組設定檔，每行格式為 "群組: 成員 成員 ..."，成員 * 代表任何使用者都可以用這個群組登入
+// 檔案不存在時使用預設的 AOS-group、CSE-group；格式錯誤回傳 -1
+int principal_load_groups(const char *path);
+
+// 驗證登入：群組必須存在且使用者是其成員，成功回傳 0 並填入 *p
+int principal_login(const char *user, const char *group, Principal *p);
+
+// 依名稱取得使用者 ID (第一次出現的名稱配置新的 ID)；用於從持久目錄載入的檔案擁有者
+uint32_t principal_user_id(const char *user);
+
+// 依名稱取得群組 ID，不存在時回傳 PRINCIPAL_NO_GROUP
+uint32_t principal_group_id(const char *group);
+
+// 允許的群組清單 (登入失敗訊息用)，例如 "'AOS-group' or 'CSE-group'"
+const char *principal_group_list(void);
+
+// 把權限字串 (6 碼，奇數位為 r/n，偶數位為 w/n) 編譯成位元遮罩，格式錯誤回傳 -1
+int perm_compile(const char *perms);
+
+// 存取檢查：依身分 (擁有者 > 同群組 > 其他人) 取出對應的 2 個位元，mode 為 PERM_READ 或 PERM_WRITE
+int perm_check(uint8_t bits, uint32_t owner, uint32_t gid, const Principal *p, int mode);
+
+#endif
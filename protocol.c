@@ -0,0 +1,106 @@
+/*
+ * protocol.c - 二進位傳輸協定的編碼與解碼
+ */
+
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+
+void proto_encode_header(unsigned char *out, const FrameHeader *h)
+{
+    uint16_t flags = htons(h->flags);
+    uint32_t req_id = htonl(h->req_id);
+    uint32_t length = htonl(h->length);
+
+    out[0] = PROTO_MAGIC;
+    out[1] = PROTO_VERSION;
+    out[2] = h->opcode;
+    out[3] = h->status;
+    memcpy(out + 4, &flags, 2);
+    memset(out + 6, 0, 2);
+    memcpy(out + 8, &req_id, 4);
+    memcpy(out + 12, &length, 4);
+}
+
+int proto_decode_header(const unsigned char *in, FrameHeader *h)
+{
+    uint16_t flags;
+    uint32_t req_id, length;
+
+    if (in[0] != PROTO_MAGIC || in[1] != PROTO_VERSION)
+        return -1;
+    memcpy(&flags, in + 4, 2);
+    memcpy(&req_id, in + 8, 4);
+    memcpy(&length, in + 12, 4);
+    h->opcode = in[2];
+    h->status = in[3];
+    h->flags = ntohs(flags);
+    h->req_id = ntohl(req_id);
+    h->length = ntohl(length);
+    return 0;
+}
+
+int proto_put_field(unsigned char *buf, size_t cap, size_t *off, const void *data, size_t len)
+{
+    uint16_t n = htons((uint16_t)len);
+
+    if (len > 0xFFFF || *off + 2 + len > cap)
+        return -1;
+    memcpy(buf + *off, &n, 2);
+    memcpy(buf + *off + 2, data, len);
+    *off += 2 + len;
+    return 0;
+}
+
+int proto_get_field(const unsigned char *payload, size_t len, size_t *off,
+                    const unsigned char **data, size_t *flen)
+{
+    uint16_t n;
+
+    if (*off + 2 > len)
+        return -1;
+    memcpy(&n, payload + *off, 2);
+    n = ntohs(n);
+    if (*off + 2 + n > len)
+        return -1;
+    *data = payload + *off + 2;
+    *flen = n;
+    *off += 2 + n;
+    return 0;
+}
+
+int proto_get_string(const unsigned char *payload, size_t len, size_t *off, char *out, size_t cap)
+{
+    const unsigned char *data;
+    size_t flen;
+
+    if (proto_get_field(payload, len, off, &data, &flen) < 0 || flen >= cap)
+        return -1;
+    if (memchr(data, '\0', flen) != NULL) // 字串欄位不可內含 '\0'
+        return -1;
+    memcpy(out, data, flen);
+    out[flen] = '\0';
+    return 0;
+}
+
+int proto_put_u64(unsigned char *buf, size_t cap, size_t *off, uint64_t value)
+{
+    unsigned char be[8];
+    for (int i = 0; i < 8; i++)
+        be[i] = (unsigned char)(value >> (56 - 8 * i));
+    return proto_put_field(buf, cap, off, be, 8);
+}
+
+int proto_get_u64(const unsigned char *payload, size_t len, size_t *off, uint64_t *value)
+{
+    const unsigned char *data;
+    size_t flen;
+
+    if (proto_get_field(payload, len, off, &data, &flen) < 0 || flen != 8)
+        return -1;
+    *value = 0;
+    for (int i = 0; i < 8; i++)
+        *value = (*value << 8) | data[i];
+    return 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * protocol.h - 二進位傳輸協定 (server 與 client 共用)
+ * 功能：每個 frame = 16 bytes 標頭 + payload。標頭帶有 request id、opcode、狀態碼與 payload 長度，
+ *       因此不受 TCP 合併/切割影響，一條連線也可以同時送出多個請求 (pipelining)。
+ *
+ * 標頭格式 (多位元組欄位一律為 network byte order)：
+ *   0      1        2       3       4-5     6-7       8-11     12-15
+ *   magic  version  opcode  status  flags   reserved  req_id   length
+ *
+ * 請求的 payload 由多個欄位組成，每個欄位為 [u16 長度][內容]；
+ * 回應的 payload 則是訊息文字或檔案內容。
+ * 第一個 byte 為 PROTO_MAGIC (非 ASCII) 的連線使用二進位協定，否則視為舊版文字協定。
+ * 同一台機器上的客戶端也可以連到 unix socket (PROTO_UNIX_PATH)；第一個 byte 為 PROTO_SHM_MAGIC 時
+ * 改用共享記憶體 ring (shmring.h) 傳送同樣的 frame，socket 只用來交換 fd 與偵測斷線。
+ */
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PROTO_MAGIC 0xF5
+#define PROTO_VERSION 1
+#define PROTO_HEADER_SIZE 16
+#define PROTO_MAX_PAYLOAD (256 * 1024) // 單一 frame payload 上限
+#define PROTO_MAX_INFLIGHT 64          // 每條連線同時處理中的請求上限
+#define PROTO_MAX_FILES 1024           // mread / mwrite 一次最多的檔案數
+#define PROTO_LIST_DEFAULT 100         // list 未指定筆數時每頁的檔案數
+#define PROTO_LIST_MAX 1000            // list 每頁最多的檔案數
+#define PROTO_SHM_MAGIC 0xF6           // unix socket 上的共享記憶體交握 (隨附 SCM_RIGHTS 的 fd)
+#define PROTO_UNIX_PATH ".server.sock" // unix socket 的預設路徑 (相對於伺服器的工作目錄)
+
+// 指令 (opcode)
+enum
+{
+    OP_LOGIN = 1,  // 欄位: 使用者, 群組
+    OP_NEW = 2,    // 欄位: 檔名, 權限
+    OP_READ = 3,   // 欄位: 檔名 [, offset (u64)] [, length (u64)]；回應 payload 為檔案內容
+    OP_WRITE = 4,      // 欄位: 檔名, 模式 (o/a/p)[, p 模式的 u64 offset]；之後剩餘的 payload 為寫入資料 (需設定 FLAG_DATA)
+    OP_CHANGE = 5,     // 欄位: 檔名, 權限
+    OP_WRITE_DATA = 6, // 同一個 write 請求的後續資料 (req_id 相同，payload 全部是資料)
+    OP_STATS = 7,      // 沒有欄位；回應 payload 為 JSON 格式的伺服器統計
+    OP_LIST = 8,       // 欄位: [前綴] [, cursor] [, 筆數 (u64)]；回應每行一個檔案 "權限 擁有者 群組 檔名"，
+                       // 設定 FLAG_MORE 表示還有下一頁 (以這頁最後一個檔名作為 cursor)
+    OP_STAT = 9,       // 欄位: 檔名；回應 "權限 擁有者 群組 長度 版本 檔名"
+    OP_MREAD = 10,     // 欄位: 檔名, 檔名, ...；每個檔案一個 ST_PART 回應，最後是 ST_OK 的摘要
+    OP_MWRITE = 11     // 欄位: 模式 (o/a), 然後每個檔案一組 [檔名] [資料] (資料欄位為空時寫入預設的一行)
+};
+
+// 標頭 flags
+#define FLAG_MORE 0x1 // 這個請求還有後續的 OP_WRITE_DATA frame (list 的回應：還有下一頁)
+#define FLAG_DATA 0x2 // write 請求帶有客戶端資料 (未設定時寫入預設的 "xxx wrote here at ..." 一行)
+
+
+// 回應狀態碼：小於 ST_FINAL 的是中途通知，同一個請求之後還會有最終回應
+enum
+{
+    ST_WAITING = 1,      // 檔案正被他人使用，請求排隊中
+    ST_GRANTED = 2,      // 已取得檔案鎖，開始處理
+    ST_PART = 3,         // mread / mwrite 其中一個檔案的結果：payload 為 [檔名] 欄位、1 byte 狀態碼，之後為內容或訊息
+    ST_FINAL = 16,
+    ST_OK = 16,
+    ST_ERR_BADREQ = 17,  // 格式錯誤或無效指令
+    ST_ERR_LOGIN = 18,   // 登入失敗
+    ST_ERR_NOTFOUND = 19,
+    ST_ERR_EXISTS = 20,
+    ST_ERR_PERM = 21,    // 權限不足或不是擁有者
+    ST_ERR_IO = 22,
+    ST_ERR_BUSY = 23,    // 伺服器過載，稍後再試
+    ST_ERR_REDIRECT = 24, // 複本不接受寫入：payload 為主伺服器的位址 "host:port"
+    ST_ERR_STALE = 25    // 複本的資料落後超過容許的時間：payload 為主伺服器的位址
+};
+
+typedef struct
+{
+    uint8_t opcode;
+    uint8_t status;
+    uint16_t flags;
+    uint32_t req_id;
+    uint32_t length; // payload 長度
+} FrameHeader;
+
+// 將標頭寫入 out (PROTO_HEADER_SIZE bytes)
+void proto_encode_header(unsigned char *out, const FrameHeader *h);
+
+// 解析標頭；magic 或版本不符時回傳 -1
+int proto_decode_header(const unsigned char *in, FrameHeader *h);
+
+// 在 buf[*off] 附加一個欄位，空間不足時回傳 -1
+int proto_put_field(unsigned char *buf, size_t cap, size_t *off, const void *data, size_t len);
+
+// 從 payload[*off] 取出下一個欄位，格式錯誤或已無欄位時回傳 -1
+int proto_get_field(const unsigned char *payload, size_t len, size_t *off,
+                    const unsigned char **data, size_t *flen);
+
+// 取出字串欄位並複製到 out (含結尾 '\0')，長度超過 cap - 1 時回傳 -1
+int proto_get_string(const unsigned char *payload, size_t len, size_t *off, char *out, size_t cap);
+
+// 64 位元整數欄位 (8 bytes, network byte order)
+int proto_put_u64(unsigned char *buf, size_t cap, size_t *off, uint64_t value);
+int proto_get_u64(const unsigned char *payload, size_t len, size_t *off, uint64_t *value);
+
+#endif
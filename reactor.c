@@ -0,0 +1,1185 @@
+/*
+ * reactor.c - epoll 事件迴圈 (edge-triggered)
+ * 功能：非阻塞 accept/recv/send，將完整訊息交給伺服器的處理函式。
+ *       每個事件迴圈綁定一個 CPU 並有自己的 SO_REUSEPORT 監聽 socket，由核心把新連線分散到各迴圈；
+ *       連線從 accept 到關閉都留在同一個迴圈 (同一個 CPU)，不需要跨執行緒交接。
+ *       unix socket 的連線可以在登入前送出共享記憶體交握，之後改由門鈴 (eventfd) 驅動讀取。
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/filter.h>
+#include <sched.h>
+
+#include "reactor.h"
+#include "protocol.h"
+#include "uring.h"
+#include "shmring.h"
+
+#define MAX_EVENTS 256
+#define IOV_BATCH 16             // 一次 sendmsg 最多合併的記憶體區段
+#define SENDFILE_CHUNK (1 << 20) // 每次 sendfile 最多送出的 bytes，避免單一連線獨占事件迴圈
+#define COPY_CHUNK (64 * 1024)   // 複製模式每次 pread 的 bytes 數
+#define RING_FILES 4096          // 每個事件迴圈在 io_uring 註冊的 socket 槽位數 (用完時其餘連線以一般 fd 讀取)
+#define RING_SLICE 4096          // io_uring 批次讀取時每條連線使用的接收緩衝區大小
+
+struct EventLoop
+{
+    int epfd;                // epoll file descriptor
+    int wakefd;              // eventfd：背景執行緒交回連線時喚醒事件迴圈
+    int listen_fd;           // 自己的監聽 socket (SO_REUSEPORT)；-1: 不接受連線
+    int unix_fd;             // unix socket 監聽 (只有第 0 個迴圈)；-1: 沒有
+    int cpu;                 // 綁定的 CPU (-1: 不綁定)
+    pthread_t tid;
+    pthread_mutex_t lock;    // 保護 resumed 佇列
+    Conn *resumed;           // 已處理完指令、等待繼續解析的連線
+    Conn *dead;              // 本輪 epoll_wait 中關閉的連線 (同一批事件可能還指向它們)
+
+    Uring *ring;             // io_uring (-U)；NULL: 逐一以 recv 讀取
+    char *arena;             // 註冊給 ring 的接收緩衝區 (MAX_EVENTS 個 RING_SLICE)
+    int *free_slots;         // 尚未使用的 socket 槽位
+    int nfree;
+};
+
+static EventLoop *loops;
+static int loop_count;
+static int shared_listener; // 1: 不支援 SO_REUSEPORT，只有第 0 個迴圈 accept 並輪流分配連線
+static atomic_int connections; // 目前開啟的連線數
+static MessageHandler on_message;
+static CloseHandler on_close;
+
+// 用 epoll_event.data.ptr 區分事件來源：監聽 socket 與 eventfd 用這些標記
+static char listen_tag, unix_tag, wake_tag;
+
+// 停止監聽連線的事件 (socket 與共享記憶體的門鈴)
+static void conn_unwatch(Conn *c)
+{
+    epoll_ctl(c->loop->epfd, EPOLL_CTL_DEL, c->sockfd, NULL);
+    if (c->shm)
+        epoll_ctl(c->loop->epfd, EPOLL_CTL_DEL, c->shm->bell, NULL);
+}
+
+// 關閉連線 (只在所屬事件迴圈執行緒、且連線不處於 BUSY 時呼叫)
+// 記憶體延後到本輪事件處理完才釋放，避免同一批事件中的其他項目存取到已釋放的連線
+static void conn_destroy(Conn *c)
+{
+    if (on_close)
+        on_close(c);
+    conn_unwatch(c);
+    if (c->shm)
+    {
+        shm_close(c->shm);
+        free(c->shm);
+        c->shm = NULL;
+    }
+    if (c->ring_slot >= 0)
+    {
+        // 註冊的槽位持有 socket 的參照，必須先清除，close 才會真的關閉連線
+        uring_set_file(c->loop->ring, c->ring_slot, -1);
+        c->loop->free_slots[c->loop->nfree++] = c->ring_slot;
+    }
+    close(c->sockfd);
+    atomic_fetch_sub_explicit(&connections, 1, memory_order_relaxed);
+    c->dead = 1;
+    c->next_dead = c->loop->dead;
+    c->loop->dead = c;
+}
+
+static void chunk_free(OutChunk *ch)
+{
+    if (ch->release)
+        ch->release(ch->release_arg);
+    free(ch);
+}
+
+// 送完的區段 (呼叫者持有 out_lock)：release 可能要取得其他鎖 (例如檔案鎖)，那些鎖的持有者也可能正要送出回應，
+// 因此先放進 out_done，等 conn_unlock_out 釋放 out_lock 之後才呼叫
+static void chunk_retire(Conn *c, OutChunk *ch)
+{
+    if (!ch->release)
+    {
+        free(ch);
+        return;
+    }
+    ch->next = c->out_done;
+    c->out_done = ch;
+}
+
+// 釋放 out_lock，之後才釋放期間送完的區段
+static void conn_unlock_out(Conn *c)
+{
+    OutChunk *done = c->out_done;
+    c->out_done = NULL;
+    pthread_mutex_unlock(&c->out_lock);
+    while (done)
+    {
+        OutChunk *next = done->next;
+        chunk_free(done);
+        done = next;
+    }
+}
+
+static void loop_free_dead(EventLoop *self)
+{
+    while (self->dead)
+    {
+        Conn *c = self->dead;
+        self->dead = c->next_dead;
+        while (c->out_head)
+        {
+            OutChunk *ch = c->out_head;
+            c->out_head = ch->next;
+            chunk_free(ch);
+        }
+        pthread_mutex_destroy(&c->out_lock);
+        free(c->inbuf);
+        free(c);
+    }
+}
+
+// 送出連續的記憶體區段 (以 sendmsg 合併成一次系統呼叫)
+static ssize_t flush_memory(Conn *c)
+{
+    struct iovec iov[IOV_BATCH];
+    struct msghdr mh;
+    int cnt = 0;
+
+    for (OutChunk *ch = c->out_head; ch && ch->fd < 0 && cnt < IOV_BATCH; ch = ch->next)
+    {
+        iov[cnt].iov_base = (void *)ch->data;
+        iov[cnt].iov_len = ch->len;
+        cnt++;
+    }
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = iov;
+    mh.msg_iovlen = cnt;
+    ssize_t n = sendmsg(c->sockfd, &mh, MSG_NOSIGNAL);
+
+    // 依送出的 bytes 數前進，送完的區段釋放
+    for (ssize_t left = n; left > 0;)
+    {
+        OutChunk *ch = c->out_head;
+        size_t step = (size_t)left < ch->len ? (size_t)left : ch->len;
+        ch->data += step;
+        ch->len -= step;
+        left -= step;
+        if (ch->len == 0)
+        {
+            c->out_head = ch->next;
+            chunk_retire(c, ch);
+        }
+    }
+    return n;
+}
+
+// 送出檔案區段：sendfile 直接從 page cache 複製到 socket
+static ssize_t flush_file(Conn *c)
+{
+    static const char zeros[4096];
+    OutChunk *ch = c->out_head;
+    size_t want = ch->len < SENDFILE_CHUNK ? ch->len : SENDFILE_CHUNK;
+    ssize_t n;
+
+    if (ch->zero_fill)
+        n = send(c->sockfd, zeros, want < sizeof(zeros) ? want : sizeof(zeros), MSG_NOSIGNAL);
+    else if (ch->copy)
+    {
+        // 複製模式：送出的內容在 send 返回時已複製進 socket，之後檔案被修改也不影響
+        static __thread char buf[COPY_CHUNK];
+        n = pread(ch->fd, buf, want < sizeof(buf) ? want : sizeof(buf), ch->file_off);
+        if (n == 0)
+        {
+            ch->zero_fill = 1;
+            return 1;
+        }
+        if (n > 0 && (n = send(c->sockfd, buf, n, MSG_NOSIGNAL)) > 0)
+            ch->file_off += n;
+    }
+    else
+    {
+        n = sendfile(c->sockfd, ch->fd, &ch->file_off, want);
+        if (n == 0)
+        {
+            // 檔案在送出途中被截短：標頭已宣告長度，只能補 0 維持 frame 邊界
+            ch->zero_fill = 1;
+            return 1;
+        }
+    }
+    if (n > 0)
+    {
+        ch->len -= n;
+        if (ch->len == 0)
+        {
+            c->out_head = ch->next;
+            chunk_retire(c, ch);
+        }
+    }
+    return n;
+}
+
+// 共享記憶體：依序把輸出佇列複製進回應 ring (檔案區段以 pread 直接讀進 ring)，最後一次公開
+// ring 已滿時表明在等空間，客戶端讀取後敲門鈴再繼續送
+static ssize_t flush_shm(Conn *c)
+{
+    char *dst;
+    ssize_t room = shm_writable(c->shm, &dst), total = 0;
+
+    if (room < 0)
+    {
+        errno = EPROTO; // 客戶端破壞了 ring 的索引
+        return -1;
+    }
+    if (room == 0)
+    {
+        if (shm_wait_space(c->shm))
+            return 1;
+        errno = EAGAIN;
+        return -1;
+    }
+    while (c->out_head && total < room)
+    {
+        OutChunk *ch = c->out_head;
+        size_t want = ch->len < (size_t)(room - total) ? ch->len : (size_t)(room - total);
+        ssize_t n = want;
+
+        if (ch->fd < 0)
+        {
+            memcpy(dst + total, ch->data, want);
+            ch->data += want;
+        }
+        else if (ch->zero_fill)
+            memset(dst + total, 0, want);
+        else if ((n = pread(ch->fd, dst + total, want, ch->file_off)) > 0)
+            ch->file_off += n;
+        else if (n == 0)
+        {
+            // 與 flush_file 相同：檔案在送出途中被截短，以 0 補齊
+            ch->zero_fill = 1;
+            continue;
+        }
+        else
+            break;
+        total += n;
+        ch->len -= n;
+        if (ch->len == 0)
+        {
+            c->out_head = ch->next;
+            chunk_retire(c, ch);
+        }
+    }
+    if (total == 0)
+        return -1; // pread 失敗 (errno 已設定)
+    shm_produce(c->shm, total);
+    return total;
+}
+
+// 盡可能送出輸出佇列 (呼叫者需持有 out_lock)
+static void conn_flush_locked(Conn *c)
+{
+    while (c->out_head)
+    {
+        ssize_t n = c->shm ? flush_shm(c) : c->out_head->fd < 0 ? flush_memory(c) : flush_file(c);
+        if (n > 0)
+            continue;
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break; // socket 緩衝區 (或回應 ring) 已滿，等 EPOLLOUT (或門鈴) 再送
+        // 連線錯誤：丟棄剩餘資料，由事件迴圈偵測斷線
+        while (c->out_head)
+        {
+            OutChunk *ch = c->out_head;
+            c->out_head = ch->next;
+            chunk_retire(c, ch);
+        }
+    }
+    if (c->out_head == NULL)
+        c->out_tail = NULL;
+}
+
+static OutChunk *chunk_new_memory(const char *data, size_t len)
+{
+    OutChunk *ch = malloc(sizeof(OutChunk) + len);
+    memset(ch, 0, sizeof(OutChunk));
+    ch->fd = -1;
+    memcpy(ch->inline_data, data, len);
+    ch->data = ch->inline_data;
+    ch->len = len;
+    return ch;
+}
+
+static void conn_enqueue_locked(Conn *c, OutChunk *ch)
+{
+    if (c->out_tail)
+        c->out_tail->next = ch;
+    else
+        c->out_head = ch;
+    c->out_tail = ch;
+}
+
+// 共享記憶體連線且沒有排隊中的資料：直接複製進回應 ring，不必配置輸出區段
+static int conn_send_shm(Conn *c, const char *data, size_t len)
+{
+    char *dst;
+    int done = 0;
+
+    pthread_mutex_lock(&c->out_lock);
+    if (c->out_head == NULL && shm_writable(c->shm, &dst) >= (ssize_t)len)
+    {
+        memcpy(dst, data, len);
+        shm_produce(c->shm, len);
+        done = 1;
+    }
+    pthread_mutex_unlock(&c->out_lock);
+    return done;
+}
+
+void conn_send(Conn *c, const char *data, size_t len)
+{
+    if (len == 0)
+        return;
+    if (c->shm && conn_send_shm(c, data, len))
+        return;
+    OutChunk *ch = chunk_new_memory(data, len);
+
+    pthread_mutex_lock(&c->out_lock);
+    conn_enqueue_locked(c, ch);
+    conn_flush_locked(c);
+    conn_unlock_out(c);
+}
+
+void conn_send_file(Conn *c, const char *prefix, size_t prefix_len, int fd, off_t offset, size_t len, int copy,
+                    ReleaseFunc release, void *release_arg)
+{
+    OutChunk *head = prefix_len > 0 ? chunk_new_memory(prefix, prefix_len) : NULL;
+    OutChunk *file = calloc(1, sizeof(OutChunk));
+
+    file->fd = fd;
+    file->file_off = offset;
+    file->len = len;
+    file->copy = copy;
+    file->release = release;
+    file->release_arg = release_arg;
+
+    pthread_mutex_lock(&c->out_lock);
+    if (head)
+        conn_enqueue_locked(c, head);
+    if (len > 0)
+        conn_enqueue_locked(c, file);
+    conn_flush_locked(c);
+    conn_unlock_out(c);
+
+    if (len == 0)
+        chunk_free(file); // 沒有內容要送，直接釋放來源
+}
+
+void conn_send_buffer(Conn *c, const char *prefix, size_t prefix_len, const char *data, size_t len,
+                      ReleaseFunc release, void *release_arg)
+{
+    OutChunk *head = prefix_len > 0 ? chunk_new_memory(prefix, prefix_len) : NULL;
+    OutChunk *body = calloc(1, sizeof(OutChunk));
+
+    // 外部緩衝區直接放進佇列，與 prefix 在同一次 sendmsg 中送出
+    body->fd = -1;
+    body->data = data;
+    body->len = len;
+    body->release = release;
+    body->release_arg = release_arg;
+
+    pthread_mutex_lock(&c->out_lock);
+    if (head)
+        conn_enqueue_locked(c, head);
+    if (len > 0)
+        conn_enqueue_locked(c, body);
+    conn_flush_locked(c);
+    conn_unlock_out(c);
+
+    if (len == 0)
+        chunk_free(body);
+}
+
+static int conn_max_inflight(Conn *c)
+{
+    return c->binary ? PROTO_MAX_INFLIGHT : 1;
+}
+
+void conn_begin_request(Conn *c)
+{
+    c->inflight++;
+    if (c->inflight >= conn_max_inflight(c))
+        c->state = CONN_BUSY; // 暫停解析，直到有請求完成
+}
+
+void conn_pause(Conn *c)
+{
+    c->inflight++;
+    c->state = CONN_BUSY;
+}
+
+void conn_end_request(Conn *c)
+{
+    EventLoop *loop = c->loop;
+    uint64_t one = 1;
+
+    // 同一條連線可能有多個請求同時完成：只有第一個負責把連線放進佇列
+    if (atomic_fetch_add(&c->done, 1) != 0)
+        return;
+
+    pthread_mutex_lock(&loop->lock);
+    c->next_resumed = loop->resumed;
+    loop->resumed = c;
+    pthread_mutex_unlock(&loop->lock);
+
+    if (write(loop->wakefd, &one, sizeof(one)) < 0)
+        perror("eventfd write");
+}
+
+// 文字協定沒有長度標頭：以換行分隔；若對方沒有送換行 (舊版 client)，
+// 則把「這次讀完時」緩衝區內剩下的資料視為一則訊息。
+// 回傳 1 表示處理了一則訊息，0 表示資料不足。
+static int conn_next_text(Conn *c, int drained)
+{
+    char msg[BUFFER_SIZE + 1];
+    char *nl = memchr(c->inbuf, '\n', c->inlen);
+    size_t msglen, consumed;
+
+    if (nl)
+    {
+        msglen = nl - c->inbuf;
+        consumed = msglen + 1;
+    }
+    else if (drained || c->inlen == c->incap)
+    {
+        msglen = c->inlen;
+        consumed = c->inlen;
+    }
+    else
+        return 0; // 訊息尚未收完整
+
+    memcpy(msg, c->inbuf, msglen);
+    msg[msglen] = '\0';
+    memmove(c->inbuf, c->inbuf + consumed, c->inlen - consumed);
+    c->inlen -= consumed;
+
+    if (msglen > 0 && msg[msglen - 1] == '\r')
+        msg[--msglen] = '\0';
+    if (msglen > 0) // 忽略空行
+        on_message(c, msg, msglen);
+    return 1;
+}
+
+// 二進位協定：標頭中的 length 決定 frame 邊界
+static int conn_next_frame(Conn *c)
+{
+    FrameHeader h;
+
+    if (c->inlen < PROTO_HEADER_SIZE)
+        return 0;
+    if (proto_decode_header((unsigned char *)c->inbuf, &h) < 0 || h.length > PROTO_MAX_PAYLOAD)
+    {
+        c->closing = 1; // 協定錯誤：無法再找到下一個 frame 的邊界
+        return 0;
+    }
+
+    size_t frame_len = PROTO_HEADER_SIZE + h.length;
+    if (c->inlen < frame_len)
+    {
+        if (c->incap < frame_len)
+        {
+            c->incap = frame_len;
+            c->inbuf = realloc(c->inbuf, c->incap);
+        }
+        return 0;
+    }
+
+    on_message(c, c->inbuf, frame_len);
+    memmove(c->inbuf, c->inbuf + frame_len, c->inlen - frame_len);
+    c->inlen -= frame_len;
+    return 1;
+}
+
+// 共享記憶體：frame 直接在請求 ring 中原地解析 (mirror 映射讓跨過結尾的 frame 也是連續的)，處理完才讓出空間
+// 讀乾淨後表明要等門鈴，期間若又有資料就繼續解析
+static void conn_process_shm(Conn *c)
+{
+    while (c->state != CONN_BUSY && !c->closing)
+    {
+        const char *data;
+        FrameHeader h;
+        ssize_t avail = shm_readable(c->shm, &data);
+
+        if (avail < 0 || (avail >= PROTO_HEADER_SIZE &&
+                          (proto_decode_header((const unsigned char *)data, &h) < 0 || h.length > PROTO_MAX_PAYLOAD)))
+        {
+            c->closing = 1; // 協定錯誤
+            return;
+        }
+        if (avail < PROTO_HEADER_SIZE || (size_t)avail < PROTO_HEADER_SIZE + h.length)
+        {
+            if (shm_idle(c->shm))
+                continue;
+            return;
+        }
+        // 長度只從標頭取一次：客戶端之後改寫 ring 中的內容也不會讓解析超出這個 frame
+        size_t frame_len = PROTO_HEADER_SIZE + h.length;
+        on_message(c, (char *)data, frame_len);
+        shm_consume(c->shm, frame_len);
+    }
+}
+
+// 解析輸入緩衝區中的完整訊息
+static void conn_process_input(Conn *c, int drained)
+{
+    if (c->shm)
+    {
+        conn_process_shm(c);
+        return;
+    }
+
+    // 第一個 byte 決定這條連線使用的協定
+    if (c->state == CONN_LOGIN && c->inlen > 0 && !c->binary &&
+        (unsigned char)c->inbuf[0] == PROTO_MAGIC)
+    {
+        c->binary = 1;
+        c->incap = PROTO_HEADER_SIZE + BUFFER_SIZE;
+        c->inbuf = realloc(c->inbuf, c->incap);
+    }
+
+    while (c->state != CONN_BUSY && !c->closing && c->inlen > 0)
+    {
+        if (!(c->binary ? conn_next_frame(c) : conn_next_text(c, drained)))
+            break;
+    }
+}
+
+// 讀完之後：解析訊息，處理斷線
+static void conn_after_read(Conn *c, int drained)
+{
+    if (!c->closing)
+        conn_process_input(c, drained);
+
+    if (c->closing && c->inflight == 0)
+    {
+        pthread_mutex_lock(&c->out_lock);
+        conn_flush_locked(c);
+        conn_unlock_out(c);
+        conn_destroy(c);
+    }
+    else if (c->closing)
+    {
+        // 背景執行緒仍在使用此連線，先停止監聽，等 conn_end_request 後再釋放
+        conn_unwatch(c);
+    }
+}
+
+// 共享記憶體連線的事件：門鈴 (客戶端寫入請求或讓出回應空間) 或 socket (斷線)
+// 交握之後客戶端不會再在 socket 上送資料，讀到任何東西都視為斷線
+static void conn_on_shm(Conn *c)
+{
+    uint64_t cnt;
+    char b;
+
+    if (read(c->shm->bell, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+        c->closing = 1;
+    ssize_t n = recv(c->sockfd, &b, 1, MSG_DONTWAIT);
+    if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        c->closing = 1;
+
+    pthread_mutex_lock(&c->out_lock);
+    conn_flush_locked(c);
+    conn_unlock_out(c);
+    conn_after_read(c, 1);
+}
+
+// unix socket 連線的第一次讀取：以 recvmsg 接收可能隨附的 fd
+// 收到 PROTO_SHM_MAGIC 與 (memfd, 伺服器門鈴, 客戶端門鈴) 時把連線升級為共享記憶體並回傳 1；
+// 一般的資料照常放進 inbuf 並回傳 0 (之後仍由 recv 讀取)
+static int conn_handshake(Conn *c)
+{
+    union
+    {
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {c->inbuf, c->incap};
+    struct msghdr mh;
+    int fds[3], nfds = 0;
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+    ssize_t n = recvmsg(c->sockfd, &mh, MSG_CMSG_CLOEXEC);
+    if (n <= 0)
+        return 0; // 斷線與 EAGAIN 交給一般的讀取流程判斷
+
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm))
+    {
+        if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS)
+            continue;
+        int cnt = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < cnt; i++)
+        {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+            if (nfds < 3)
+                fds[nfds++] = fd;
+            else
+                close(fd);
+        }
+    }
+    if (nfds == 0)
+    {
+        c->inlen = n;
+        return 0;
+    }
+
+    ShmChannel *ch = malloc(sizeof(ShmChannel));
+    int ok = n == 1 && (unsigned char)c->inbuf[0] == PROTO_SHM_MAGIC && nfds == 3 &&
+             shm_attach(ch, fds[0], fds[1], fds[2]) == 0;
+    if (ok)
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = c;
+        ok = epoll_ctl(c->loop->epfd, EPOLL_CTL_ADD, ch->bell, &ev) == 0;
+        if (!ok)
+            shm_close(ch);
+    }
+    else
+        for (int i = 0; i < nfds; i++)
+            close(fds[i]);
+    if (!ok)
+    {
+        free(ch);
+        c->closing = 1; // 無效的交握
+        conn_after_read(c, 0);
+        return 1;
+    }
+
+    c->shm = ch;
+    c->binary = 1;
+    c->inlen = 0;
+    conn_on_shm(c); // 客戶端可能已經寫入登入請求
+    return 1;
+}
+
+// 讀取資料直到 EAGAIN (edge-triggered 必須一次讀乾淨)
+static void conn_on_readable(Conn *c)
+{
+    int drained = 0;
+
+    if (c->shm)
+    {
+        conn_on_shm(c);
+        return;
+    }
+    if (c->local && c->state == CONN_LOGIN && c->inlen == 0 && !c->closing && conn_handshake(c))
+        return;
+
+    while (c->inlen < c->incap)
+    {
+        ssize_t n = recv(c->sockfd, c->inbuf + c->inlen, c->incap - c->inlen, 0);
+        if (n > 0)
+        {
+            c->inlen += n;
+            // BUSY 時只收資料不解析；緩衝區滿時先處理完 (或擴充) 再讀
+            if (c->state != CONN_BUSY && c->inlen == c->incap)
+                conn_process_input(c, 0);
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            drained = 1;
+            break;
+        }
+        // n == 0 (對方斷線) 或其他錯誤
+        c->closing = 1;
+        break;
+    }
+    conn_after_read(c, drained);
+}
+
+// io_uring：本輪所有可讀連線的第一次讀取合併成一次 io_uring_enter (讀進註冊的緩衝區再複製到 inbuf)
+// 讀到的資料少於要求的長度表示 socket 已經讀乾淨，省下原本用來確認 EAGAIN 的那次 recv
+static void loop_read_batch(EventLoop *self, Conn **ready, int n)
+{
+    size_t want[MAX_EVENTS];
+    int res[MAX_EVENTS], queued = 0;
+
+    for (int i = 0; i < n; i++)
+    {
+        Conn *c = ready[i];
+        want[i] = 0;
+        if (c->dead || c->closing || c->inlen == c->incap || c->shm || (c->local && c->state == CONN_LOGIN))
+            continue; // 交給一般的讀取流程 (共享記憶體與交握不經過 socket 的資料讀取)
+        want[i] = c->incap - c->inlen < RING_SLICE ? c->incap - c->inlen : RING_SLICE;
+        res[i] = -EINTR;
+
+        struct io_uring_sqe *sqe = uring_sqe(self->ring);
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->fd = c->ring_slot >= 0 ? c->ring_slot : c->sockfd;
+        sqe->flags = c->ring_slot >= 0 ? IOSQE_FIXED_FILE : 0;
+        sqe->addr = (uint64_t)(uintptr_t)(self->arena + (size_t)i * RING_SLICE);
+        sqe->len = want[i];
+        sqe->buf_index = 0;
+        sqe->rw_flags = RWF_NOWAIT; // 沒有資料時立即回傳 -EAGAIN (否則核心會等到資料到達才完成)
+        sqe->user_data = i;
+        queued++;
+    }
+
+    for (int done = 0; done < queued;)
+    {
+        uint64_t id;
+        int rv, err = uring_submit(self->ring, queued - done);
+        if (err < 0)
+        {
+            errno = -err;
+            perror("io_uring_enter");
+            exit(1);
+        }
+        while (uring_cqe(self->ring, &id, &rv))
+        {
+            res[id] = rv;
+            done++;
+        }
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        Conn *c = ready[i];
+        if (c->dead)
+            continue;
+        if (want[i] == 0 || (res[i] < 0 && res[i] != -EAGAIN))
+        {
+            // 未送出或失敗 (包含不支援 RWF_NOWAIT 的核心)：改用 recv，真正的連線錯誤由 recv 判斷
+            conn_on_readable(c);
+            continue;
+        }
+        if (res[i] > 0)
+        {
+            memcpy(c->inbuf + c->inlen, self->arena + (size_t)i * RING_SLICE, res[i]);
+            c->inlen += res[i];
+        }
+        if (res[i] == -EAGAIN || (res[i] > 0 && (size_t)res[i] < want[i]))
+            conn_after_read(c, 1);
+        else if (res[i] == 0)
+        {
+            c->closing = 1; // 對方斷線
+            conn_after_read(c, 0);
+        }
+        else
+        {
+            // 讀滿：socket 可能還有資料，和 conn_on_readable 一樣先處理滿的緩衝區再繼續讀
+            if (c->state != CONN_BUSY && c->inlen == c->incap)
+                conn_process_input(c, 0);
+            conn_on_readable(c);
+        }
+    }
+}
+
+// 接受連線：local = 1 時來自 unix socket
+static void loop_accept(EventLoop *self, int listen_fd, int local)
+{
+    static unsigned next_loop; // 共用監聽 socket 與 unix socket 都只由第 0 個事件迴圈 accept，不需要同步
+
+    while (1)
+    {
+        struct sockaddr_storage address;
+        socklen_t addrlen = sizeof(address);
+        int fd = accept4(listen_fd, (struct sockaddr *)&address, &addrlen, SOCK_NONBLOCK);
+        if (fd < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("Accept failed");
+            return;
+        }
+
+        int opt = 1;
+        if (!local)
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+        Conn *c = calloc(1, sizeof(Conn));
+        c->sockfd = fd;
+        c->state = CONN_LOGIN;
+        c->local = local;
+        c->incap = BUFFER_SIZE;
+        c->inbuf = malloc(c->incap);
+        // 連線留在接受它的迴圈 (記憶體也在這個 CPU 上配置)；共用監聽 socket 與 unix socket 輪流分配
+        EventLoop *owner = shared_listener || local ? &loops[next_loop++ % loop_count] : self;
+        c->loop = owner;
+        c->ring_slot = -1;
+        pthread_mutex_init(&c->out_lock, NULL);
+        // 槽位表只由所屬迴圈的執行緒修改 (分配給其他迴圈的連線不註冊)；
+        // 必須在加入 epoll 之前完成，之後連線可能已在其他迴圈上被處理甚至釋放
+        if (owner == self && self->nfree > 0 && uring_set_file(self->ring, self->free_slots[self->nfree - 1], fd) == 0)
+            c->ring_slot = self->free_slots[--self->nfree];
+
+        atomic_fetch_add_explicit(&connections, 1, memory_order_relaxed);
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.ptr = c;
+        if (epoll_ctl(owner->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        {
+            perror("epoll_ctl");
+            if (c->ring_slot >= 0)
+            {
+                uring_set_file(self->ring, c->ring_slot, -1);
+                self->free_slots[self->nfree++] = c->ring_slot;
+            }
+            atomic_fetch_sub_explicit(&connections, 1, memory_order_relaxed);
+            close(fd);
+            pthread_mutex_destroy(&c->out_lock);
+            free(c->inbuf);
+            free(c);
+            continue;
+        }
+    }
+}
+
+// 處理背景執行緒交回的連線
+static void loop_on_wake(EventLoop *self)
+{
+    uint64_t cnt;
+    Conn *list;
+
+    if (read(self->wakefd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+        perror("eventfd read");
+
+    pthread_mutex_lock(&self->lock);
+    list = self->resumed;
+    self->resumed = NULL;
+    pthread_mutex_unlock(&self->lock);
+
+    while (list)
+    {
+        Conn *c = list;
+        list = list->next_resumed;
+
+        c->inflight -= atomic_exchange(&c->done, 0);
+        if (c->closing)
+        {
+            if (c->inflight == 0)
+                conn_destroy(c);
+            continue;
+        }
+        if (c->inflight < conn_max_inflight(c))
+            c->state = CONN_READY;
+        // 處理在 BUSY 期間已收到的資料，再把 socket 讀乾淨 (共享記憶體直接從 ring 解析，不必讀 socket)
+        if (c->shm)
+            conn_after_read(c, 1);
+        else
+        {
+            conn_process_input(c, 0);
+            conn_on_readable(c);
+        }
+    }
+}
+
+// 建立事件迴圈自己的 io_uring：註冊接收緩衝區與 socket 槽位 (失敗時這個迴圈沿用 recv)
+static void loop_ring_init(EventLoop *self)
+{
+    size_t len = (size_t)MAX_EVENTS * RING_SLICE;
+
+    if (!uring_enabled() || !(self->ring = uring_new(MAX_EVENTS)))
+        return;
+    self->arena = aligned_alloc(RING_SLICE, len);
+    if (uring_register_buffer(self->ring, self->arena, len) < 0)
+    {
+        uring_free(self->ring);
+        free(self->arena);
+        self->ring = NULL;
+        self->arena = NULL;
+        return;
+    }
+    if (uring_register_files(self->ring, RING_FILES) == 0)
+    {
+        self->free_slots = malloc(RING_FILES * sizeof(int));
+        for (int i = 0; i < RING_FILES; i++)
+            self->free_slots[i] = RING_FILES - 1 - i;
+        self->nfree = RING_FILES;
+    }
+}
+
+static void *loop_main(void *arg)
+{
+    EventLoop *self = (EventLoop *)arg;
+    struct epoll_event events[MAX_EVENTS];
+    Conn *ready[MAX_EVENTS];
+
+    if (self->cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(self->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    loop_ring_init(self);
+
+    while (1)
+    {
+        int n = epoll_wait(self->epfd, events, MAX_EVENTS, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            exit(1);
+        }
+
+        int nready = 0;
+        for (int i = 0; i < n; i++)
+        {
+            void *tag = events[i].data.ptr;
+            if (tag == &listen_tag)
+            {
+                loop_accept(self, self->listen_fd, 0);
+            }
+            else if (tag == &unix_tag)
+            {
+                loop_accept(self, self->unix_fd, 1);
+            }
+            else if (tag == &wake_tag)
+            {
+                loop_on_wake(self);
+            }
+            else
+            {
+                Conn *c = (Conn *)tag;
+                if (c->dead)
+                    continue;
+                if (events[i].events & EPOLLOUT)
+                {
+                    pthread_mutex_lock(&c->out_lock);
+                    conn_flush_locked(c);
+                    conn_unlock_out(c);
+                }
+                if (!(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+                    continue;
+                if (self->ring)
+                    ready[nready++] = c; // 本輪結束時一起讀取
+                else
+                    conn_on_readable(c);
+            }
+        }
+        if (nready > 0)
+            loop_read_batch(self, ready, nready);
+        loop_free_dead(self);
+    }
+    return NULL;
+}
+
+// 建立監聽 socket；reuseport = 1 時設定 SO_REUSEPORT (不支援時回傳 -2)，其他錯誤回傳 -1
+static int open_listener(int port, int backlog, int reuseport)
+{
+    struct sockaddr_in address;
+    int opt = 1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+    if (fd < 0)
+        return -1;
+    // 允許重用位址 (避免伺服器重啟時 Port 被佔用)
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0)
+    {
+        close(fd);
+        return -2;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY; // 監聽所有網卡介面
+    address.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(fd, backlog) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// 確認沒有其他程序正在使用 port：SO_REUSEPORT 的 socket 可以和同一使用者的其他程序共用 port，
+// 先以一般的 bind 檢查，避免兩個伺服器同時執行時默默分掉彼此的連線
+static int port_in_use(int port)
+{
+    struct sockaddr_in address;
+    int opt = 1, busy;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+    busy = bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0;
+    close(fd);
+    return busy;
+}
+
+// 建立 unix socket 監聽：路徑上留有前一次執行的 socket 檔時先移除，
+// 但若連得上 (另一個伺服器仍在使用) 則視為錯誤，避免搶走它的路徑
+static int open_unix_listener(const char *path, int backlog)
+{
+    struct sockaddr_un address;
+
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int busy = connect(probe, (struct sockaddr *)&address, sizeof(address)) == 0;
+    close(probe);
+    if (busy)
+    {
+        errno = EADDRINUSE;
+        return -1;
+    }
+    unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(fd, backlog) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// 讓核心把連線交給「處理該封包的 CPU」對應的監聽 socket (第 i 個 socket 屬於綁在第 i 個 CPU 的迴圈)
+// 失敗時 (例如舊核心) 維持預設的雜湊分配
+static void steer_by_cpu(int fd, int nloops)
+{
+    struct sock_filter code[] = {
+        {BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU}, // A = 目前的 CPU
+        {BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t)nloops},       // A %= 迴圈數
+        {BPF_RET | BPF_A, 0, 0, 0},
+    };
+    struct sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+    setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+// 依目前程序允許使用的 CPU (taskset / cgroup) 決定第 i 個迴圈綁定的 CPU
+// 回傳 1 表示第 i 個迴圈剛好綁在 CPU i 上 (每個迴圈各自一個 CPU)，可以依 CPU 編號分配連線
+static int assign_cpus(int nloops, int pin)
+{
+    cpu_set_t allowed;
+    int cpus[CPU_SETSIZE], ncpus = 0;
+
+    if (pin && sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+        for (int c = 0; c < CPU_SETSIZE; c++)
+            if (CPU_ISSET(c, &allowed))
+                cpus[ncpus++] = c;
+    int identity = ncpus >= nloops;
+    for (int i = 0; i < nloops; i++)
+    {
+        loops[i].cpu = ncpus > 0 ? cpus[i % ncpus] : -1;
+        identity = identity && loops[i].cpu == i;
+    }
+    return identity;
+}
+
+void reactor_run(int port, const char *unix_path, int backlog, int nloops, int pin, MessageHandler handler,
+                 CloseHandler close_handler)
+{
+    struct epoll_event ev;
+
+    loop_count = nloops;
+    on_message = handler;
+    on_close = close_handler;
+
+    loops = calloc(nloops, sizeof(EventLoop));
+    for (int i = 0; i < nloops; i++)
+    {
+        EventLoop *loop = &loops[i];
+        loop->epfd = epoll_create1(0);
+        loop->wakefd = eventfd(0, EFD_NONBLOCK);
+        if (loop->epfd < 0 || loop->wakefd < 0)
+        {
+            perror("epoll/eventfd");
+            exit(1);
+        }
+        pthread_mutex_init(&loop->lock, NULL);
+
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = &wake_tag;
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev);
+    }
+
+    // 每個迴圈一個 SO_REUSEPORT 監聽 socket；不支援時退回單一 socket 由第 0 個迴圈分配連線
+    int steer = assign_cpus(nloops, pin);
+    if (port_in_use(port))
+    {
+        perror("Bind failed");
+        exit(1);
+    }
+    for (int i = 0; i < nloops; i++)
+        loops[i].listen_fd = loops[i].unix_fd = -1;
+    for (int i = 0; i < nloops && !shared_listener; i++)
+    {
+        int fd = open_listener(port, backlog, 1);
+        if (fd == -2 && i == 0)
+        {
+            shared_listener = 1;
+            fd = open_listener(port, backlog, 0);
+        }
+        if (fd < 0)
+        {
+            perror("Bind failed");
+            exit(1);
+        }
+        loops[i].listen_fd = fd;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = &listen_tag;
+        epoll_ctl(loops[i].epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+    if (steer && !shared_listener && nloops > 1)
+        steer_by_cpu(loops[0].listen_fd, nloops);
+    if (unix_path)
+    {
+        if ((loops[0].unix_fd = open_unix_listener(unix_path, backlog)) < 0)
+        {
+            perror("Unix socket bind failed");
+            exit(1);
+        }
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.ptr = &unix_tag;
+        epoll_ctl(loops[0].epfd, EPOLL_CTL_ADD, loops[0].unix_fd, &ev);
+    }
+
+    for (int i = 1; i < nloops; i++)
+        pthread_create(&loops[i].tid, NULL, loop_main, &loops[i]);
+
+    // 第 0 個事件迴圈直接在呼叫者 (主執行緒) 上執行
+    loops[0].tid = pthread_self();
+    loop_main(&loops[0]);
+}
+
+int reactor_connections(void)
+{
+    return atomic_load_explicit(&connections, memory_order_relaxed);
+}
@@ -0,0 +1,131 @@
+/*
+ * reactor.h - epoll 事件迴圈 (edge-triggered)
+ * 功能：以固定數量的事件迴圈執行緒服務大量非阻塞連線，
+ *       每條連線以狀態機 (LOGIN -> READY <-> BUSY) 驅動指令處理。
+ *       依連線的第一個 byte 判斷使用二進位 frame 協定 (protocol.h) 或舊版文字協定。
+ *       每個事件迴圈有自己的 SO_REUSEPORT 監聽 socket 並綁定一個 CPU，連線由接受它的迴圈處理到結束。
+ *       啟用 io_uring (uring.h) 時，同一輪 epoll 中可讀的連線以一次 io_uring_enter 批次讀取。
+ *       同一台機器上的客戶端可以改連 unix socket，並以交握升級為共享記憶體 ring (shmring.h)：
+ *       之後的 frame 直接在 ring 中解析，回應複製進 ring，socket 只用來偵測斷線。
+ */
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#include "principal.h"
+
+#define BUFFER_SIZE 1024 // 防止溢位
+#define REACTOR_DEFAULT_BACKLOG 4096 // 每個監聽 socket 的 listen backlog (實際上限為 net.core.somaxconn)
+
+typedef struct EventLoop EventLoop;
+struct ShmChannel;
+
+// 釋放輸出資料來源的回呼 (例如關閉檔案)，在資料送完或連線關閉時呼叫
+typedef void (*ReleaseFunc)(void *arg);
+
+// 輸出佇列中的一段資料：記憶體內容 (複製進來的或外部共用的緩衝區)，或是用 sendfile 直接從 page cache 送出的檔案區段
+typedef struct OutChunk
+{
+    struct OutChunk *next;
+    int fd;              // >= 0: 檔案區段；-1: 記憶體資料
+    const char *data;    // 記憶體資料 (指向 inline_data 或外部緩衝區)
+    size_t len;          // 尚未送出的 bytes 數
+    off_t file_off;      // 檔案區段下一個要送的位置
+    int zero_fill;       // 1: 檔案在傳送途中變短，剩下的長度以 0 補齊以維持 frame 邊界
+    int copy;            // 1: 以 pread + send 複製進 socket (不用 sendfile，見 conn_send_file)
+    ReleaseFunc release; // 送完後呼叫
+    void *release_arg;
+    char inline_data[];
+} OutChunk;
+
+// 連線狀態
+typedef enum
+{
+    CONN_LOGIN, // 等待登入訊息 "使用者 群組"
+    CONN_READY, // 可以接收下一個指令
+    CONN_BUSY   // 處理中的請求已達上限 (文字協定 1 個、二進位協定 PROTO_MAX_INFLIGHT 個) 或 conn_pause，暫停解析輸入
+} ConnState;
+
+// 客戶端連線資訊結構 (每條連線一份，由所屬的事件迴圈管理)
+typedef struct Conn
+{
+    int sockfd;        // socket file descriptor (非阻塞)
+    ConnState state;   // 連線狀態機
+    int closing;       // 1: 連線即將關閉 (對方斷線或登入失敗)
+    int dead;          // 1: 已關閉，等本輪事件處理完再釋放記憶體
+    int binary;        // 1: 二進位 frame 協定；0: 文字協定
+    EventLoop *loop;   // 所屬的事件迴圈
+    int ring_slot;     // 在所屬迴圈 io_uring 中註冊的 fd 槽位 (-1: 未註冊)
+    int local;         // 1: 從 unix socket 接受的連線 (登入前可以升級為共享記憶體)
+    struct ShmChannel *shm; // 共享記憶體通道 (NULL: 經由 socket 收送)
+    char user[50];     // 使用者名稱
+    char group[50];    // 使用者群組
+    Principal who;     // 登入後的使用者 ID 與所屬群組 (權限檢查用)
+
+    char *inbuf;       // 尚未解析的輸入資料 (只由事件迴圈執行緒存取)
+    size_t inlen;
+    size_t incap;      // 文字協定固定 BUFFER_SIZE；二進位協定依 frame 大小擴充
+
+    int inflight;      // 處理中的請求數 (只由事件迴圈執行緒修改)
+    atomic_int done;   // 背景執行緒已完成、尚未由事件迴圈結算的請求數
+
+    struct PendingWrite *pending_writes; // 尚未收齊資料的 write 請求 (由 server.c 管理，只在事件迴圈執行緒存取)
+
+    pthread_mutex_t out_lock; // 保護輸出佇列 (背景執行緒也會送出回應)
+    OutChunk *out_head;       // 尚未送出的回應資料
+    OutChunk *out_tail;
+    OutChunk *out_done;       // 已送完 (或丟棄)、等釋放 out_lock 後才呼叫 release 的區段
+
+    struct Conn *next_resumed; // 交回事件迴圈的佇列鏈結
+    struct Conn *next_dead;    // 待釋放清單的鏈結
+} Conn;
+
+// 收到一則完整訊息時呼叫 (在事件迴圈執行緒上執行，不可阻塞)
+// 文字協定：msg 為去掉換行的字串；二進位協定：msg 為完整 frame (標頭 + payload)。
+// msg 只在呼叫期間有效。處理函式可以用 conn_begin_request() 把請求交給背景執行緒，
+// 完成後呼叫 conn_end_request()；或設定 c->closing = 1 要求送完回應後關閉連線。
+typedef void (*MessageHandler)(Conn *c, char *msg, size_t len);
+
+// 連線關閉、釋放前呼叫 (在事件迴圈執行緒上，此時已沒有處理中的請求)
+typedef void (*CloseHandler)(Conn *c);
+
+// 建立 nloops 個事件迴圈執行緒，各自在 port 上監聽並接受連線 (不會返回；無法 bind 時結束程式)
+// pin = 1 時第 i 個迴圈綁定到程序可用的第 i 個 CPU，並讓核心把連線交給封包所在 CPU 的迴圈
+// unix_path 不為 NULL 時另外監聽這個 unix socket (由第 0 個迴圈接受，輪流分配給各迴圈)
+void reactor_run(int port, const char *unix_path, int backlog, int nloops, int pin, MessageHandler handler,
+                 CloseHandler close_handler);
+
+// 送出資料給客戶端 (任何執行緒皆可呼叫)，送不完的部分留待 EPOLLOUT 時繼續送
+void conn_send(Conn *c, const char *data, size_t len);
+
+// 送出 prefix (例如 frame 標頭) 與檔案 fd 從 offset 起 len bytes 的內容 (sendfile，不經過使用者空間)
+// 兩者一起放進輸出佇列，不會與其他回應交錯；送完或連線關閉時呼叫 release(release_arg)
+// sendfile 放進 socket 緩衝區的是 page cache 頁面的參考，release 之後仍可能送出之後才寫進去的內容；
+// 區段在 release 之後可能被原地修改時 copy = 1，改為複製進 socket
+void conn_send_file(Conn *c, const char *prefix, size_t prefix_len, int fd, off_t offset, size_t len, int copy,
+                    ReleaseFunc release, void *release_arg);
+
+// 送出 prefix 與一塊由呼叫者管理的記憶體 data (不複製，例如共用的檔案內容快取)
+// 送完或連線關閉時呼叫 release(release_arg)，在此之前 data 必須保持有效且不被修改
+void conn_send_buffer(Conn *c, const char *prefix, size_t prefix_len, const char *data, size_t len,
+                      ReleaseFunc release, void *release_arg);
+
+// 登記一個交給背景執行緒的請求 (事件迴圈執行緒呼叫)，達到上限時連線轉為 BUSY
+void conn_begin_request(Conn *c);
+
+// 登記一個必須先完成、才能繼續解析這條連線的背景工作 (事件迴圈執行緒呼叫，例如把上傳資料寫進暫存檔)：
+// 連線立即轉為 BUSY，輸入緩衝區收滿後不再讀取 socket (由 TCP 流量控制讓對方停下)；完成後同樣呼叫 conn_end_request
+void conn_pause(Conn *c);
+
+// 背景執行緒處理完請求後呼叫 (任何執行緒)，把連線交回事件迴圈繼續解析下一則訊息
+void conn_end_request(Conn *c);
+
+// 目前開啟的連線數 (統計用)
+int reactor_connections(void);
+
+#endif
@@ -0,0 +1,884 @@
+/*
+ * replica.c - 主從複寫 (log shipping)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "replica.h"
+#include "protocol.h"
+#include "fdcache.h"
+#include "upload.h"
+#include "principal.h"
+#include "stats.h"
+
+#define REPL_MASK (REPL_LOG_RECORDS - 1)
+#define REPL_CHUNK (PROTO_MAX_PAYLOAD - 256) // 每個 frame 的資料量 (其餘空間放欄位)
+#define REPL_INLINE_MAX (REPL_LOG_BYTES / 4) // 超過時紀錄不複製資料，送出時才從檔案讀取
+
+// 一筆紀錄 (主伺服器)
+typedef struct LogRecord
+{
+    uint64_t seq;
+    uint8_t type; // REPL_FILE / REPL_PERMS / REPL_REPLACE / REPL_WRITE
+    char name[50];
+    char owner[50];
+    char group[50];
+    char perms[10];
+    uint64_t offset; // 資料在檔案中的位置
+    uint64_t len;    // 資料長度
+    char *data;      // NULL 且 len > 0：資料太大而沒有複製，送出時讀取檔案目前的內容 (之後的紀錄會帶來更新的內容)
+    int refs;        // 紀錄本身 1 個，正在送出它的傳送執行緒各 1 個 (由 log_mutex 保護)
+} LogRecord;
+
+// 一條複本連線的傳送執行緒
+typedef struct
+{
+    int sock;
+    unsigned char *buf; // 組 frame 的緩衝區 (PROTO_HEADER_SIZE + PROTO_MAX_PAYLOAD)
+} Sender;
+
+// 複本上正在組合的紀錄 (資料分成多個 frame)
+typedef struct
+{
+    uint8_t type; // REPL_FILE / REPL_REPLACE / REPL_WRITE
+    char name[50];
+    char owner[50];
+    char group[50];
+    char perms[10];
+    uint64_t offset; // 第一段資料在檔案中的位置
+    Upload *upload;  // 已收到的資料 (NULL: 沒有組合中的紀錄)
+} Pending;
+
+// 套用紀錄的執行緒等待檔案鎖 (複本上只有這個執行緒寫入，只會等到進行中的讀取者)
+typedef struct
+{
+    LockWaiter waiter;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int granted;
+} SyncLock;
+
+static ReplicaRole role = ROLE_STANDALONE;
+
+// 主伺服器的紀錄：保留序號 oldest ~ last 的紀錄，放在 ring[序號 & REPL_MASK] (last < oldest 表示沒有紀錄)
+static pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_cond; // 有新紀錄時廣播 (CLOCK_MONOTONIC，與 stats_now_us 相同)
+static LogRecord *ring[REPL_LOG_RECORDS];
+static uint64_t oldest = 1, last;
+static size_t log_bytes;
+static uint64_t epoch;     // 這次執行的紀錄識別：重新啟動後序號重新開始，複本必須重新取得快照
+static int client_port;
+static atomic_int replicas; // 連線中的複本數
+
+// 複本的狀態
+static char primary_host[64];
+static int primary_port;
+static atomic_int primary_client_port; // 主伺服器 HELLO 告知的客戶端 port (0: 尚未連上)
+static int max_lag_ms = REPL_DEFAULT_MAX_LAG_MS;
+static atomic_uint_least64_t applied;  // 已套用的序號
+static atomic_uint_least64_t fresh_us; // 最後一次與主伺服器一致的時間 (0: 從未一致)
+static uint64_t failed_seq;            // 最後一次套用失敗的紀錄序號 (只有 follower 執行緒使用)
+static int failed_times;               // 這筆紀錄連續失敗的次數
+static SyncLock apply_lock = {.mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+static SyncLock apply_pin = {.mutex = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER}; // FileEntry.inplace
+
+ReplicaRole replica_role(void)
+{
+    return role;
+}
+
+static int send_all(int sock, const void *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(sock, buf, len, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf = (const char *)buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int recv_full(int sock, void *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = recv(sock, buf, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf = (char *)buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+// 讀一個 frame 到 buf (PROTO_HEADER_SIZE + PROTO_MAX_PAYLOAD bytes)
+static int recv_frame(int sock, unsigned char *buf, FrameHeader *h)
+{
+    if (recv_full(sock, buf, PROTO_HEADER_SIZE) < 0 || proto_decode_header(buf, h) < 0 ||
+        h->length > PROTO_MAX_PAYLOAD)
+        return -1;
+    return recv_full(sock, buf + PROTO_HEADER_SIZE, h->length);
+}
+
+// 送出只有 u64 欄位的 frame (HELLO / SNAPSHOT / HEARTBEAT)
+static int send_u64s(int sock, uint8_t type, uint16_t flags, int n, const uint64_t *values)
+{
+    unsigned char frame[PROTO_HEADER_SIZE + 64];
+    size_t off = PROTO_HEADER_SIZE;
+
+    for (int i = 0; i < n; i++)
+        proto_put_u64(frame, sizeof(frame), &off, values[i]);
+    FrameHeader h = {type, 0, flags, 0, off - PROTO_HEADER_SIZE};
+    proto_encode_header(frame, &h);
+    return send_all(sock, frame, off);
+}
+
+// 從 offset 讀滿 len bytes，回傳讀到的長度 (遇到檔尾時較短)，失敗回傳 -1
+static ssize_t pread_full(int fd, char *buf, size_t len, off_t offset)
+{
+    size_t done = 0;
+    while (done < len)
+    {
+        ssize_t n = pread(fd, buf + done, len - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        done += n;
+    }
+    return done;
+}
+
+// ---- 主伺服器：紀錄 ----
+
+static void record_unref(LogRecord *r) // 持有 log_mutex
+{
+    if (--r->refs == 0)
+    {
+        free(r->data);
+        free(r);
+    }
+}
+
+// 配置序號並加入紀錄，超過上限時丟棄最舊的紀錄 (最新的一筆一定保留)
+static void log_append(LogRecord *r)
+{
+    pthread_mutex_lock(&log_mutex);
+    r->seq = last + 1;
+    r->refs = 1;
+    log_bytes += r->data ? r->len : 0;
+    while (oldest <= last && (r->seq - oldest >= REPL_LOG_RECORDS || log_bytes > REPL_LOG_BYTES))
+    {
+        LogRecord *old = ring[oldest & REPL_MASK];
+        log_bytes -= old->data ? old->len : 0;
+        ring[oldest & REPL_MASK] = NULL;
+        record_unref(old);
+        oldest++;
+    }
+    ring[r->seq & REPL_MASK] = r;
+    last = r->seq;
+    pthread_cond_broadcast(&log_cond);
+    pthread_mutex_unlock(&log_mutex);
+}
+
+static LogRecord *record_new(uint8_t type, FileEntry *file)
+{
+    LogRecord *r = calloc(1, sizeof(LogRecord));
+    uint8_t bits;
+
+    r->type = type;
+    snprintf(r->name, sizeof(r->name), "%s", file->name);
+    snprintf(r->owner, sizeof(r->owner), "%s", file->owner);
+    snprintf(r->group, sizeof(r->group), "%s", file->group);
+    catalog_get_perms(file, r->perms, &bits);
+    return r;
+}
+
+// 記錄檔案目前提交的版本在 [offset, offset + len) 的內容 (截到已提交的長度)
+static void log_content(uint8_t type, FileEntry *file, uint64_t offset, uint64_t len)
+{
+    LogRecord *r = record_new(type, file);
+    uint64_t size = 0;
+    FdHandle *fdh = fdcache_snapshot(file, &size, NULL);
+
+    if (!fdh)
+        size = 0;
+    if (offset > size)
+        offset = size;
+    if (len > size - offset)
+        len = size - offset;
+    r->offset = offset;
+    r->len = len;
+    if (fdh && len > 0 && len <= REPL_INLINE_MAX)
+    {
+        r->data = malloc(len);
+        if (pread_full(fdh->fd, r->data, len, offset) != (ssize_t)len)
+        {
+            free(r->data); // 讀取失敗：送出時再從檔案讀取
+            r->data = NULL;
+        }
+    }
+    if (fdh)
+        fdcache_release(fdh);
+    log_append(r);
+}
+
+void replica_log_file(FileEntry *file)
+{
+    if (role == ROLE_PRIMARY)
+        log_content(REPL_FILE, file, 0, FILELOCK_EOF);
+}
+
+void replica_log_perms(FileEntry *file)
+{
+    if (role == ROLE_PRIMARY)
+        log_append(record_new(REPL_PERMS, file));
+}
+
+void replica_log_replace(FileEntry *file)
+{
+    if (role == ROLE_PRIMARY)
+        log_content(REPL_REPLACE, file, 0, FILELOCK_EOF);
+}
+
+void replica_log_write(FileEntry *file, uint64_t offset, uint64_t len)
+{
+    if (role == ROLE_PRIMARY)
+        log_content(REPL_WRITE, file, offset, len);
+}
+
+// ---- 主伺服器：傳送 ----
+
+static int send_frame(Sender *s, uint8_t type, uint16_t flags, size_t plen)
+{
+    FrameHeader h = {type, 0, flags, 0, plen};
+    proto_encode_header(s->buf, &h);
+    return send_all(s->sock, s->buf, PROTO_HEADER_SIZE + plen);
+}
+
+// 送出一筆紀錄：每個 frame 都帶有欄位與這段資料的位置，資料超過 REPL_CHUNK 時分成多個 frame
+static int send_record(Sender *s, const LogRecord *r)
+{
+    unsigned char *payload = s->buf + PROTO_HEADER_SIZE;
+    size_t off = 0;
+
+    proto_put_field(payload, PROTO_MAX_PAYLOAD, &off, r->name, strlen(r->name));
+    if (r->type == REPL_FILE)
+    {
+        proto_put_field(payload, PROTO_MAX_PAYLOAD, &off, r->owner, strlen(r->owner));
+        proto_put_field(payload, PROTO_MAX_PAYLOAD, &off, r->group, strlen(r->group));
+    }
+    if (r->type == REPL_FILE || r->type == REPL_PERMS)
+        proto_put_field(payload, PROTO_MAX_PAYLOAD, &off, r->perms, strlen(r->perms));
+    if (r->type == REPL_PERMS)
+        return send_frame(s, r->type, 0, off);
+
+    // 沒有複製資料的紀錄 (與快照)：讀取檔案目前提交的版本
+    FdHandle *fdh = NULL;
+    uint64_t len = r->len;
+    if (!r->data && len > 0)
+    {
+        FileEntry *file = catalog_find(r->name);
+        uint64_t size = 0;
+        if (file)
+            fdh = fdcache_snapshot(file, &size, NULL);
+        if (!fdh)
+            size = 0;
+        len = r->offset >= size ? 0 : len < size - r->offset ? len : size - r->offset;
+    }
+
+    uint64_t done = 0;
+    int ret = 0;
+    do
+    {
+        size_t n = len - done > REPL_CHUNK ? REPL_CHUNK : len - done, o = off;
+        proto_put_u64(payload, PROTO_MAX_PAYLOAD, &o, r->offset + done);
+        if (r->data)
+            memcpy(payload + o, r->data + done, n);
+        else if (n > 0 && pread_full(fdh->fd, (char *)payload + o, n, r->offset + done) != (ssize_t)n)
+        {
+            ret = -1;
+            break;
+        }
+        done += n;
+        if ((ret = send_frame(s, r->type, done < len ? FLAG_MORE : 0, o + n)) < 0)
+            break;
+    } while (done < len);
+    if (fdh)
+        fdcache_release(fdh);
+    return ret;
+}
+
+// 快照：依檔名順序送出每個檔案目前的權限與內容，最後以 REPL_SNAPSHOT 告知接下來的紀錄從 start 之後開始
+// 快照期間提交的變更可能已包含在內，之後重複套用的結果相同
+static int send_snapshot(Sender *s, uint64_t start)
+{
+    CatalogInfo *info = malloc(PROTO_LIST_MAX * sizeof(CatalogInfo));
+    char after[50] = "";
+    int more = 1, count = 0, ret = 0;
+
+    while (more && ret == 0)
+    {
+        int n = catalog_list("", after, info, PROTO_LIST_MAX, &more);
+        for (int i = 0; i < n && ret == 0; i++)
+        {
+            LogRecord r = {.type = REPL_FILE, .len = FILELOCK_EOF};
+            snprintf(r.name, sizeof(r.name), "%s", info[i].name);
+            snprintf(r.owner, sizeof(r.owner), "%s", info[i].owner);
+            snprintf(r.group, sizeof(r.group), "%s", info[i].group);
+            snprintf(r.perms, sizeof(r.perms), "%s", info[i].perms);
+            ret = send_record(s, &r);
+        }
+        if (n > 0)
+            snprintf(after, sizeof(after), "%s", info[n - 1].name);
+        count += n;
+    }
+    free(info);
+    if (ret == 0 && (ret = send_u64s(s->sock, REPL_SNAPSHOT, 0, 1, &start)) == 0)
+        printf("[Replica] 已送出快照 (%d 個檔案，序號 %llu)\n", count, (unsigned long long)start);
+    return ret;
+}
+
+// 依序送出序號 sent 之後的紀錄；送完所有紀錄時、以及每隔 REPL_HEARTBEAT_MS 送出心跳 (當時最新的序號)
+// 複本落後到紀錄已被丟棄時返回 (複本重新連線後改取快照)
+static void stream(Sender *s, uint64_t sent)
+{
+    uint64_t beat = stats_now_us();
+    int dirty = 0; // 上次心跳之後送過紀錄
+
+    for (;;)
+    {
+        LogRecord *r = NULL;
+        uint64_t latest;
+
+        pthread_mutex_lock(&log_mutex);
+        if (sent == last && !dirty)
+        {
+            uint64_t deadline = beat + REPL_HEARTBEAT_MS * 1000;
+            struct timespec ts = {deadline / 1000000, deadline % 1000000 * 1000};
+            pthread_cond_timedwait(&log_cond, &log_mutex, &ts);
+        }
+        if (sent + 1 < oldest)
+        {
+            pthread_mutex_unlock(&log_mutex);
+            printf("[Replica] 複本落後超過保留的紀錄，中斷連線 (重新連線時改送快照)\n");
+            return;
+        }
+        if (sent < last)
+        {
+            r = ring[(sent + 1) & REPL_MASK];
+            r->refs++;
+        }
+        latest = last;
+        pthread_mutex_unlock(&log_mutex);
+
+        uint64_t now = stats_now_us();
+        if ((!r && dirty) || now - beat >= REPL_HEARTBEAT_MS * 1000)
+        {
+            if (send_u64s(s->sock, REPL_HEARTBEAT, 0, 1, &latest) < 0)
+                r = NULL, sent = UINT64_MAX;
+            beat = now;
+            dirty = 0;
+        }
+        if (r)
+        {
+            int ret = sent == UINT64_MAX ? -1 : send_record(s, r);
+            sent = ret < 0 ? UINT64_MAX : r->seq;
+            pthread_mutex_lock(&log_mutex);
+            record_unref(r);
+            pthread_mutex_unlock(&log_mutex);
+            dirty = 1;
+        }
+        if (sent == UINT64_MAX)
+            return; // 複本斷線
+    }
+}
+
+static void *sender_main(void *arg)
+{
+    Sender *s = arg;
+    FrameHeader h;
+    uint64_t their_epoch, their_seq;
+    size_t off = 0;
+
+    // 交握：複本告知已套用到的位置；紀錄仍保留著 (且屬於這次執行) 時接著送，否則先送快照
+    if (recv_frame(s->sock, s->buf, &h) == 0 && h.opcode == REPL_HELLO &&
+        proto_get_u64(s->buf + PROTO_HEADER_SIZE, h.length, &off, &their_epoch) == 0 &&
+        proto_get_u64(s->buf + PROTO_HEADER_SIZE, h.length, &off, &their_seq) == 0)
+    {
+        pthread_mutex_lock(&log_mutex);
+        int snapshot = their_epoch != epoch || their_seq + 1 < oldest || their_seq > last;
+        uint64_t start = snapshot ? last : their_seq;
+        pthread_mutex_unlock(&log_mutex);
+
+        uint64_t hello[3] = {epoch, client_port, start};
+        printf("[Replica] 複本已連線 (%s，序號 %llu)\n", snapshot ? "送出快照" : "接續紀錄",
+               (unsigned long long)start);
+        if (send_u64s(s->sock, REPL_HELLO, snapshot ? FLAG_MORE : 0, 3, hello) == 0 &&
+            (!snapshot || send_snapshot(s, start) == 0))
+            stream(s, start);
+        printf("[Replica] 複本已斷線\n");
+    }
+    atomic_fetch_sub(&replicas, 1);
+    close(s->sock);
+    free(s->buf);
+    free(s);
+    return NULL;
+}
+
+static void *listen_main(void *arg)
+{
+    int listen_fd = (int)(long)arg;
+    struct timeval tv = {REPL_TIMEOUT_MS / 1000, REPL_TIMEOUT_MS % 1000 * 1000};
+    int one = 1;
+
+    for (;;)
+    {
+        int sock = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (sock < 0)
+        {
+            if (errno != EINTR && errno != ECONNABORTED)
+            {
+                perror("accept (replica)");
+                usleep(REPL_RETRY_MS * 1000); // fd 用完時不要忙碌重試
+            }
+            continue;
+        }
+        // 逾時：交握沒有回應或複本停止讀取時中斷，不讓傳送執行緒永遠卡住
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        Sender *s = malloc(sizeof(Sender));
+        s->sock = sock;
+        s->buf = malloc(PROTO_HEADER_SIZE + PROTO_MAX_PAYLOAD);
+        atomic_fetch_add(&replicas, 1);
+        pthread_t tid;
+        pthread_create(&tid, NULL, sender_main, s);
+        pthread_detach(tid);
+    }
+    return NULL;
+}
+
+int replica_start_primary(int repl_port, int port)
+{
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0), one = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(repl_port);
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+        bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 16) < 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&log_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    epoch = ((uint64_t)time(NULL) << 32 ^ stats_now_us() ^ getpid()) | 1; // 不為 0 (複本以 0 表示沒有完整的資料)
+    client_port = port;
+    role = ROLE_PRIMARY;
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, listen_main, (void *)(long)fd);
+    pthread_detach(tid);
+    return 0;
+}
+
+// ---- 複本：套用 ----
+
+static void apply_granted(void *arg)
+{
+    SyncLock *l = arg;
+    pthread_mutex_lock(&l->mutex);
+    l->granted = 1;
+    pthread_cond_signal(&l->cond);
+    pthread_mutex_unlock(&l->mutex);
+}
+
+// 以 l 取得 lock 在 [start, end) 的寫鎖，取不到時等待授予
+static void sync_lock(SyncLock *l, FileLock *lock, uint64_t start, uint64_t end)
+{
+    l->granted = 0;
+    l->waiter.exclusive = 1;
+    l->waiter.start = start;
+    l->waiter.end = end;
+    l->waiter.granted = apply_granted;
+    l->waiter.queued = NULL;
+    l->waiter.arg = l;
+    if (filelock_acquire(lock, &l->waiter) == 0)
+        return;
+    pthread_mutex_lock(&l->mutex);
+    while (!l->granted)
+        pthread_cond_wait(&l->cond, &l->mutex);
+    pthread_mutex_unlock(&l->mutex);
+}
+
+static void lock_file(FileEntry *file, uint64_t start, uint64_t end)
+{
+    sync_lock(&apply_lock, &file->lock, start, end);
+}
+
+static void unlock_file(FileEntry *file)
+{
+    filelock_release(&file->lock, &apply_lock.waiter);
+}
+
+static int apply_perms(const char *name, const char *perms)
+{
+    FileEntry *file = catalog_find(name);
+    int bits = perm_compile(perms);
+
+    if (!file || bits < 0)
+        return -1;
+    lock_file(file, 0, FILELOCK_EOF);
+    catalog_set_perms(file, perms, bits);
+    unlock_file(file);
+    return 1;
+}
+
+// 整個內容 (REPL_FILE / REPL_REPLACE)：與主伺服器的覆蓋寫入相同，rename 暫存檔後提交新的 inode
+// REPL_FILE 的檔案不存在時建立 (新項目回傳時已持有寫鎖)，存在時更新權限
+static int apply_replace(Pending *p)
+{
+    FileEntry *file;
+    int created = 0, bits = 0;
+
+    if (upload_prepare_replace(p->upload) < 0)
+        return -1;
+    if (p->type == REPL_FILE)
+    {
+        bits = perm_compile(p->perms);
+        if (bits < 0)
+            return -1;
+        file = catalog_insert(p->name, p->owner, p->group, p->perms, principal_user_id(p->owner),
+                              principal_group_id(p->group), bits, &created);
+        if (!created)
+            lock_file(file, 0, FILELOCK_EOF);
+    }
+    else
+    {
+        if ((file = catalog_find(p->name)) == NULL)
+            return -1;
+        lock_file(file, 0, FILELOCK_EOF);
+    }
+
+    // rename 失敗時不提交：舊的內容與權限維持不變 (新項目維持尚未建立的狀態)
+    if (!created)
+        fdcache_begin_replace(file);
+    int fd = upload_commit_replace(p->upload);
+    if (fd >= 0)
+    {
+        if (p->type == REPL_FILE && !created)
+            catalog_set_perms(file, p->perms, bits);
+        fdcache_install(file, fd, upload_size(p->upload));
+    }
+    else if (!created)
+        fdcache_abort_replace(file);
+    if (created)
+        filelock_release(&file->lock, NULL);
+    else
+        unlock_file(file);
+    return fd < 0 ? -1 : 1;
+}
+
+// 寫在 offset (REPL_WRITE)：與主伺服器的原地寫入相同，寫進目前的 inode 並提交新長度
+// (同樣另外持有 FileEntry.inplace 的寫鎖，重疊的讀取不會送出寫到一半的區段)
+static int apply_write(Pending *p)
+{
+    FileEntry *file = catalog_find(p->name);
+    uint64_t len = upload_size(p->upload);
+
+    if (!file || p->offset > FILELOCK_EOF - len)
+        return -1;
+    if (len == 0)
+        return 1;
+    lock_file(file, p->offset, p->offset + len);
+    sync_lock(&apply_pin, &file->inplace, p->offset, p->offset + len);
+    FdHandle *fdh = fdcache_acquire(file);
+    int ok = fdh && upload_write_at(p->upload, fdh->fd, p->offset) == 0;
+    if (ok)
+        fdcache_commit(file, p->offset + len);
+    if (fdh)
+        fdcache_release(fdh);
+    filelock_release(&file->inplace, &apply_pin.waiter);
+    unlock_file(file);
+    return ok ? 1 : -1;
+}
+
+// 套用一個紀錄 frame：完成一筆紀錄回傳 1，還有後續的 frame 回傳 0，格式錯誤或套用失敗回傳 -1
+// (失敗時中斷連線，重新連線後主伺服器從同一筆紀錄重送)
+static int apply_frame(Pending *p, const FrameHeader *h, const unsigned char *payload)
+{
+    char name[50], owner[50] = "", group[50] = "", perms[10] = "";
+    size_t plen = h->length, off = 0;
+    uint64_t offset;
+
+    // 檔名來自網路：與 new 相同，不接受伺服器自己的檔案或其他目錄
+    if (proto_get_string(payload, plen, &off, name, sizeof(name)) < 0 || name[0] == '\0' || name[0] == '.' ||
+        strchr(name, '/'))
+        return -1;
+    if (h->opcode == REPL_FILE && (proto_get_string(payload, plen, &off, owner, sizeof(owner)) < 0 ||
+                                   proto_get_string(payload, plen, &off, group, sizeof(group)) < 0))
+        return -1;
+    if ((h->opcode == REPL_FILE || h->opcode == REPL_PERMS) &&
+        proto_get_string(payload, plen, &off, perms, sizeof(perms)) < 0)
+        return -1;
+    if (h->opcode == REPL_PERMS)
+        return p->upload ? -1 : apply_perms(name, perms);
+    if (proto_get_u64(payload, plen, &off, &offset) < 0)
+        return -1;
+
+    if (!p->upload)
+    {
+        p->type = h->opcode;
+        snprintf(p->name, sizeof(p->name), "%s", name);
+        snprintf(p->owner, sizeof(p->owner), "%s", owner);
+        snprintf(p->group, sizeof(p->group), "%s", group);
+        snprintf(p->perms, sizeof(p->perms), "%s", perms);
+        p->offset = offset;
+        p->upload = upload_new(name);
+    }
+    else if (p->type != h->opcode || strcmp(p->name, name) != 0 || offset != p->offset + upload_size(p->upload))
+        return -1; // 後續的 frame 必須接著同一筆紀錄
+    if (upload_append(p->upload, (const char *)payload + off, plen - off) < 0)
+        return -1;
+    if (h->flags & FLAG_MORE)
+        return 0;
+
+    int ret = p->type == REPL_WRITE ? apply_write(p) : apply_replace(p);
+    upload_free(p->upload);
+    p->upload = NULL;
+    return ret;
+}
+
+static int connect_primary(void)
+{
+    struct sockaddr_in addr;
+    struct timeval tv = {REPL_TIMEOUT_MS / 1000, REPL_TIMEOUT_MS % 1000 * 1000};
+    int sock, one = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(primary_port);
+    if (inet_pton(AF_INET, primary_host, &addr.sin_addr) <= 0)
+        return -1;
+    if ((sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        close(sock);
+        return -1;
+    }
+    // 主伺服器至少每隔 REPL_HEARTBEAT_MS 送出心跳，太久沒有資料代表連線已經失效
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return sock;
+}
+
+// 一次連線：交握後依序套用紀錄，直到斷線或發生錯誤
+// *my_epoch 為已套用紀錄所屬的 epoch (0: 沒有完整的快照，需要重新取得)
+static void follow(int sock, unsigned char *buf, uint64_t *my_epoch)
+{
+    Pending pending = {0};
+    FrameHeader h;
+    uint64_t hello[2] = {*my_epoch, atomic_load(&applied)};
+    uint64_t their_epoch, port, start;
+    uint64_t beat_seq = 0, beat_at = 0; // 尚未套用到的心跳 (beat_at = 0: 沒有)
+    size_t off = 0;
+
+    if (send_u64s(sock, REPL_HELLO, 0, 2, hello) < 0 || recv_frame(sock, buf, &h) < 0 || h.opcode != REPL_HELLO ||
+        proto_get_u64(buf + PROTO_HEADER_SIZE, h.length, &off, &their_epoch) < 0 ||
+        proto_get_u64(buf + PROTO_HEADER_SIZE, h.length, &off, &port) < 0 ||
+        proto_get_u64(buf + PROTO_HEADER_SIZE, h.length, &off, &start) < 0)
+        return;
+    int snapshot = h.flags & FLAG_MORE;
+    atomic_store(&primary_client_port, (int)port);
+    if (snapshot)
+        *my_epoch = 0; // 快照完整收到之前中斷的話，下次必須重新取得
+    else
+    {
+        if (their_epoch != *my_epoch || start != atomic_load(&applied))
+            return;
+    }
+    printf("[Replica] 已連上主伺服器 %s:%d (%s，序號 %llu)\n", primary_host, primary_port,
+           snapshot ? "取得快照" : "接續紀錄", (unsigned long long)start);
+
+    while (recv_frame(sock, buf, &h) == 0)
+    {
+        const unsigned char *payload = buf + PROTO_HEADER_SIZE;
+        uint64_t seq;
+        int ret;
+
+        off = 0;
+        switch (h.opcode)
+        {
+        case REPL_HEARTBEAT:
+            // 主伺服器在送出心跳時的最新序號：套用到這個序號時，複本與當時的主伺服器一致
+            // (時間以收到心跳為準，不計網路傳輸時間)
+            if (snapshot || proto_get_u64(payload, h.length, &off, &seq) < 0)
+                goto out;
+            if (atomic_load(&applied) >= seq)
+            {
+                atomic_store(&fresh_us, stats_now_us());
+                beat_at = 0;
+            }
+            else if (beat_at == 0)
+            {
+                beat_seq = seq;
+                beat_at = stats_now_us();
+            }
+            break;
+        case REPL_SNAPSHOT:
+            if (!snapshot || pending.upload || proto_get_u64(payload, h.length, &off, &seq) < 0 || seq != start)
+                goto out;
+            atomic_store(&applied, seq);
+            *my_epoch = their_epoch;
+            snapshot = 0;
+            printf("[Replica] 快照套用完成 (序號 %llu)\n", (unsigned long long)seq);
+            break;
+        case REPL_FILE:
+        case REPL_PERMS:
+        case REPL_REPLACE:
+        case REPL_WRITE:
+            if ((ret = apply_frame(&pending, &h, payload)) < 0)
+            {
+                // 重新連線後主伺服器從同一筆紀錄重送；失敗是確定性的 (例如本地狀態已經不一致) 時
+                // 會一直失敗，連續失敗 REPL_APPLY_RETRIES 次後放棄接續，下次連線改為取得快照
+                seq = atomic_load(&applied) + 1;
+                failed_times = !snapshot && seq == failed_seq ? failed_times + 1 : 1;
+                failed_seq = seq;
+                if (!snapshot && failed_times >= REPL_APPLY_RETRIES)
+                {
+                    fprintf(stderr, "[Replica] 紀錄 (序號 %llu) 連續 %d 次無法套用，重新取得快照\n",
+                            (unsigned long long)seq, failed_times);
+                    *my_epoch = 0;
+                    failed_times = 0;
+                }
+                else
+                    fprintf(stderr, "[Replica] 無法套用紀錄 (序號 %llu)，重新連線\n", (unsigned long long)seq);
+                goto out;
+            }
+            if (ret == 0 || snapshot)
+                break; // 快照中的檔案不是紀錄，不計入序號
+            seq = atomic_fetch_add(&applied, 1) + 1;
+            if (beat_at && seq >= beat_seq)
+            {
+                atomic_store(&fresh_us, beat_at);
+                beat_at = 0;
+            }
+            break;
+        default:
+            goto out;
+        }
+    }
+out:
+    if (pending.upload)
+        upload_free(pending.upload);
+}
+
+static void *follower_main(void *arg)
+{
+    unsigned char *buf = malloc(PROTO_HEADER_SIZE + PROTO_MAX_PAYLOAD);
+    uint64_t my_epoch = 0;
+    int warned = 0;
+
+    (void)arg;
+    for (;;)
+    {
+        int sock = connect_primary();
+        if (sock >= 0)
+        {
+            follow(sock, buf, &my_epoch);
+            close(sock);
+            printf("[Replica] 與主伺服器的連線中斷，%d ms 後重新連線\n", REPL_RETRY_MS);
+            warned = 0;
+        }
+        else if (!warned)
+        {
+            fprintf(stderr, "[Replica] 無法連線至主伺服器 %s:%d，持續重試中\n", primary_host, primary_port);
+            warned = 1;
+        }
+        usleep(REPL_RETRY_MS * 1000);
+    }
+    return NULL;
+}
+
+void replica_start_follower(const char *host, int port, int lag_ms)
+{
+    snprintf(primary_host, sizeof(primary_host), "%s", host);
+    primary_port = port;
+    max_lag_ms = lag_ms;
+    role = ROLE_REPLICA;
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, follower_main, NULL);
+    pthread_detach(tid);
+}
+
+int replica_fresh(uint64_t *lag_ms)
+{
+    uint64_t fresh = atomic_load(&fresh_us);
+
+    *lag_ms = fresh ? (stats_now_us() - fresh) / 1000 : UINT64_MAX;
+    return *lag_ms <= (uint64_t)max_lag_ms;
+}
+
+void replica_primary_addr(char *out, size_t cap)
+{
+    int port = atomic_load(&primary_client_port);
+
+    if (port > 0)
+        snprintf(out, cap, "%s:%d", primary_host, port);
+    else
+        snprintf(out, cap, "%s", primary_host);
+}
+
+void replica_stats(ReplicaRole *r, uint64_t *seq, int *n, uint64_t *lag_ms)
+{
+    *r = role;
+    *seq = 0;
+    *n = 0;
+    *lag_ms = 0;
+    if (role == ROLE_PRIMARY)
+    {
+        pthread_mutex_lock(&log_mutex);
+        *seq = last;
+        pthread_mutex_unlock(&log_mutex);
+        *n = atomic_load(&replicas);
+    }
+    else if (role == ROLE_REPLICA)
+    {
+        *seq = atomic_load(&applied);
+        replica_fresh(lag_ms);
+    }
+}
@@ -0,0 +1,93 @@
+/*
+ * replica.h - 主從複寫 (log shipping)
+ * 功能：主伺服器 (-R) 把每次提交的變更 (new / change / 覆蓋 / 附加與原地寫入，含資料) 依序記在記憶體中的
+ *       操作紀錄 (log)，每個連上來的複本由一個傳送執行緒依序送出；複本 (-A) 由一個執行緒依序套用，
+ *       主伺服器不等待複本 (非同步)。紀錄都是「結果」而不是「指令」(整個內容、某個位置的資料、權限)，
+ *       重複套用的結果相同，因此複本可以先取得快照，再從快照開始時的序號接著套用。
+ *       複本只服務讀取 (read / mread / stat / list)：寫入以 ST_ERR_REDIRECT 回覆主伺服器的位址；
+ *       主伺服器沒有待送的紀錄時定期送出心跳，複本套用完心跳之前的紀錄就代表與當時的主伺服器一致，
+ *       距離上一次一致超過容許的落後時間時，讀取以 ST_ERR_STALE 拒絕 (bounded staleness)。
+ *
+ * 複寫連線上的 frame 沿用 protocol.h 的標頭 (opcode 為 REPL_*)，payload 為欄位加上資料：
+ *   複本 -> 主伺服器  REPL_HELLO     u64 epoch, u64 已套用的序號 (epoch 不符時主伺服器改送快照)
+ *   主伺服器 -> 複本  REPL_HELLO     u64 epoch, u64 客戶端 port, u64 起始序號；FLAG_MORE 表示接著送快照
+ *                     REPL_FILE      檔名, 擁有者, 群組, 權限, u64 offset；資料為整個內容 (new 與快照)
+ *                     REPL_PERMS     檔名, 權限 (change)
+ *                     REPL_REPLACE   檔名, u64 offset；資料為整個內容 (覆蓋寫入)
+ *                     REPL_WRITE     檔名, u64 offset；資料寫在 offset (附加與原地寫入)
+ *                     REPL_SNAPSHOT  u64 序號 (快照結束，之後的紀錄從這個序號之後開始)
+ *                     REPL_HEARTBEAT u64 序號 (送出時主伺服器最新的序號)
+ * 超過一個 frame 的資料分成多個同類型的 frame，除了最後一個都設定 FLAG_MORE。
+ */
+
+#ifndef REPLICA_H
+#define REPLICA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "catalog.h"
+
+#define REPL_LOG_RECORDS 65536          // 記憶體中保留的紀錄數上限 (2 的次方)
+#define REPL_LOG_BYTES (64 << 20)       // 記憶體中保留的資料總量上限，落後更多的複本改為重新取得快照
+#define REPL_HEARTBEAT_MS 100           // 沒有新紀錄時的心跳間隔
+#define REPL_DEFAULT_MAX_LAG_MS 1000    // 複本容許的落後時間
+#define REPL_TIMEOUT_MS 3000            // 複本超過這段時間沒有收到任何資料就重新連線
+#define REPL_RETRY_MS 500               // 連線失敗後重試的間隔
+#define REPL_APPLY_RETRIES 3            // 同一筆紀錄連續套用失敗這麼多次後改為重新取得快照
+
+// 複寫連線的 frame 類型
+enum
+{
+    REPL_HELLO = 1,
+    REPL_FILE = 2,
+    REPL_PERMS = 3,
+    REPL_REPLACE = 4,
+    REPL_WRITE = 5,
+    REPL_SNAPSHOT = 6,
+    REPL_HEARTBEAT = 7
+};
+
+// 伺服器的角色
+typedef enum
+{
+    ROLE_STANDALONE,
+    ROLE_PRIMARY,
+    ROLE_REPLICA
+} ReplicaRole;
+
+// 主伺服器：在 repl_port 接受複本連線；client_port 為客戶端連線的 port (複本轉告寫入的客戶端)
+// 無法監聽時回傳 -1
+int replica_start_primary(int repl_port, int client_port);
+
+// 複本：連到 host:port 的主伺服器 (-R 的 port) 並持續套用紀錄，max_lag_ms 為容許的落後時間
+// 斷線時自動重新連線
+void replica_start_follower(const char *host, int port, int max_lag_ms);
+
+ReplicaRole replica_role(void);
+
+// 以下在主伺服器上記錄提交的變更 (其他角色直接返回)：必須在提交之後、釋放涵蓋變更範圍的檔案鎖之前呼叫，
+// 同一個檔案上互相衝突的變更才會依提交順序記錄。內容一律從檔案目前提交的版本讀出
+
+// new：中繼資料與整個內容
+void replica_log_file(FileEntry *file);
+
+// change：權限
+void replica_log_perms(FileEntry *file);
+
+// 覆蓋寫入：整個內容
+void replica_log_replace(FileEntry *file);
+
+// 附加或原地寫入：[offset, offset + len) 的內容
+void replica_log_write(FileEntry *file, uint64_t offset, uint64_t len);
+
+// 複本：與主伺服器一致的資料落後不超過容許的時間時回傳 1 (可以服務讀取)，*lag_ms 為目前落後的時間
+int replica_fresh(uint64_t *lag_ms);
+
+// 複本：主伺服器的客戶端位址 "host:port" 寫入 out (轉告客戶端)；尚未連上主伺服器時只有 host
+void replica_primary_addr(char *out, size_t cap);
+
+// 統計：主伺服器為最新的序號與連線中的複本數；複本為已套用的序號與落後的時間 (從未一致過時為 UINT64_MAX)
+void replica_stats(ReplicaRole *role, uint64_t *seq, int *replicas, uint64_t *lag_ms);
+
+#endif
@@ -1,6 +1,8 @@
 /*
  * server.c - 多執行緒檔案伺服器
  * 功能：提供檔案建立、讀寫與權限管理，並支援多個客戶端同時連線。
+ *       連線由 epoll 事件迴圈 (reactor.c) 管理，指令交給工作執行緒 (pool.c) 執行。
+ *       可以作為主伺服器 (-R) 把變更送給其他伺服器程序，或作為唯讀的複本 (-A) 分擔讀取 (replica.c)。
  */
 
 #include <stdio.h>
@@ -12,445 +14,1932 @@
 #include <pthread.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <time.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <sys/resource.h>
+
+#include "reactor.h"
+#include "pool.h"
+#include "catalog.h"
+#include "protocol.h"
+#include "upload.h"
+#include "fdcache.h"
+#include "content.h"
+#include "commit.h"
+#include "principal.h"
+#include "filelock.h"
+#include "stats.h"
+#include "store.h"
+#include "uring.h"
+#include "replica.h"
 
 #define PORT 8888
-#define MAX_FILES 20     // 最大檔案數量限制
-#define BUFFER_SIZE 1024 // 防止溢位
+#define WRITE_DELAY_SEC 10          // 模擬寫入耗時 (秒)，可以用來測試鎖定機制
+#define CAPABILITY_PRINT_LIMIT 50 // 檔案數超過此值時只印出變更的那一筆，避免每次建立都輸出整個目錄
+
+static int locked_reads; // 1 (-r locked)：讀取時取得讀鎖，等待進行中的寫入完成；0：讀取最後提交的快照
+
+static void print_capability_entry(FileEntry *file, void *arg)
+{
+    (void)arg;
+    char perms[10];
+    uint8_t bits;
+    catalog_get_perms(file, perms, &bits);
+    printf("%-20s %-10s %-10s %-10s\n", file->name, file->owner, file->group, perms);
+}
+
+// 印出目前的 Capability List (伺服器端除錯用)
+void print_capability_lists(FileEntry *changed)
+{
+    printf("\n=== Capability List (伺服器當前狀態) ===\n");
+    printf("%-20s %-10s %-10s %-10s\n", "檔名", "擁有者", "群組", "權限");
+    if (catalog_size() <= CAPABILITY_PRINT_LIMIT)
+        catalog_foreach(print_capability_entry, NULL);
+    else
+    {
+        print_capability_entry(changed, NULL);
+        printf("... (共 %zu 個檔案)\n", catalog_size());
+    }
+    printf("=======================================\n\n");
+}
+
+// 核心權限檢查邏輯：依使用者身分 (擁有者/同群組/其他人) 檢查編譯後的權限位元
+static int check_permission(FileEntry *file, Conn *c, int mode)
+{
+    uint8_t bits = atomic_load_explicit(&file->perm_bits, memory_order_acquire);
+    return perm_check(bits, file->uid, file->gid, &c->who, mode);
+}
+
+// mread / mwrite 中的一個檔案
+typedef struct
+{
+    char name[50];
+    FileEntry *file;   // 找不到、權限不足或重複的檔名時為 NULL
+    int status;        // 檢查結果：ST_OK、錯誤狀態碼，或 0 (重複的檔名，略過)
+    Upload *upload;    // mwrite：寫入資料 (NULL 代表寫入預設的一行)
+    LockWaiter waiter; // 等待這個檔案的鎖
+    int locked;        // 1: 已要求 (或取得) 這個檔案的鎖
+    FdHandle *fdh;     // mwrite 附加模式：寫入的 fd，釋放鎖之後交給 commit_sync
+    CommitItem commit; // mwrite 附加模式：依持久化策略落地後回報結果
+} MultiFile;
+
+// 多檔指令的參數：檔案依檔名排序，鎖也依這個順序要求
+typedef struct Multi
+{
+    char mode[4];        // mwrite 的寫入模式 (o/a)
+    int exclusive;       // 1: 要求寫鎖
+    int n, next;         // 檔案數；下一個要求鎖的檔案
+    TaskFunc then;       // 所有鎖都取得後執行
+    atomic_int syncing;  // mwrite 附加模式：尚未落地的檔案數 (加上 mwrite_locked 自己的 1)
+    char time_str[64];   // mwrite：寫入時間
+    MultiFile files[];
+} Multi;
+
+// 一個待處理的請求 (文字或二進位協定解析後的共同格式)
+typedef struct
+{
+    Conn *conn;
+    int binary;      // 回應要用 frame 還是純文字
+    uint8_t opcode;  // OP_NEW / OP_READ / OP_WRITE / OP_CHANGE / OP_STATS
+    uint32_t req_id; // 二進位協定的 request id (回應時帶回)
+    uint16_t flags;  // 二進位協定標頭的 flags (FLAG_MORE / FLAG_DATA)
+    char arg1[50];   // 檔名 (list：前綴)
+    char arg2[50];   // 權限或寫入模式 (list：cursor)
+    uint64_t offset; // read：起始位置；write (原地寫入模式)：寫入位置
+    uint64_t length; // read：讀取長度 (0 代表讀到檔尾)；list：每頁筆數
+    Multi *multi;    // mread / mwrite 的檔案清單
+    Upload *upload;  // write：客戶端送來的資料 (NULL 代表寫入預設的一行)
+    CommitItem commit; // write (附加模式)：交給 group commit 的請求
+
+    FileEntry *file;   // 取得檔案鎖之後要處理的檔案
+    LockWaiter waiter; // 等待檔案鎖時的 continuation
+    LockWaiter pin;    // write (原地寫入模式)：FileEntry.inplace 的寫鎖
+    int read_ret;      // read / mread：read_then 的結果
+    int waited;        // 0: 未等待；1: 排在讀取者之後；2: 排在寫入者之後 (取得鎖時通知客戶端)
+    int delayed;       // 1: 已模擬過讀取延遲
+    int perm_bits;     // new：編譯後的權限位元
+
+    uint64_t start_us; // 解析完成的時間 (統計延遲用)
+    int status;        // 已送出的最終狀態碼
+} Request;
+
+// 尚未收齊資料的 write 請求 (二進位協定分段上傳，依 request id 對應後續的 OP_WRITE_DATA)
+// 已被拒絕的請求不會留在清單中，它後續的資料 frame 對應不到請求，直接丟棄
+typedef struct PendingWrite
+{
+    Request *req;
+    struct PendingWrite *next;
+    int failed;    // 1: 寫進暫存檔失敗 (在工作執行緒上設定，下一個資料 frame 回報錯誤)
+    PoolNode task; // 把記憶體中的資料交給工作執行緒寫進暫存檔
+} PendingWrite;
+
+static Multi *multi_new(int n)
+{
+    Multi *m = calloc(1, sizeof(Multi) + n * sizeof(MultiFile));
+    m->n = n;
+    return m;
+}
+
+static void request_free(Request *req)
+{
+    if (req->upload)
+        upload_free(req->upload);
+    if (req->multi)
+    {
+        for (int i = 0; i < req->multi->n; i++)
+            if (req->multi->files[i].upload)
+                upload_free(req->multi->files[i].upload);
+        free(req->multi);
+    }
+    free(req);
+}
+
+// 指令對應的統計項目
+static StatKind stat_kind(uint8_t opcode)
+{
+    switch (opcode)
+    {
+    case OP_NEW:
+        return STAT_NEW;
+    case OP_READ:
+        return STAT_READ;
+    case OP_WRITE:
+        return STAT_WRITE;
+    case OP_CHANGE:
+        return STAT_CHANGE;
+    case OP_LIST:
+        return STAT_LIST;
+    case OP_STAT:
+        return STAT_STAT;
+    case OP_MREAD:
+        return STAT_MREAD;
+    case OP_MWRITE:
+        return STAT_MWRITE;
+    default:
+        return STAT_STATS;
+    }
+}
+
+// 非同步完成的請求 (等待檔案鎖或交給 group commit) 結束時呼叫：記錄延遲、釋放請求並把連線交回事件迴圈
+static void finish_request(Request *req)
+{
+    Conn *c = req->conn;
+    stats_record(stat_kind(req->opcode), stats_now_us() - req->start_us, req->status != ST_OK);
+    request_free(req);
+    conn_end_request(c);
+}
+
+// 回應客戶端：文字協定只送訊息本身；二進位協定加上帶有 request id 與狀態碼的標頭
+// 整個 frame 以一次 conn_send 送出，避免與同一連線上其他請求的回應交錯
+static void reply(Request *req, int status, const char *fmt, ...)
+{
+    unsigned char frame[PROTO_HEADER_SIZE + BUFFER_SIZE];
+    char *text = (char *)frame + PROTO_HEADER_SIZE;
+    va_list ap;
+
+    va_start(ap, fmt);
+    int len = vsnprintf(text, BUFFER_SIZE, fmt, ap);
+    va_end(ap);
+    if (len >= BUFFER_SIZE)
+        len = BUFFER_SIZE - 1;
+    if (status >= ST_FINAL)
+        req->status = status;
+
+    if (!req->binary)
+    {
+        conn_send(req->conn, text, len);
+        return;
+    }
+    FrameHeader h = {req->opcode, status, 0, req->req_id, len};
+    proto_encode_header(frame, &h);
+    conn_send(req->conn, (char *)frame, PROTO_HEADER_SIZE + len);
+}
+
+// mread / mwrite 其中一個檔案的結果 (ST_PART)：二進位協定的 payload 為 [檔名] 欄位、狀態碼與訊息；
+// 文字協定為 "檔名: 訊息" 一行
+static void reply_part(Request *req, const char *name, int status, const char *msg)
+{
+    unsigned char frame[PROTO_HEADER_SIZE + BUFFER_SIZE];
+    size_t off = PROTO_HEADER_SIZE, len = strlen(msg);
+
+    if (!req->binary)
+    {
+        int n = snprintf((char *)frame, sizeof(frame), "%s: %s\n", name, msg);
+        conn_send(req->conn, (char *)frame, n < (int)sizeof(frame) ? n : (int)sizeof(frame) - 1);
+        return;
+    }
+    proto_put_field(frame, sizeof(frame), &off, name, strlen(name));
+    frame[off++] = status;
+    memcpy(frame + off, msg, len);
+    off += len;
+    FrameHeader h = {req->opcode, ST_PART, 0, req->req_id, off - PROTO_HEADER_SIZE};
+    proto_encode_header(frame, &h);
+    conn_send(req->conn, (char *)frame, off);
+}
+
+#define READ_PREFIX_MAX 128 // 讀取回應前綴的最大長度
+
+// 讀取回應的前綴寫入 out，回傳長度：二進位協定為 frame 標頭，文字協定為提示文字
+// part 不為 NULL 時是 mread 的其中一個檔案：以 ST_PART 送出，內容前加上 [檔名] 欄位與狀態碼
+static size_t read_prefix(Request *req, const char *part, size_t len, char *out)
+{
+    size_t off = PROTO_HEADER_SIZE;
+
+    if (!part)
+        req->status = ST_OK;
+    if (!req->binary)
+        return part ? snprintf(out, READ_PREFIX_MAX, "讀取內容 (%s): ", part) : snprintf(out, READ_PREFIX_MAX, "讀取內容: ");
+    if (part)
+    {
+        proto_put_field((unsigned char *)out, READ_PREFIX_MAX, &off, part, strlen(part));
+        out[off++] = ST_OK;
+    }
+    FrameHeader h = {req->opcode, part ? ST_PART : ST_OK, 0, req->req_id, off - PROTO_HEADER_SIZE + len};
+    proto_encode_header((unsigned char *)out, &h);
+    return off;
+}
+
+// 回應檔案內容：標頭 (或文字前綴) 之後接上快取 fd 的 [offset, offset + len) 區段，由事件迴圈送到 socket
+// 送完後才呼叫 release (釋放 fd 的參考與讀鎖)；讀鎖釋放後區段可能被原地寫入，因此複製進 socket 而不用 sendfile
+static void reply_file(Request *req, const char *part, int fd, off_t offset, size_t len, ReleaseFunc release,
+                       void *release_arg)
+{
+    char prefix[READ_PREFIX_MAX];
+    size_t plen = read_prefix(req, part, len, prefix);
+    conn_send_file(req->conn, prefix, plen, fd, offset, len, 1, release, release_arg);
+}
+
+// 回應內容快取中的檔案內容 (格式與 reply_file 相同)：共用的緩衝區直接放進輸出佇列，送完才呼叫 release
+static void reply_content(Request *req, const char *part, ContentBuf *cb, size_t offset, size_t len,
+                          ReleaseFunc release, void *release_arg)
+{
+    char prefix[READ_PREFIX_MAX];
+    size_t plen = read_prefix(req, part, len, prefix);
+    conn_send_buffer(req->conn, prefix, plen, cb->data + offset, len, release, release_arg);
+}
+
+// 回應任意長度的資料 (不受 BUFFER_SIZE 限制)，整個 frame 同樣以一次 conn_send 送出
+static void reply_data(Request *req, int status, uint16_t flags, const char *data, size_t len)
+{
+    req->status = status;
+    if (!req->binary)
+    {
+        conn_send(req->conn, data, len);
+        return;
+    }
+    char *frame = malloc(PROTO_HEADER_SIZE + len);
+    FrameHeader h = {req->opcode, status, flags, req->req_id, len};
+    proto_encode_header((unsigned char *)frame, &h);
+    memcpy(frame + PROTO_HEADER_SIZE, data, len);
+    conn_send(req->conn, frame, PROTO_HEADER_SIZE + len);
+    free(frame);
+}
+
+// 排進檔案鎖的等待佇列時 (在鎖的 mutex 內) 通知客戶端排隊順位
+static void on_lock_queued(void *arg, int position, int behind_writer)
+{
+    Request *req = arg;
+    req->waited = behind_writer ? 2 : 1;
+    reply(req, ST_WAITING, "該檔案正在被%s (排隊順位: %d)", behind_writer ? "寫入" : "讀取", position);
+}
+
+// 取得等待中的檔案鎖後通知客戶端
+static void notify_granted(Request *req)
+{
+    if (req->waited)
+        reply(req, ST_GRANTED, req->waited == 2 ? "寫入完成" : "讀取完成");
+    req->waited = 0;
+}
+
+// 要求 req->file 在 [start, end) 範圍的檔案鎖，取得後執行 fn(req)：可以立即取得時直接執行；
+// 否則請求排進該檔案的等待佇列，目前的執行緒直接返回，取得鎖時由工作執行緒接著執行 fn
+// fn 負責以 filelock_release(&file->lock, &req->waiter) 釋放鎖並以 finish_request 結束請求
+static void lock_then(Request *req, int exclusive, uint64_t start, uint64_t end, TaskFunc fn)
+{
+    req->waiter.exclusive = exclusive;
+    req->waiter.start = start;
+    req->waiter.end = end;
+    req->waiter.granted = fn;
+    req->waiter.queued = on_lock_queued;
+    req->waiter.arg = req;
+    if (filelock_acquire(&req->file->lock, &req->waiter) == 0)
+        fn(req);
+}
+
+// 擁有者重新 new 既有檔案 (持有寫鎖)：以新的 inode 取代舊檔案並套用新權限
+// (正在讀取舊版本的讀取者仍持有舊 inode，不會讀到被截斷的資料)
+static void new_replace_locked(void *arg)
+{
+    Request *req = arg;
+    FileEntry *file = req->file;
+
+    notify_granted(req);
+    int fd = -1;
+    if (req->upload)
+    {
+        fdcache_begin_replace(file);
+        fd = upload_commit_replace(req->upload);
+        if (fd < 0)
+            fdcache_abort_replace(file);
+    }
+    if (fd < 0)
+    {
+        // 暫存檔沒有準備好或 rename 失敗：舊的內容與權限都維持不變
+        filelock_release(&file->lock, &req->waiter);
+        reply(req, ST_ERR_IO, "錯誤: 建立失敗 (I/O Error)。");
+        finish_request(req);
+        return;
+    }
+    catalog_set_perms(file, req->arg2, req->perm_bits);
+    fdcache_install(file, fd, upload_size(req->upload));
+    replica_log_file(file);
+    filelock_release(&file->lock, &req->waiter);
+
+    print_capability_lists(file);
+    reply(req, ST_OK, "檔案 %s 建立成功。", req->arg1);
+    finish_request(req);
+}
+
+// 指令：建立新檔案 (new)
+// 擁有者重新建立既有檔案需要等待檔案鎖，此時回傳 1 (請求由 new_replace_locked 結束)
+static int cmd_new(Request *req)
+{
+    Conn *c = req->conn;
+    char *arg1 = req->arg1, *arg2 = req->arg2;
+
+    // 先檢查權限格式並編譯成位元
+    int bits = perm_compile(arg2);
+    if (bits < 0)
+    {
+        reply(req, ST_ERR_BADREQ, "錯誤: 權限格式錯誤 (必須是6碼，例如 rwrnnn)");
+        return 0;
+    }
+
+    // 以 . 開頭的名稱保留給伺服器自己的檔案 (持久目錄、寫入暫存檔)，也不允許指到其他目錄
+    if (arg1[0] == '.' || strchr(arg1, '/'))
+    {
+        reply(req, ST_ERR_BADREQ, "錯誤: 無效的檔名。");
+        return 0;
+    }
+
+    // 在雜湊目錄中新增 (只鎖住檔名所在的分片)
+    int created;
+    FileEntry *file = catalog_insert(arg1, c->user, c->group, arg2, c->who.uid, c->who.gid, bits, &created);
+
+    if (!created && file->uid != c->who.uid)
+    {
+        reply(req, ST_ERR_EXISTS, "錯誤: 檔案 %s 已存在。", arg1);
+        return 0;
+    }
+
+    // 實際在磁碟建立檔案 (持有該檔案的寫鎖，不影響其他檔案)
+    char init[128];
+    int n = snprintf(init, sizeof(init), "Init file: %s\n", arg1);
+    if (!created)
+    {
+        // 新內容先寫入暫存檔 (不持有鎖)，取得寫鎖後只需要 rename
+        req->upload = upload_new(arg1);
+        if (upload_append(req->upload, init, n) < 0 || upload_prepare_replace(req->upload) < 0)
+        {
+            upload_free(req->upload);
+            req->upload = NULL;
+        }
+        req->file = file;
+        req->perm_bits = bits;
+        lock_then(req, 1, 0, FILELOCK_EOF, new_replace_locked);
+        return 1;
+    }
+
+    // 新檔案 (新項目回傳時已持有寫鎖)：開檔後直接放進 fd 快取並提交第一個版本，之後的讀寫不必再 open
+    int fd = open(arg1, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0 && pwrite(fd, init, n, 0) != n)
+    {
+        perror("pwrite");
+        close(fd);
+        unlink(arg1);
+        fd = -1;
+    }
+    if (fd < 0)
+    {
+        // 磁碟檔案沒有建立：項目維持尚未建立的狀態 (讀寫都會失敗)，擁有者可以再 new 一次
+        filelock_release(&file->lock, NULL);
+        reply(req, ST_ERR_IO, "錯誤: 建立失敗 (I/O Error)。");
+        return 0;
+    }
+    fdcache_install(file, fd, n);
+    replica_log_file(file);
+    filelock_release(&file->lock, NULL);
+
+    print_capability_lists(file);
+    reply(req, ST_OK, "檔案 %s 建立成功。", arg1);
+    return 0;
+}
+
+// 變更權限 (持有整個檔案的寫鎖)：等進行中的讀寫完成後才生效，
+// 已通過權限檢查、正在等待或寫入的請求不會在新權限之後才完成
+static void change_locked(void *arg)
+{
+    Request *req = arg;
+    FileEntry *file = req->file;
+
+    notify_granted(req);
+    catalog_set_perms(file, req->arg2, req->perm_bits);
+    replica_log_perms(file);
+    filelock_release(&file->lock, &req->waiter);
+
+    print_capability_lists(file);
+    reply(req, ST_OK, "檔案 %s 權限已變更。", req->arg1);
+    finish_request(req);
+}
+
+// 指令：變更權限 (change)
+// 需要等待檔案鎖時回傳 1 (請求由 change_locked 結束)
+static int cmd_change(Request *req)
+{
+    Conn *c = req->conn;
+    char *arg1 = req->arg1, *arg2 = req->arg2;
+
+    // 檢查權限格式並編譯成位元
+    int bits = perm_compile(arg2);
+    if (bits < 0)
+    {
+        reply(req, ST_ERR_BADREQ, "錯誤: 權限格式錯誤 (必須是6碼，例如 rwrnnn)");
+        return 0;
+    }
+
+    FileEntry *file = catalog_find(arg1);
+    if (!file)
+    {
+        reply(req, ST_ERR_NOTFOUND, "錯誤: 找不到檔案。");
+        return 0;
+    }
+
+    // 只有擁有者可以變更權限
+    if (file->uid != c->who.uid)
+    {
+        reply(req, ST_ERR_PERM, "錯誤: 你不是擁有者，無法變更權限。");
+        return 0;
+    }
+
+    // 變更權限：要求整個檔案的寫鎖
+    req->file = file;
+    req->perm_bits = bits;
+    lock_then(req, 1, 0, FILELOCK_EOF, change_locked);
+    return 1;
+}
+
+// 模擬讀取耗時 5 秒，可以用來測試併發讀取
+static void simulate_read(Request *req)
+{
+    if (req->delayed)
+        return;
+    req->delayed = 1;
+    printf("[Read] %s 正在讀取... (模擬延遲耗時 5 秒)\n", req->conn->user);
+    sleep(5);
+}
+
+// 讀取的範圍結尾 (length = 0 或超出範圍時讀到檔尾)
+static uint64_t read_end(Request *req)
+{
+    uint64_t end = req->offset + req->length;
+    return req->length == 0 || end < req->offset ? FILELOCK_EOF : end;
+}
+
+// 長度為 size 的版本中實際送出的區段
+static void read_range(Request *req, uint64_t size, uint64_t *offset, uint64_t *len)
+{
+    *offset = req->offset < size ? req->offset : size;
+    *len = size - *offset;
+    if (req->length > 0 && req->length < *len)
+        *len = req->length;
+    if (*len > UINT32_MAX - READ_PREFIX_MAX)
+        *len = UINT32_MAX - READ_PREFIX_MAX; // frame 長度欄位為 32 位元，更大的檔案以區段讀取
+}
+
+// 一次讀取在 FileEntry.inplace 持有的讀鎖 (與重疊的原地寫入互斥，見 fdcache.h)
+// 回應送完時由輸出佇列以 pin_release 釋放讀鎖與送出的版本
+typedef struct
+{
+    LockWaiter waiter;
+    FileEntry *file;
+    Request *req;
+    const char *part;
+    TaskFunc then;  // 等待讀鎖時：送出之後由工作執行緒接著執行
+    FdHandle *fdh;  // 送出中的版本 (fd 或內容快取其中之一)
+    ContentBuf *cb;
+} ReadPin;
+
+static void pin_release(void *arg)
+{
+    ReadPin *pin = arg;
+    if (pin->fdh)
+        fdcache_release(pin->fdh);
+    if (pin->cb)
+        content_release(pin->cb);
+    filelock_release(&pin->file->inplace, &pin->waiter);
+    free(pin);
+}
+
+// 持有讀鎖時送出最後提交的版本，結果放在 req->read_ret
+// 放進輸出佇列之後 pin 可能已被事件迴圈釋放，不可再使用
+static void pin_send(ReadPin *pin)
+{
+    Request *req = pin->req;
+    FileEntry *file = pin->file;
+    uint64_t size, offset, len;
+    uint32_t version;
+
+    pin->fdh = fdcache_snapshot(file, &size, &version);
+    if (!pin->fdh)
+    {
+        req->read_ret = errno == ENOENT ? -1 : -2;
+        pin_release(pin);
+        return;
+    }
+    // 小檔案整個讀進內容快取 (讀鎖涵蓋整個檔案時才可以載入)
+    if (pin->waiter.start == 0 && pin->waiter.end == FILELOCK_EOF &&
+        (pin->cb = content_load(file, pin->fdh->fd, size, version)) != NULL)
+    {
+        fdcache_release(pin->fdh);
+        pin->fdh = NULL;
+    }
+
+    read_range(req, size, &offset, &len);
+    req->read_ret = 0;
+    if (pin->cb)
+        reply_content(req, pin->part, pin->cb, offset, len, pin_release, pin);
+    else
+        reply_file(req, pin->part, pin->fdh->fd, offset, len, pin_release, pin);
+}
+
+static void pin_queued(void *arg, int position, int behind_writer)
+{
+    ReadPin *pin = arg;
+    on_lock_queued(pin->req, position, behind_writer);
+}
+
+static void pin_granted(void *arg)
+{
+    ReadPin *pin = arg;
+    Request *req = pin->req;
+    TaskFunc then = pin->then;
+
+    notify_granted(req);
+    pin_send(pin);
+    then(req);
+}
+
+// 送出檔案最後提交的版本 (read / mread 共用)：覆蓋寫入會換成新的 inode，附加寫入的資料在提交前不計入長度
+// 內容快取命中時直接從記憶體送出；否則先在送出的範圍取得 FileEntry.inplace 的讀鎖，
+// 再送出整個檔案或指定區段 (小檔案載入內容快取)，快照的 inode 與讀鎖都保留到回應送完
+// part 不為 NULL 時是 mread 的其中一個檔案 (見 read_prefix)
+// 結果放在 req->read_ret：0 成功；-1 檔案尚未建立完成 (new 持有寫鎖直到磁碟檔案建立)；-2 I/O 錯誤 (兩者都尚未回應)
+// 已送出時回傳 0；讀鎖被重疊的原地寫入佔用時回傳 1，取得讀鎖並送出後由工作執行緒執行 then(req)
+static int read_then(Request *req, FileEntry *file, const char *part, TaskFunc then)
+{
+    ContentBuf *cb = content_get(file);
+    uint64_t size = 0, offset, len;
+
+    if (cb)
+    {
+        read_range(req, cb->len, &offset, &len);
+        req->read_ret = 0;
+        reply_content(req, part, cb, offset, len, content_release, cb);
+        return 0;
+    }
+
+    ReadPin *pin = calloc(1, sizeof(ReadPin));
+    pin->file = file;
+    pin->req = req;
+    pin->part = part;
+    pin->then = then;
+    fdcache_version(file, &size);
+    int whole = size <= CONTENT_MAX_FILE; // 可能載入內容快取
+    pin->waiter.exclusive = 0;
+    pin->waiter.start = whole ? 0 : req->offset;
+    pin->waiter.end = whole ? FILELOCK_EOF : read_end(req);
+    pin->waiter.granted = pin_granted;
+    pin->waiter.queued = pin_queued;
+    pin->waiter.arg = pin;
+    if (filelock_acquire(&file->inplace, &pin->waiter) != 0)
+        return 1;
+    pin_send(pin);
+    return 0;
+}
+
+// 持有讀鎖時的讀取送出之後：結束請求
+static void read_locked_done(void *arg)
+{
+    Request *req = arg;
+
+    if (req->read_ret < 0)
+        reply(req, ST_ERR_IO, "錯誤: 讀取失敗 (I/O Error)。");
+    filelock_release(&req->file->lock, &req->waiter);
+    finish_request(req);
+}
+
+// 持有讀鎖時讀取 (-r locked，或快照讀取遇到正在建立的檔案)
+static void read_locked(void *arg)
+{
+    Request *req = arg;
+
+    notify_granted(req);
+    simulate_read(req);
+    if (read_then(req, req->file, NULL, read_locked_done) == 0)
+        read_locked_done(req);
+}
+
+// 快照讀取送出之後：檔案尚未建立完成時改為等待讀鎖，否則結束請求
+static void read_snapshot_done(void *arg)
+{
+    Request *req = arg;
+
+    if (req->read_ret == -1)
+    {
+        lock_then(req, 0, req->offset, read_end(req), read_locked);
+        return;
+    }
+    if (req->read_ret < 0)
+        reply(req, ST_ERR_IO, "錯誤: 讀取失敗 (I/O Error)。");
+    finish_request(req);
+}
+
+// 指令：讀取檔案 (read)
+// 通過檢查後一律回傳 1 (請求由 read_snapshot_done / read_locked_done 結束)
+static int cmd_read(Request *req)
+{
+    Conn *c = req->conn;
+    char *arg1 = req->arg1;
+
+    FileEntry *file = catalog_find(arg1); // O(1) 雜湊查詢
+    if (!file)
+    {
+        reply(req, ST_ERR_NOTFOUND, "錯誤: 找不到檔案。");
+        return 0;
+    }
+
+    // 檢查是否有讀取權限
+    if (!check_permission(file, c, PERM_READ))
+    {
+        reply(req, ST_ERR_PERM, "權限不足: 無法讀取。");
+        return 0;
+    }
+
+    req->file = file;
+    if (locked_reads)
+    {
+        // 讀取最新內容：等待範圍內進行中的寫入完成
+        // (只鎖定要讀取的範圍：不重疊的寫入，例如檔尾之後的附加寫入，不必等待)
+        lock_then(req, 0, req->offset, read_end(req), read_locked);
+        return 1;
+    }
+
+    // 快照讀取：不等待進行中的寫入 (重疊的原地寫入除外)
+    simulate_read(req);
+    if (read_then(req, file, NULL, read_snapshot_done) == 0)
+        read_snapshot_done(req);
+    return 1;
+}
+
+// group commit：這批寫入在等待檔案鎖 (position > 0) 或已取得鎖 (position = 0) 時通知客戶端
+static void on_commit_wait(CommitItem *item, int position, int behind_writer)
+{
+    Request *req = item->arg;
+    if (position > 0)
+        on_lock_queued(req, position, behind_writer);
+    else
+        notify_granted(req);
+}
+
+// group commit：這批寫入已依持久化策略完成，回覆並結束請求
+static void on_commit_done(CommitItem *item)
+{
+    Request *req = item->arg;
+
+    req->upload = item->upload; // 簽名行由 commit 建立，隨請求一起釋放
+    if (item->ok)
+        reply(req, ST_OK, "寫入成功 (時間: %s)。", item->time_str);
+    else
+        reply(req, ST_ERR_IO, "錯誤: 寫入失敗 (I/O Error)。");
+    finish_request(req);
+}
+
+// 覆蓋模式 (持有寫鎖)：rename 暫存檔並提交新版本
+static void overwrite_locked(void *arg)
+{
+    Request *req = arg;
+    FileEntry *file = req->file;
+
+    notify_granted(req);
+    printf("[Write] %s 正在寫入... (模擬延遲耗時 %d 秒)\n", req->conn->user, WRITE_DELAY_SEC);
+    sleep(WRITE_DELAY_SEC); // 模擬寫入耗時，可以用來測試鎖定機制
+
+    time_t now = time(NULL);
+    struct tm t;
+    char time_str[64];
+    localtime_r(&now, &t);
+    strftime(time_str, sizeof(time_str), "%Y/%m/%d-%H:%M:%S", &t);
+
+    // 沒有客戶端資料：寫入的資訊格式: xxx wrote here at xx/xx/xx-xx:xx:xx.
+    int ok = 1;
+    if (!req->upload)
+    {
+        char line[128];
+        int n = snprintf(line, sizeof(line), "%s wrote here at %s.\n", req->conn->user, time_str);
+        req->upload = upload_new(req->arg1);
+        ok = upload_append(req->upload, line, n) == 0 && upload_prepare_replace(req->upload) == 0;
+    }
+
+    // rename 後檔名指向新的 inode，提交為新版本 (舊版本在最後一個讀取者結束後回收)
+    if (ok)
+    {
+        fdcache_begin_replace(file);
+        int fd = upload_commit_replace(req->upload);
+        if (fd >= 0)
+            fdcache_install(file, fd, upload_size(req->upload));
+        else
+            fdcache_abort_replace(file); // rename 失敗：維持原本的版本
+        ok = fd >= 0;
+    }
+    if (ok)
+        replica_log_replace(file);
+    filelock_release(&file->lock, &req->waiter); // 釋放鎖
+
+    if (ok)
+        reply(req, ST_OK, "寫入成功 (時間: %s)。", time_str);
+    else
+        reply(req, ST_ERR_IO, "錯誤: 寫入失敗 (I/O Error)。");
+    finish_request(req);
+}
+
+// 原地寫入 (另外持有 FileEntry.inplace 在同一範圍的寫鎖)：直接寫進目前的 inode 並提交新版本
+// 重疊的讀取在寫入期間等待，不會送出寫到一半的區段 (fdcache.h)
+static void positional_write(void *arg)
+{
+    Request *req = arg;
+    FileEntry *file = req->file;
+
+    time_t now = time(NULL);
+    struct tm t;
+    char time_str[64];
+    localtime_r(&now, &t);
+    strftime(time_str, sizeof(time_str), "%Y/%m/%d-%H:%M:%S", &t);
+
+    FdHandle *fdh = fdcache_acquire(file);
+    int ok = fdh && upload_write_at(req->upload, fdh->fd, req->offset) == 0;
+    if (ok)
+        fdcache_commit(file, req->offset + upload_size(req->upload));
+    if (fdh)
+        fdcache_release(fdh);
+    if (ok)
+        replica_log_write(file, req->offset, upload_size(req->upload));
+    filelock_release(&file->inplace, &req->pin);
+    filelock_release(&file->lock, &req->waiter);
+
+    if (ok)
+        reply(req, ST_OK, "寫入成功 (時間: %s)。", time_str);
+    else
+        reply(req, ST_ERR_IO, "錯誤: 寫入失敗 (I/O Error)。");
+    finish_request(req);
+}
+
+// 原地寫入模式 (持有 [offset, offset + 資料長度) 的寫鎖)：寫入不同區段的請求、以及不重疊的讀取可以同時進行
+// 實際寫入前再等待重疊範圍內尚未送完的讀取 (不佔用執行緒，由 positional_write 結束請求)
+static void positional_locked(void *arg)
+{
+    Request *req = arg;
+    FileEntry *file = req->file;
+
+    notify_granted(req);
+    printf("[Write] %s 正在寫入 offset %llu... (模擬延遲耗時 %d 秒)\n", req->conn->user,
+           (unsigned long long)req->offset, WRITE_DELAY_SEC);
+    sleep(WRITE_DELAY_SEC); // 模擬寫入耗時，可以用來測試鎖定機制
+
+    req->pin.exclusive = 1;
+    req->pin.start = req->waiter.start;
+    req->pin.end = req->waiter.end;
+    req->pin.granted = positional_write;
+    req->pin.queued = NULL;
+    req->pin.arg = req;
+    if (filelock_acquire(&file->inplace, &req->pin) == 0)
+        positional_write(req);
+}
+
+// 指令：寫入檔案 (write)
+// 附加模式交給 group commit (由 on_commit_done 結束請求)、覆蓋與原地寫入模式等待寫鎖
+// (由 overwrite_locked / positional_locked 結束)，此時回傳 1
+static int cmd_write(Request *req)
+{
+    Conn *c = req->conn;
+    char *arg1 = req->arg1, *arg2 = req->arg2;
+
+    FileEntry *file = catalog_find(arg1); // O(1) 雜湊查詢
+    if (!file)
+    {
+        reply(req, ST_ERR_NOTFOUND, "錯誤: 找不到檔案。");
+        return 0;
+    }
+
+    // 檢查是否有寫入權限
+    if (!check_permission(file, c, PERM_WRITE))
+    {
+        reply(req, ST_ERR_PERM, "權限不足: 無法寫入。");
+        return 0;
+    }
+
+    // 原地寫入模式 (p)：只鎖定寫入的範圍，直接修改目前的 inode
+    // (快照讀取不等待寫鎖，但會等待重疊範圍內進行中的原地寫入，見 fdcache.h)
+    if (strcmp(arg2, "p") == 0)
+    {
+        if (!req->upload)
+        {
+            char line[128], time_str[64];
+            time_t now = time(NULL);
+            struct tm t;
+            localtime_r(&now, &t);
+            strftime(time_str, sizeof(time_str), "%Y/%m/%d-%H:%M:%S", &t);
+            int n = snprintf(line, sizeof(line), "%s wrote here at %s.\n", c->user, time_str);
+            req->upload = upload_new(arg1);
+            upload_append(req->upload, line, n);
+        }
+        uint64_t len = upload_size(req->upload);
+        if (req->offset > FILELOCK_EOF - len)
+        {
+            reply(req, ST_ERR_BADREQ, "無效指令。");
+            return 0;
+        }
+        req->file = file;
+        lock_then(req, 1, req->offset, req->offset + len, positional_locked);
+        return 1;
+    }
+
+    // 附加模式 (a)：同一個檔案上等待中的附加請求合併成一批寫入
+    if (strcmp(arg2, "o") != 0)
+    {
+        req->commit.upload = req->upload;
+        req->commit.user = c->user;
+        req->commit.arg = req;
+        req->commit.on_wait = on_commit_wait;
+        req->commit.on_done = on_commit_done;
+        req->upload = NULL;
+        commit_append(file, &req->commit);
+        return 1;
+    }
+
+    // 覆蓋模式 (o)：資料先完整寫入同目錄的暫存檔 (不持有鎖)，提交時只需要 rename
+    if (req->upload && upload_prepare_replace(req->upload) < 0)
+    {
+        reply(req, ST_ERR_IO, "錯誤: 寫入失敗 (I/O Error)。");
+        return 0;
+    }
+
+    // 要求整個檔案的寫鎖，如果有人正在寫入 (或 -r locked 的讀取者正在讀取) 則排隊等待，不佔用執行緒
+    req->file = file;
+    lock_then(req, 1, 0, FILELOCK_EOF, overwrite_locked);
+    return 1;
+}
+
+// 指令：列出檔案 (list)：依檔名排序，可以只列出某個前綴的檔案；
+// 超過一頁時二進位協定的回應設定 FLAG_MORE，客戶端以這一頁最後一個檔名作為 cursor 取得下一頁
+static void cmd_list(Request *req)
+{
+    int limit = req->length == 0 ? PROTO_LIST_DEFAULT : req->length > PROTO_LIST_MAX ? PROTO_LIST_MAX : (int)req->length;
+    CatalogInfo *info = malloc(limit * sizeof(CatalogInfo));
+    int more;
+    int n = catalog_list(req->arg1, req->arg2, info, limit, &more);
+
+    size_t cap = (size_t)n * sizeof(CatalogInfo) + 256, len = 0;
+    char *text = malloc(cap);
+    for (int i = 0; i < n; i++)
+        len += snprintf(text + len, cap - len, "%s %s %s %s\n", info[i].perms, info[i].owner, info[i].group,
+                        info[i].name);
+    if (!req->binary && more)
+        len += snprintf(text + len, cap - len, "(還有更多檔案: list %s %s)\n", req->arg1[0] ? req->arg1 : "*",
+                        info[n - 1].name);
+    else if (!req->binary && n == 0)
+        len += snprintf(text + len, cap - len, "(沒有符合的檔案)\n");
+    reply_data(req, ST_OK, more ? FLAG_MORE : 0, text, len);
+    free(text);
+    free(info);
+}
+
+// 指令：查詢檔案資訊 (stat)：權限、擁有者、群組與已提交的長度和版本
+static void cmd_stat(Request *req)
+{
+    FileEntry *file = catalog_find(req->arg1);
+    if (!file)
+    {
+        reply(req, ST_ERR_NOTFOUND, "錯誤: 找不到檔案。");
+        return;
+    }
+
+    char perms[10];
+    uint8_t bits;
+    uint64_t size;
+    catalog_get_perms(file, perms, &bits);
+    uint32_t version = fdcache_version(file, &size);
+    reply(req, ST_OK, "%s %s %s %llu %u %s", perms, file->owner, file->group, (unsigned long long)size, version,
+          file->name);
+}
+
+static int multi_cmp(const void *a, const void *b)
+{
+    return strcmp(((const MultiFile *)a)->name, ((const MultiFile *)b)->name);
+}
+
+// 多檔指令的準備：檔名排序 (決定要求鎖的順序)，並逐一查詢檔案、檢查權限
+// 重複的檔名只保留第一個；回傳檢查失敗的檔案數
+static int multi_check(Request *req, int mode)
+{
+    Multi *m = req->multi;
+    int failed = 0;
+
+    qsort(m->files, m->n, sizeof(MultiFile), multi_cmp);
+    for (int i = 0; i < m->n; i++)
+    {
+        MultiFile *f = &m->files[i];
+        if (i > 0 && strcmp(f->name, m->files[i - 1].name) == 0)
+            continue; // status = 0：略過
+        f->file = catalog_find(f->name);
+        if (!f->file)
+            f->status = ST_ERR_NOTFOUND;
+        else if (!check_permission(f->file, req->conn, mode))
+        {
+            f->status = ST_ERR_PERM;
+            f->file = NULL;
+        }
+        else
+            f->status = ST_OK;
+        failed += f->status != ST_OK;
+    }
+    return failed;
+}
+
+// 依序要求 m->files 的整個檔案鎖，全部取得後執行 m->then(req)
+// 所有多檔請求都依檔名順序要求，單檔請求最多持有一個鎖，因此不會互相等待成環 (不會死結)；
+// 取不到鎖時不佔用執行緒，取得時由工作執行緒接著要求下一個
+static void multi_lock_next(void *arg)
+{
+    Request *req = arg;
+    Multi *m = req->multi;
+
+    while (m->next < m->n)
+    {
+        MultiFile *f = &m->files[m->next++];
+        if (!f->file)
+            continue;
+        f->locked = 1;
+        f->waiter.exclusive = m->exclusive;
+        f->waiter.start = 0;
+        f->waiter.end = FILELOCK_EOF;
+        f->waiter.granted = multi_lock_next;
+        f->waiter.queued = on_lock_queued;
+        f->waiter.arg = req;
+        if (filelock_acquire(&f->file->lock, &f->waiter) != 0)
+            return;
+    }
+    notify_granted(req);
+    m->then(req);
+}
+
+static void multi_unlock(Multi *m)
+{
+    for (int i = 0; i < m->n; i++)
+    {
+        if (m->files[i].locked)
+            filelock_release(&m->files[i].file->lock, &m->files[i].waiter);
+        m->files[i].locked = 0;
+    }
+}
+
+static void mread_next(void *arg);
+
+// mread 其中一個檔案送出之後：找不到、沒有權限或讀取失敗時回報該檔案的錯誤
+static void mread_report(Request *req, MultiFile *f)
+{
+    if (f->status == ST_OK && req->read_ret < 0)
+        f->status = req->read_ret == -1 ? ST_ERR_NOTFOUND : ST_ERR_IO;
+    if (f->status == ST_ERR_NOTFOUND)
+        reply_part(req, f->name, ST_ERR_NOTFOUND, "錯誤: 找不到檔案。");
+    else if (f->status == ST_ERR_PERM)
+        reply_part(req, f->name, ST_ERR_PERM, "權限不足: 無法讀取。");
+    else if (f->status == ST_ERR_IO)
+        reply_part(req, f->name, ST_ERR_IO, "錯誤: 讀取失敗 (I/O Error)。");
+}
+
+// 等待讀鎖的檔案送出之後 (工作執行緒)：回報結果並接著讀取下一個檔案
+static void mread_resume(void *arg)
+{
+    Request *req = arg;
+    mread_report(req, &req->multi->files[req->multi->next - 1]);
+    mread_next(req);
+}
 
-// 檔案資訊結構：用來記錄伺服器上管理的檔案狀態
-typedef struct
+// 依序送出 m->next 之後的檔案 (內容或錯誤)，遇到被原地寫入佔用的檔案時等待；全部送完後送出摘要並結束請求
+static void mread_next(void *arg)
 {
-    char name[50];         // 檔案名稱
-    char owner[50];        // 擁有者名稱
-    char group[50];        // 所屬群組
-    char perms[10];        // 權限字串 (6碼，格式如 "rwrnnn"，代表 擁有者/群組/其他人 的 讀/寫 權限)
-    int is_used;           // 標記此結構是否已被使用 (1:有檔案, 0:空閒)
-    pthread_rwlock_t lock; // PTHREAD 內建的讀寫鎖：允許多個讀取者，寫入時獨佔
-} FileEntry;
+    Request *req = arg;
+    Multi *m = req->multi;
+    int ok = 0, failed = 0;
 
-// 全域檔案清單與互斥鎖
-FileEntry file_list[MAX_FILES];
-pthread_mutex_t list_mutex = PTHREAD_MUTEX_INITIALIZER; // 用於保護檔案清單的變更 (如建立新檔案時)，用 PTHREAD 內建的 mutex lock
+    while (m->next < m->n)
+    {
+        MultiFile *f = &m->files[m->next++];
+        if (f->status == ST_OK && read_then(req, f->file, f->name, mread_resume) != 0)
+            return;
+        mread_report(req, f);
+    }
+    multi_unlock(m);
 
-// 客戶端連線資訊結構
-typedef struct
+    for (int i = 0; i < m->n; i++)
+    {
+        if (m->files[i].status == ST_OK)
+            ok++;
+        else if (m->files[i].status != 0)
+            failed++;
+    }
+    reply(req, ST_OK, "讀取完成: %d 個檔案成功，%d 個失敗。", ok, failed);
+    finish_request(req);
+}
+
+// 多檔讀取：每個檔案送出一個結果 (內容或錯誤)，最後送出摘要並結束請求
+static void mread_run(void *arg)
 {
-    int sockfd;     // socket file descriptor
-    char user[50];  // 使用者名稱
-    char group[50]; // 使用者群組
-} ClientInfo;
+    Request *req = arg;
+
+    simulate_read(req); // 整批只模擬一次延遲
+    req->multi->next = 0; // 從第一個檔案開始送出 (-r locked 時 next 已用來依序要求鎖)
+    mread_next(req);
+}
 
-// 初始化檔案清單：重置使用狀態並初始化讀寫鎖
-void init_files()
+// 指令：一次讀取多個檔案 (mread)，找不到或沒有權限的檔案個別回報錯誤
+// -r locked 時依檔名順序取得每個檔案的讀鎖，全部取得後才讀取；請求一律由 mread_run 結束，回傳 1
+static int cmd_mread(Request *req)
 {
-    for (int i = 0; i < MAX_FILES; i++)
+    Multi *m = req->multi;
+
+    multi_check(req, PERM_READ);
+    if (!locked_reads)
     {
-        file_list[i].is_used = 0;
-        pthread_rwlock_init(&file_list[i].lock, NULL);
+        mread_run(req);
+        return 1;
     }
+    m->exclusive = 0;
+    m->then = mread_run;
+    multi_lock_next(req);
+    return 1;
 }
 
-// 印出目前的 Capability List (伺服器端除錯用)
-void print_capability_lists()
+// 多檔寫入的所有檔案都完成 (附加模式已依持久化策略落地)：依序回報每個檔案的結果與摘要，結束請求
+static void mwrite_reply(Request *req)
 {
-    printf("\n=== Capability List (伺服器當前狀態) ===\n");
-    printf("%-20s %-10s %-10s %-10s\n", "檔名", "擁有者", "群組", "權限");
-    for (int i = 0; i < MAX_FILES; i++)
+    Multi *m = req->multi;
+    int failed = 0;
+
+    for (int i = 0; i < m->n; i++)
+    {
+        MultiFile *f = &m->files[i];
+        if (!f->file)
+            continue;
+        int ok = f->status == ST_OK;
+        reply_part(req, f->name, f->status, ok ? "寫入成功。" : "錯誤: 寫入失敗 (I/O Error)。");
+        failed += !ok;
+    }
+    if (failed)
+        reply(req, ST_ERR_IO, "錯誤: %d 個檔案寫入失敗 (時間: %s)。", failed, m->time_str);
+    else
+        reply(req, ST_OK, "寫入成功 (時間: %s)。", m->time_str);
+    finish_request(req);
+}
+
+// 附加模式的一個檔案已落地 (可能在同步執行緒上)：最後一個完成的回覆請求
+static void mwrite_synced(CommitItem *item)
+{
+    Request *req = item->arg;
+    Multi *m = req->multi;
+
+    for (int i = 0; i < m->n; i++)
+        if (&m->files[i].commit == item && !item->ok)
+            m->files[i].status = ST_ERR_IO;
+    if (atomic_fetch_sub(&m->syncing, 1) == 1)
+        mwrite_reply(req);
+}
+
+// 多檔寫入 (持有所有檔案的寫鎖)：每個檔案依模式覆蓋或附加，整批只模擬一次寫入延遲
+// 附加模式與 group commit 一樣依持久化策略落地 (在釋放鎖之後) 才回覆
+static void mwrite_locked(void *arg)
+{
+    Request *req = arg;
+    Multi *m = req->multi;
+    int overwrite = strcmp(m->mode, "o") == 0;
+
+    printf("[Write] %s 批次寫入 %d 個檔案... (模擬延遲耗時 %d 秒)\n", req->conn->user, m->n, WRITE_DELAY_SEC);
+    sleep(WRITE_DELAY_SEC);
+
+    time_t now = time(NULL);
+    struct tm t;
+    localtime_r(&now, &t);
+    strftime(m->time_str, sizeof(m->time_str), "%Y/%m/%d-%H:%M:%S", &t);
+
+    for (int i = 0; i < m->n; i++)
     {
-        if (file_list[i].is_used)
+        MultiFile *f = &m->files[i];
+        if (!f->file)
+            continue;
+        if (!f->upload)
         {
-            printf("%-20s %-10s %-10s %-10s\n",
-                   file_list[i].name, file_list[i].owner, file_list[i].group, file_list[i].perms);
+            char line[128];
+            int n = snprintf(line, sizeof(line), "%s wrote here at %s.\n", req->conn->user, m->time_str);
+            f->upload = upload_new(f->name);
+            upload_append(f->upload, line, n);
         }
+
+        int ok;
+        if (overwrite)
+        {
+            // 與覆蓋模式相同：rename 暫存檔並提交新的 inode
+            ok = upload_prepare_replace(f->upload) == 0;
+            if (ok)
+            {
+                fdcache_begin_replace(f->file);
+                int fd = upload_commit_replace(f->upload);
+                if (fd >= 0)
+                    fdcache_install(f->file, fd, upload_size(f->upload));
+                else
+                    fdcache_abort_replace(f->file);
+                ok = fd >= 0;
+            }
+            if (ok)
+                replica_log_replace(f->file);
+        }
+        else
+        {
+            // 持有整個檔案的寫鎖，直接寫在已提交的檔尾之後 (fd 的參考保留到落地)
+            uint64_t size;
+            f->fdh = fdcache_snapshot(f->file, &size, NULL);
+            ok = f->fdh && upload_write_at(f->upload, f->fdh->fd, size) == 0;
+            if (ok)
+            {
+                fdcache_commit(f->file, size + upload_size(f->upload));
+                replica_log_write(f->file, size, upload_size(f->upload));
+            }
+            else if (f->fdh)
+            {
+                fdcache_release(f->fdh);
+                f->fdh = NULL;
+            }
+        }
+        f->status = ok ? ST_OK : ST_ERR_IO;
     }
-    printf("=======================================\n\n");
+    multi_unlock(m);
+
+    // 附加成功的檔案交給 commit_sync (同步在鎖外進行)，全部落地後由最後一個完成者回覆
+    atomic_store(&m->syncing, 1);
+    for (int i = 0; i < m->n; i++)
+    {
+        MultiFile *f = &m->files[i];
+        if (!f->fdh)
+            continue;
+        f->commit.next = NULL;
+        f->commit.arg = req;
+        f->commit.on_done = mwrite_synced;
+        atomic_fetch_add(&m->syncing, 1);
+        FdHandle *fdh = f->fdh;
+        f->fdh = NULL;
+        commit_sync(fdh, &f->commit);
+    }
+    if (atomic_fetch_sub(&m->syncing, 1) == 1)
+        mwrite_reply(req);
 }
 
-// 檢查權限字串格式是否合法 (必須是 6 碼，且奇數位為 r/n，偶數位為 w/n)
-int check_perm_format(const char *perms)
+// 指令：一次寫入多個檔案 (mwrite)
+// 任何一個檔案找不到或沒有權限時整個請求被拒絕 (不寫入任何檔案)；
+// 否則依檔名順序取得所有檔案的寫鎖後寫入 (由 mwrite_locked 結束請求)，此時回傳 1
+static int cmd_mwrite(Request *req)
 {
-    if (strlen(perms) != 6)
-        return 0;
-    for (int i = 0; i < 6; i++)
+    Multi *m = req->multi;
+
+    if (multi_check(req, PERM_WRITE) > 0)
+    {
+        for (int i = 0; i < m->n; i++)
+        {
+            MultiFile *f = &m->files[i];
+            if (f->status == ST_ERR_NOTFOUND)
+                reply(req, ST_ERR_NOTFOUND, "錯誤: 找不到檔案 %s。", f->name);
+            else if (f->status == ST_ERR_PERM)
+                reply(req, ST_ERR_PERM, "權限不足: 無法寫入 %s。", f->name);
+            else
+                continue;
+            return 0;
+        }
+    }
+
+    // 覆蓋模式的資料先寫入暫存檔 (不持有鎖)；同一個檔名出現兩次無法決定寫入順序，直接拒絕
+    for (int i = 0; i < m->n; i++)
     {
-        if (i % 2 == 0) // 讀取位元 (Read bit)
+        MultiFile *f = &m->files[i];
+        if (f->status == 0)
         {
-            if (perms[i] != 'r' && perms[i] != 'n')
-                return 0;
+            reply(req, ST_ERR_BADREQ, "錯誤: 檔名 %s 重複。", f->name);
+            return 0;
         }
-        else // 寫入位元 (Write bit)
+        if (strcmp(m->mode, "o") == 0 && f->upload && upload_prepare_replace(f->upload) < 0)
         {
-            if (perms[i] != 'w' && perms[i] != 'n')
-                return 0;
+            reply(req, ST_ERR_IO, "錯誤: 寫入失敗 (I/O Error)。");
+            return 0;
         }
     }
+    m->exclusive = 1;
+    m->then = mwrite_locked;
+    multi_lock_next(req);
     return 1;
 }
 
-// 核心權限檢查邏輯
-// 根據使用者身分決定檢查權限字串的哪個部分
-int check_permission(FileEntry *file, char *user, char *group, char mode)
+// stats：回傳 JSON 格式的統計 (各指令延遲、檔案鎖等待、連線數與佇列深度)
+static void cmd_stats(Request *req)
 {
-    int offset = 4; // 預設檢查 "其他人" (Others) 的權限 (索引 4, 5)
+    size_t len;
+    char *text = stats_render(STATS_JSON, &len);
+    reply_data(req, ST_OK, 0, text, len);
+    free(text);
+}
 
-    // strcmp 相等 return 0
-    if (strcmp(file->owner, user) == 0)
-        offset = 0; // 若是擁有者，檢查索引 0, 1
-    else if (strcmp(file->group, group) == 0)
-        offset = 2; // 若同群組，檢查索引 2, 3
+// 工作執行緒：執行單一請求 (可能因模擬延遲而阻塞，所以不在事件迴圈上執行)
+// 需要等待檔案鎖的請求不在此等待：指令回傳 1 表示請求已交出，由取得鎖後的 continuation 結束
+static void execute_request(void *arg)
+{
+    Request *req = (Request *)arg;
+    int async = 0;
 
-    // 根據讀取 (r) 或寫入 (w) 模式，決定檢查該區段的第 1 個或第 2 個字元
-    char p_target = (mode == 'r') ? file->perms[offset] : file->perms[offset + 1];
+    switch (req->opcode)
+    {
+    case OP_NEW:
+        async = cmd_new(req);
+        break;
+    case OP_CHANGE:
+        async = cmd_change(req);
+        break;
+    case OP_READ:
+        async = cmd_read(req);
+        break;
+    case OP_WRITE:
+        async = cmd_write(req);
+        break;
+    case OP_STATS:
+        cmd_stats(req);
+        break;
+    case OP_LIST:
+        cmd_list(req);
+        break;
+    case OP_STAT:
+        cmd_stat(req);
+        break;
+    case OP_MREAD:
+        async = cmd_mread(req);
+        break;
+    case OP_MWRITE:
+        async = cmd_mwrite(req);
+        break;
+    }
 
-    if (mode == 'r' && p_target == 'r')
-        return 1;
-    if (mode == 'w' && p_target == 'w')
-        return 1;
+    if (!async)
+        finish_request(req); // 交回事件迴圈處理下一個請求
+}
+
+// 解析文字協定多檔指令的檔名清單 (以空白分隔)，格式錯誤或超過上限時回傳 NULL
+static Multi *parse_text_names(char *list)
+{
+    int n = 0;
+    for (char *p = list + strspn(list, " \t"); *p; p += strspn(p, " \t"))
+    {
+        size_t len = strcspn(p, " \t");
+        if (len >= sizeof(((MultiFile *)0)->name))
+            return NULL;
+        p += len;
+        n++;
+    }
+    if (n == 0 || n > PROTO_MAX_FILES)
+        return NULL;
+
+    Multi *m = multi_new(n);
+    char *save, *tok = strtok_r(list, " \t", &save);
+    for (int i = 0; tok; i++, tok = strtok_r(NULL, " \t", &save))
+        snprintf(m->files[i].name, sizeof(m->files[i].name), "%s", tok);
+    return m;
+}
+
+// 解析文字協定的指令：Cmd [Arg1] [Arg2]
+static int parse_text_request(Request *req, char *msg)
+{
+    char cmd[10] = "", arg3[50] = "";
+
+    sscanf(msg, "%9s %49s %49s %49s", cmd, req->arg1, req->arg2, arg3);
+    if (strcmp(cmd, "new") == 0)
+        req->opcode = OP_NEW;
+    else if (strcmp(cmd, "read") == 0)
+    {
+        // read [檔名] [offset] [length]
+        req->opcode = OP_READ;
+        req->offset = strtoull(req->arg2, NULL, 10);
+        req->length = strtoull(arg3, NULL, 10);
+    }
+    else if (strcmp(cmd, "write") == 0)
+    {
+        // write [檔名] [模式] [資料...]：模式之後的整行文字為寫入資料
+        // write [檔名] p [offset] [資料...]：原地寫入模式在資料前多一個寫入位置
+        int data_pos = 0;
+        req->opcode = OP_WRITE;
+        if (strcmp(req->arg2, "p") == 0)
+        {
+            req->offset = strtoull(arg3, NULL, 10);
+            sscanf(msg, "%*s %*s %*s %*s %n", &data_pos);
+        }
+        else
+            sscanf(msg, "%*s %*s %*s %n", &data_pos);
+        if (data_pos > 0 && msg[data_pos] != '\0')
+        {
+            req->upload = upload_new(req->arg1);
+            upload_buffer(req->upload, msg + data_pos, strlen(msg + data_pos));
+            upload_buffer(req->upload, "\n", 1);
+        }
+    }
+    else if (strcmp(cmd, "change") == 0)
+        req->opcode = OP_CHANGE;
+    else if (strcmp(cmd, "stats") == 0)
+        req->opcode = OP_STATS;
+    else if (strcmp(cmd, "list") == 0)
+    {
+        // list [前綴 (* 代表全部)] [cursor]
+        req->opcode = OP_LIST;
+        if (strcmp(req->arg1, "*") == 0)
+            req->arg1[0] = '\0';
+    }
+    else if (strcmp(cmd, "stat") == 0)
+        req->opcode = OP_STAT;
+    else if (strcmp(cmd, "mread") == 0 || strcmp(cmd, "mwrite") == 0)
+    {
+        // mread [檔名...]；mwrite [模式] [檔名...] (文字協定不帶資料，每個檔案寫入預設的一行)
+        int names_pos = 0;
+        req->opcode = cmd[1] == 'r' ? OP_MREAD : OP_MWRITE;
+        sscanf(msg, req->opcode == OP_MREAD ? "%*s %n" : "%*s %*s %n", &names_pos);
+        if (names_pos == 0 || (req->multi = parse_text_names(msg + names_pos)) == NULL)
+            return -1;
+        if (req->opcode == OP_MWRITE && strcmp(req->arg1, "o") != 0 && strcmp(req->arg1, "a") != 0)
+            return -1;
+        req->multi->mode[0] = req->arg1[0];
+    }
+    else
+        return -1;
     return 0;
 }
 
-// 執行緒函式：處理單一客戶端的連線
-void *client_handler(void *arg)
+// 解析二進位協定多檔指令的欄位：mread 為檔名清單；mwrite 為模式之後每個檔案一組 [檔名] [資料]
+static int parse_binary_multi(Request *req, const unsigned char *payload, size_t plen)
 {
-    ClientInfo *client = (ClientInfo *)arg;
-    int sock = client->sockfd;
-    char buffer[BUFFER_SIZE];
-    int n;
+    int per_file = req->opcode == OP_MWRITE ? 2 : 1, nfields = 0, max = PROTO_MAX_FILES * per_file;
+    size_t off = 0;
+    char mode[4] = "";
 
-    // --- Stage 1: 接收並驗證登入資訊 ---
-    memset(buffer, 0, BUFFER_SIZE);              // 將 buffer 設為 0
-    if (recv(sock, buffer, BUFFER_SIZE, 0) <= 0) // 從 buffer 讀資料到 sock，回傳值小於或等於 0 = 連線無效
+    if (req->opcode == OP_MWRITE &&
+        (proto_get_string(payload, plen, &off, mode, sizeof(mode)) < 0 || (strcmp(mode, "o") && strcmp(mode, "a"))))
+        return -1;
+
+    // 每個欄位只解析一次，之後只使用記下的位置與長度
+    // (共享記憶體的 frame 在處理完之前仍可能被客戶端改寫，再走訪一次可能得到不同的欄位)
+    struct
     {
-        close(sock);
-        free(client);
-        return NULL;
+        const unsigned char *data;
+        size_t len;
+    } *fields = malloc(max * sizeof(*fields));
+    while (off < plen)
+    {
+        if (nfields == max || proto_get_field(payload, plen, &off, &fields[nfields].data, &fields[nfields].len) < 0)
+        {
+            free(fields);
+            return -1;
+        }
+        nfields++;
+    }
+    if (nfields == 0 || nfields % per_file != 0)
+    {
+        free(fields);
+        return -1;
     }
-    sscanf(buffer, "%s %s", client->user, client->group);
 
-    // 檢查群組名稱是否在允許清單中，只能用 AOS-group、CSE-group
-    if (strcmp(client->group, "AOS-group") != 0 && strcmp(client->group, "CSE-group") != 0)
+    Multi *m = req->multi = multi_new(nfields / per_file);
+    snprintf(m->mode, sizeof(m->mode), "%s", mode);
+    int ret = 0;
+    for (int i = 0; i < m->n; i++)
     {
-        printf("登入失敗: %s 使用了無效群組 %s\n", client->user, client->group);
-        char *error_msg = "Login Failed: Invalid Group. Only 'AOS-group' or 'CSE-group' allowed.";
-        send(sock, error_msg, strlen(error_msg), 0);
+        MultiFile *f = &m->files[i];
+        const unsigned char *data = fields[i * per_file].data;
+        size_t flen = fields[i * per_file].len;
 
-        close(sock);
-        free(client);
-        return NULL;
+        // 先複製再檢查 (不可內含 '\0')，檢查的就是實際使用的檔名
+        if (flen == 0 || flen >= sizeof(f->name))
+        {
+            ret = -1;
+            break;
+        }
+        memcpy(f->name, data, flen);
+        f->name[flen] = '\0';
+        if (strlen(f->name) != flen)
+        {
+            ret = -1;
+            break;
+        }
+        if (per_file == 1)
+            continue;
+        data = fields[i * per_file + 1].data;
+        flen = fields[i * per_file + 1].len;
+        if (flen == 0)
+            continue; // 沒有資料：寫入預設的一行
+        f->upload = upload_new(f->name);
+        upload_buffer(f->upload, (const char *)data, flen); // 在事件迴圈上：只放進記憶體 (最多一個 frame)
+    }
+    free(fields);
+    return ret;
+}
+
+// 解析二進位協定的 frame：標頭帶 opcode，payload 依序為 [檔名] [權限或模式]
+// (read 的第 2、3 個欄位為 u64 的 offset 與 length；原地寫入模式 p 在模式之後多一個 u64 的 offset)
+static int parse_binary_request(Request *req, const unsigned char *frame, size_t len)
+{
+    const unsigned char *payload = frame + PROTO_HEADER_SIZE;
+    size_t plen = len - PROTO_HEADER_SIZE, off = 0;
+    FrameHeader h;
+
+    proto_decode_header(frame, &h);
+    req->opcode = h.opcode;
+    req->req_id = h.req_id;
+    req->flags = h.flags;
+    if (h.opcode == OP_STATS)
+        return 0;
+    if (h.opcode == OP_MREAD || h.opcode == OP_MWRITE)
+        return parse_binary_multi(req, payload, plen);
+    if (h.opcode == OP_LIST)
+    {
+        // 欄位都可以省略：前綴、cursor、每頁筆數
+        if (off < plen && proto_get_string(payload, plen, &off, req->arg1, sizeof(req->arg1)) < 0)
+            return -1;
+        if (off < plen && proto_get_string(payload, plen, &off, req->arg2, sizeof(req->arg2)) < 0)
+            return -1;
+        if (off < plen && proto_get_u64(payload, plen, &off, &req->length) < 0)
+            return -1;
+        return 0;
+    }
+    if (h.opcode != OP_NEW && h.opcode != OP_READ && h.opcode != OP_WRITE && h.opcode != OP_CHANGE &&
+        h.opcode != OP_STAT)
+        return -1;
+    if (proto_get_string(payload, plen, &off, req->arg1, sizeof(req->arg1)) < 0)
+        return -1;
+    if (h.opcode == OP_READ)
+    {
+        if (off < plen && proto_get_u64(payload, plen, &off, &req->offset) < 0)
+            return -1;
+        if (off < plen && proto_get_u64(payload, plen, &off, &req->length) < 0)
+            return -1;
+        return 0;
+    }
+    if (off < plen && proto_get_string(payload, plen, &off, req->arg2, sizeof(req->arg2)) < 0)
+        return -1;
+    if (h.opcode == OP_WRITE && strcmp(req->arg2, "p") == 0 && proto_get_u64(payload, plen, &off, &req->offset) < 0)
+        return -1;
+    if (h.opcode == OP_WRITE && (h.flags & (FLAG_DATA | FLAG_MORE)))
+    {
+        // 欄位之後剩下的 payload 是第一段寫入資料
+        req->upload = upload_new(req->arg1);
+        upload_buffer(req->upload, (const char *)payload + off, plen - off); // 只放進記憶體 (最多一個 frame)
+    }
+    return 0;
+}
+
+// 驗證登入資訊：群組與成員由設定檔決定 (預設只允許 AOS-group、CSE-group)
+static void handle_login(Request *req, const char *user, const char *group)
+{
+    Conn *c = req->conn;
+
+    snprintf(c->user, sizeof(c->user), "%s", user);
+    snprintf(c->group, sizeof(c->group), "%s", group);
+
+    // 檢查群組是否存在且使用者是其成員，成功時取得使用者與群組的 ID
+    if (principal_login(c->user, c->group, &c->who) < 0)
+    {
+        printf("登入失敗: %s 使用了無效群組 %s\n", c->user, c->group);
+        reply(req, ST_ERR_LOGIN, "Login Failed: Invalid Group. Only %s allowed.", principal_group_list());
+        c->closing = 1;
+        return;
     }
 
     // 登入成功，回傳確認訊息
-    printf("客戶端登入成功: 使用者=%s, 群組=%s\n", client->user, client->group);
-    send(sock, "Login OK", 8, 0);
+    printf("客戶端登入成功: 使用者=%s, 群組=%s\n", c->user, c->group);
+    reply(req, ST_OK, "Login OK");
+    c->state = CONN_READY;
+}
+
+// 把解析完成的請求交給工作執行緒
+static void dispatch_request(Request *req)
+{
+    Conn *c = req->conn;
 
-    // --- Stage 2: 指令處理迴圈 ---
-    while (1)
+    if (pool_submit(execute_request, req) < 0)
     {
-        memset(buffer, 0, BUFFER_SIZE); // 將 buffer 設為 0
-        n = recv(sock, buffer, BUFFER_SIZE, 0);
-        if (n <= 0) // 連線無效 or 客戶端斷線
-            break;
+        // 過載：工作佇列已滿，直接拒絕而不是讓排隊時間無限增長
+        reply(req, ST_ERR_BUSY, "伺服器忙碌中，請稍後再試。");
+        request_free(req);
+        return;
+    }
+    conn_begin_request(c); // 達到同時處理上限時暫停解析這條連線的下一個訊息
+}
+
+// 複本只服務讀取：寫入轉告主伺服器的位址，資料落後太久時拒絕讀取 (統計不受影響)
+// 可以執行時回傳 0，否則回覆錯誤並回傳 -1
+static int check_role(Request *req)
+{
+    char primary[128];
+    uint64_t lag_ms;
+
+    if (replica_role() != ROLE_REPLICA || req->opcode == OP_STATS)
+        return 0;
+    int write = req->opcode == OP_NEW || req->opcode == OP_WRITE || req->opcode == OP_CHANGE ||
+                req->opcode == OP_MWRITE;
+    if (!write && replica_fresh(&lag_ms))
+        return 0;
 
-        char cmd[10], arg1[50], arg2[50];
-        memset(cmd, 0, sizeof(cmd));
-        memset(arg1, 0, sizeof(arg1)); // new, read, write, change
-        memset(arg2, 0, sizeof(arg2)); // 權限
+    // 二進位協定的 payload 只有位址，客戶端可以直接改連
+    replica_primary_addr(primary, sizeof(primary));
+    if (req->binary)
+        reply(req, write ? ST_ERR_REDIRECT : ST_ERR_STALE, "%s", primary);
+    else if (write)
+        reply(req, ST_ERR_REDIRECT, "錯誤: 這是唯讀的複本，寫入請改送到主伺服器 %s。", primary);
+    else
+        reply(req, ST_ERR_STALE, "錯誤: 複本的資料落後主伺服器太久，請改向主伺服器 %s 讀取。", primary);
+    return -1;
+}
 
-        // 解析指令：Cmd [Arg1] [Arg2]
-        sscanf(buffer, "%s %s %s", cmd, arg1, arg2);
-        char response[BUFFER_SIZE];
-        memset(response, 0, BUFFER_SIZE); // 將 response 設為 0
+// 分段上傳的第一個 frame：先在事件迴圈上檢查檔案與權限，避免暫存注定被拒絕的資料
+static void begin_upload(Request *req)
+{
+    Conn *c = req->conn;
+    int count = 0;
 
-        // 指令：建立新檔案 (new)
-        if (strcmp(cmd, "new") == 0)
+    for (PendingWrite *pw = c->pending_writes; pw; pw = pw->next, count++)
+    {
+        if (pw->req->req_id == req->req_id)
         {
-            // 先檢查權限格式
-            if (!check_perm_format(arg2))
-            {
-                sprintf(response, "錯誤: 權限格式錯誤 (必須是6碼，例如 rwrnnn)");
-            }
-            else
-            {
-                // 修改全域檔案清單，必須上 Mutex 鎖
-                pthread_mutex_lock(&list_mutex);
-                int idx = -1;
-                // 在 file_list 中尋找空閒的檔案位置
-                for (int i = 0; i < MAX_FILES; i++)
-                    if (!file_list[i].is_used)
-                    {
-                        idx = i;
-                        break;
-                    }
-
-                if (idx != -1)
-                {
-                    // 複製變數到 file_list 之 key 所對應的 value
-                    strcpy(file_list[idx].name, arg1);
-                    strcpy(file_list[idx].perms, arg2);
-                    strcpy(file_list[idx].owner, client->user);
-                    strcpy(file_list[idx].group, client->group);
-                    file_list[idx].is_used = 1;
-
-                    // 實際在磁碟建立檔案
-                    FILE *fp = fopen(arg1, "w");
-                    if (fp)
-                    {
-                        fprintf(fp, "Init file: %s\n", arg1);
-                        fclose(fp);
-                    }
-
-                    sprintf(response, "檔案 %s 建立成功。", arg1);
-                    print_capability_lists();
-                }
-                else
-                {
-                    sprintf(response, "錯誤: 伺服器空間已滿。");
-                }
-                pthread_mutex_unlock(&list_mutex); // 釋放 Mutex 鎖
-            }
+            reply(req, ST_ERR_BADREQ, "無效指令。");
+            request_free(req);
+            return;
         }
-        // 指令：變更權限 (change)
-        else if (strcmp(cmd, "change") == 0)
+    }
+    if (count >= PROTO_MAX_INFLIGHT)
+    {
+        reply(req, ST_ERR_BUSY, "伺服器忙碌中，請稍後再試。");
+        request_free(req);
+        return;
+    }
+
+    FileEntry *file = catalog_find(req->arg1);
+    if (!file)
+    {
+        reply(req, ST_ERR_NOTFOUND, "錯誤: 找不到檔案。");
+        request_free(req);
+        return;
+    }
+    if (!check_permission(file, c, PERM_WRITE))
+    {
+        reply(req, ST_ERR_PERM, "權限不足: 無法寫入。");
+        request_free(req);
+        return;
+    }
+
+    PendingWrite *pw = calloc(1, sizeof(PendingWrite));
+    pw->req = req;
+    pw->next = c->pending_writes;
+    c->pending_writes = pw;
+}
+
+// 記憶體中的上傳資料超過上限：在工作執行緒寫進暫存檔，完成後才繼續解析這條連線
+static void spill_task(void *arg)
+{
+    PendingWrite *pw = arg;
+    Conn *c = pw->req->conn;
+
+    if (upload_spill(pw->req->upload) < 0)
+        pw->failed = 1;
+    conn_end_request(c);
+}
+
+// 分段上傳的後續資料：附加到對應的 write 請求，最後一段 (沒有 FLAG_MORE) 收到後才交給工作執行緒
+// 事件迴圈只把資料放進記憶體；超過上限時暫停這條連線，由工作執行緒寫進暫存檔 (socket 緩衝區滿後對方就會停下)
+static void on_write_data(Conn *c, const unsigned char *frame, size_t len)
+{
+    PendingWrite **pp, *pw;
+    FrameHeader h;
+
+    proto_decode_header(frame, &h);
+    for (pp = &c->pending_writes; *pp && (*pp)->req->req_id != h.req_id; pp = &(*pp)->next)
+        ;
+    if ((pw = *pp) == NULL)
+        return; // 請求已被拒絕 (或不存在)，丟棄資料
+
+    Request *req = pw->req;
+    int failed = pw->failed;
+    if (!failed && upload_buffer(req->upload, (const char *)frame + PROTO_HEADER_SIZE, len - PROTO_HEADER_SIZE) &&
+        (h.flags & FLAG_MORE))
+    {
+        conn_pause(c);
+        pool_continue(&pw->task, spill_task, pw);
+        return;
+    }
+    if (!failed && (h.flags & FLAG_MORE))
+        return; // 還有後續資料
+
+    *pp = pw->next;
+    free(pw);
+    if (failed)
+    {
+        reply(req, ST_ERR_IO, "錯誤: 寫入失敗 (I/O Error)。");
+        request_free(req);
+        return;
+    }
+    dispatch_request(req);
+}
+
+// 事件迴圈收到完整訊息時呼叫：登入在此直接處理，其他指令交給工作執行緒
+static void on_message(Conn *c, char *msg, size_t len)
+{
+    Request *req = calloc(1, sizeof(Request));
+    req->conn = c;
+    req->binary = c->binary;
+
+    // --- Stage 1: 接收並驗證登入資訊 ---
+    if (c->state == CONN_LOGIN)
+    {
+        char user[50] = "", group[50] = "";
+        if (c->binary)
         {
-            // 檢查權限
-            if (!check_perm_format(arg2))
-            {
-                sprintf(response, "錯誤: 權限格式錯誤 (必須是6碼，例如 rwrnnn)");
-            }
-            else
-            {
-                int found = 0;
-                for (int i = 0; i < MAX_FILES; i++)
-                {
-                    if (file_list[i].is_used && strcmp(file_list[i].name, arg1) == 0)
-                    {
-                        // 只有擁有者可以變更權限
-                        if (strcmp(file_list[i].owner, client->user) == 0)
-                        {
-                            // 變更權限
-                            strcpy(file_list[i].perms, arg2);
-                            sprintf(response, "檔案 %s 權限已變更。", arg1);
-                            print_capability_lists();
-                        }
-                        else
-                        {
-                            sprintf(response, "錯誤: 你不是擁有者，無法變更權限。");
-                        }
-                        found = 1;
-                        break;
-                    }
-                }
-                if (!found)
-                    sprintf(response, "錯誤: 找不到檔案。");
-            }
+            const unsigned char *payload = (unsigned char *)msg + PROTO_HEADER_SIZE;
+            size_t plen = len - PROTO_HEADER_SIZE, off = 0;
+            FrameHeader h;
+            proto_decode_header((unsigned char *)msg, &h);
+            req->opcode = OP_LOGIN;
+            req->req_id = h.req_id;
+            if (h.opcode != OP_LOGIN ||
+                proto_get_string(payload, plen, &off, user, sizeof(user)) < 0 ||
+                proto_get_string(payload, plen, &off, group, sizeof(group)) < 0)
+                user[0] = group[0] = '\0';
         }
-        // 指令：讀取檔案 (read)
-        else if (strcmp(cmd, "read") == 0)
-        {
-            int idx = -1; // 檔案在 file_list 中的 index 位置
-            for (int i = 0; i < MAX_FILES; i++)
-            {
-                if (file_list[i].is_used && strcmp(file_list[i].name, arg1) == 0)
-                {
-                    idx = i;
-                    break;
-                }
-            }
+        else
+            sscanf(msg, "%49s %49s", user, group);
+        handle_login(req, user, group);
+        free(req);
+        return;
+    }
 
-            if (idx != -1)
-            {
-                // 檢查是否有讀取權限
-                if (check_permission(&file_list[idx], client->user, client->group, 'r'))
-                {
-                    // 嘗試取得讀鎖，如果有人正在寫入則會等待
-                    int lock_result = pthread_rwlock_tryrdlock(&file_list[idx].lock);
-                    if (lock_result != 0)
-                    {
-                        // 無法立即取得讀鎖，表示有人正在寫入
-                        sprintf(response, "該檔案正在被寫入");
-                        send(sock, response, strlen(response), 0);
-                        
-                        // 等待寫入完成
-                        pthread_rwlock_rdlock(&file_list[idx].lock);
-                        
-                        // 寫入完成後通知客戶端
-                        memset(response, 0, BUFFER_SIZE);
-                        sprintf(response, "寫入完成");
-                        send(sock, response, strlen(response), 0);
-                    }
-
-                    printf("[Read] %s 正在讀取... (模擬延遲耗時 5 秒)\n", client->user);
-                    sleep(5); // 模擬讀取耗時 5 秒，可以用來測試併發讀取
-
-                    FILE *fp = fopen(arg1, "r");
-                    if (fp)
-                    {
-                        char content[500];
-                        fgets(content, 500, fp);
-                        sprintf(response, "讀取內容: %s ...and more", content);
-                        fclose(fp);
-                    }
-                    else
-                    {
-                        sprintf(response, "錯誤: 讀取失敗 (I/O Error)。");
-                    }
-                    // 釋放鎖
-                    pthread_rwlock_unlock(&file_list[idx].lock);
-                }
-                else
-                {
-                    sprintf(response, "權限不足: 無法讀取。");
-                }
-            }
-            else
-            {
-                sprintf(response, "錯誤: 找不到檔案。");
-            }
-        }
-        // 指令：寫入檔案 (write)
-        else if (strcmp(cmd, "write") == 0)
-        {
-            int idx = -1; // 檔案在 file_list 中的 index 位置
-            for (int i = 0; i < MAX_FILES; i++)
-            {
-                if (file_list[i].is_used && strcmp(file_list[i].name, arg1) == 0)
-                {
-                    idx = i;
-                    break;
-                }
-            }
+    // --- Stage 2: 指令處理 ---
+    if (c->binary && (unsigned char)msg[2] == OP_WRITE_DATA)
+    {
+        free(req);
+        on_write_data(c, (unsigned char *)msg, len);
+        return;
+    }
 
-            if (idx != -1)
-            {
-                // 檢查是否有寫入權限
-                if (check_permission(&file_list[idx], client->user, client->group, 'w'))
-                {
-                    // 嘗試取得寫鎖，如果有人正在讀取或寫入則會等待
-                    int lock_result = pthread_rwlock_trywrlock(&file_list[idx].lock);
-                    if (lock_result != 0)
-                    {
-                        // 無法立即取得寫鎖，表示有人正在讀取
-                        sprintf(response, "該檔案正在被讀取");
-                        send(sock, response, strlen(response), 0);
-                        
-                        // 等待讀取完成
-                        pthread_rwlock_wrlock(&file_list[idx].lock);
-                        
-                        // 讀取完成後通知客戶端
-                        memset(response, 0, BUFFER_SIZE);
-                        sprintf(response, "讀取完成");
-                        send(sock, response, strlen(response), 0);
-                    }
-
-                    printf("[Write] %s 正在寫入... (模擬延遲耗時 10 秒)\n", client->user);
-                    sleep(10); // 模擬寫入耗時 10 秒，可以用來測試鎖定機制
-
-                    FILE *fp;
-                    // 判斷是覆蓋 (o) 還是附加 (a) 模式
-                    if (strcmp(arg2, "o") == 0)
-                        fp = fopen(arg1, "w");
-                    else
-                        fp = fopen(arg1, "a");
-
-                    if (fp)
-                    {
-                        // 寫入的資訊格式: xxx wrote here at xx/xx/xx-xx:xx:xx.
-                        time_t now = time(NULL);
-                        struct tm *t = localtime(&now);
-                        char time_str[64];
-                        strftime(time_str, sizeof(time_str), "%Y/%m/%d-%H:%M:%S", t);
-
-                        fprintf(fp, "%s wrote here at %s.\n", client->user, time_str);
-                        fclose(fp);
-                        sprintf(response, "寫入成功 (時間: %s)。", time_str);
-                    }
-                    else
-                    {
-                        sprintf(response, "錯誤: 寫入失敗 (I/O Error)。");
-                    }
-                    // 釋放鎖
-                    pthread_rwlock_unlock(&file_list[idx].lock);
-                }
-                else
-                {
-                    sprintf(response, "權限不足: 無法寫入。");
-                }
-            }
-            else
-            {
-                sprintf(response, "錯誤: 找不到檔案。");
-            }
-        }
+    int bad = c->binary ? parse_binary_request(req, (unsigned char *)msg, len)
+                        : parse_text_request(req, msg);
+    if (bad)
+    {
         // exception
-        else
-        {
-            sprintf(response, "無效指令。");
-        }
-        // 將執行結果回傳給客戶端
-        send(sock, response, strlen(response), 0);
+        reply(req, ST_ERR_BADREQ, "無效指令。");
+        request_free(req);
+        return;
+    }
+
+    if (check_role(req) < 0)
+    {
+        request_free(req);
+        return;
+    }
+
+    req->start_us = stats_now_us();
+    if (req->opcode == OP_WRITE && (req->flags & FLAG_MORE))
+        begin_upload(req);
+    else
+        dispatch_request(req);
+}
+
+// 連線關閉時釋放尚未收齊資料的 write 請求
+static void on_close(Conn *c)
+{
+    while (c->pending_writes)
+    {
+        PendingWrite *pw = c->pending_writes;
+        c->pending_writes = pw->next;
+        request_free(pw->req);
+        free(pw);
     }
-    // 清理資源
-    close(sock);
-    free(client);
-    return NULL;
 }
 
-int main()
+static void usage(const char *prog)
 {
-    int server_fd, new_socket;
-    struct sockaddr_in address;
-    int addrlen = sizeof(address);
+    fprintf(stderr, "用法: %s [-p port] [-l 事件迴圈數] [-t 工作執行緒數] [-q 最大排隊工作數] [-f 快取 fd 數]\n"
+                    "          [-M 內容快取 MB (0: 停用)] [-D none|batch|interval 持久化策略] [-i 同步間隔 ms]\n"
+                    "          [-g 群組設定檔] [-r snapshot|locked 讀取模式] [-L fifo|read|write 檔案鎖公平性]\n"
+                    "          [-S 統計輸出間隔 (秒)] [-O 統計檔案] [-F json|prom 統計格式]\n"
+                    "          [-C 持久目錄路徑 (none: 不保存)] [-b listen backlog] [-P 不綁定 CPU]\n"
+                    "          [-U 使用 io_uring] [-u unix socket 路徑 (none: 不監聽)]\n"
+                    "          [-R 複寫 port (作為主伺服器)] [-A 主伺服器 host:port (作為唯讀複本)] [-X 複本容許落後 ms]\n", prog);
+    exit(1);
+}
 
-    // 初始化檔案清單：重置使用狀態並初始化讀寫鎖
-    init_files();
+int main(int argc, char *argv[])
+{
+    int port = PORT;
+    int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nloops = ncpu; // 預設每個 CPU 一個事件迴圈
+    int nworkers = ncpu * POOL_THREADS_PER_CORE;
+    int max_queued = POOL_DEFAULT_QUEUE;
+    int fd_capacity = FDCACHE_DEFAULT_CAPACITY;
+    long content_mb = CONTENT_DEFAULT_CAPACITY >> 20;
+    int durability = DURABILITY_NONE;
+    int sync_interval = COMMIT_DEFAULT_INTERVAL_MS;
+    const char *group_config = PRINCIPAL_DEFAULT_CONFIG;
+    int lock_policy = LOCK_FIFO;
+    int stats_interval = 0; // 0: 不定期輸出統計
+    const char *stats_path = NULL;
+    int stats_format = STATS_JSON;
+    const char *store_path = STORE_DEFAULT_PATH;
+    const char *unix_path = PROTO_UNIX_PATH;
+    int backlog = REACTOR_DEFAULT_BACKLOG;
+    int pin_cpus = 1;
+    int use_uring = 0;
+    int repl_port = 0;                 // -R：接受複本連線的 port
+    char *primary = NULL;              // -A：主伺服器的複寫位址
+    int max_lag_ms = REPL_DEFAULT_MAX_LAG_MS;
+    int ch;
 
-    // 建立 Socket
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0)
+    while ((ch = getopt(argc, argv, "p:l:t:q:f:M:D:i:g:r:L:S:O:F:C:b:PUu:R:A:X:")) != -1)
     {
-        perror("Socket failed");
-        exit(1);
+        switch (ch)
+        {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'l':
+            nloops = atoi(optarg);
+            break;
+        case 't':
+            nworkers = atoi(optarg);
+            break;
+        case 'q':
+            max_queued = atoi(optarg);
+            break;
+        case 'f':
+            fd_capacity = atoi(optarg);
+            break;
+        case 'M':
+            content_mb = atol(optarg);
+            break;
+        case 'D':
+            if ((durability = commit_parse_policy(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'i':
+            sync_interval = atoi(optarg);
+            break;
+        case 'g':
+            group_config = optarg;
+            break;
+        case 'r':
+            if (strcmp(optarg, "locked") == 0)
+                locked_reads = 1;
+            else if (strcmp(optarg, "snapshot") != 0)
+                usage(argv[0]);
+            break;
+        case 'L':
+            if ((lock_policy = filelock_parse_policy(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'S':
+            stats_interval = atoi(optarg);
+            break;
+        case 'O':
+            stats_path = optarg;
+            break;
+        case 'F':
+            if ((stats_format = stats_parse_format(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'C':
+            store_path = strcmp(optarg, "none") == 0 ? NULL : optarg;
+            break;
+        case 'b':
+            backlog = atoi(optarg);
+            break;
+        case 'P':
+            pin_cpus = 0;
+            break;
+        case 'U':
+            use_uring = 1;
+            break;
+        case 'u':
+            unix_path = strcmp(optarg, "none") == 0 ? NULL : optarg;
+            break;
+        case 'R':
+            repl_port = atoi(optarg);
+            break;
+        case 'A':
+            primary = optarg;
+            break;
+        case 'X':
+            max_lag_ms = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
     }
+    if (nloops < 1)
+        nloops = 1;
+    if (nworkers < 1)
+        nworkers = 1;
+    if (max_queued < 1)
+        max_queued = 1;
+    if (backlog < 1)
+        backlog = REACTOR_DEFAULT_BACKLOG;
+
+    // 主伺服器與複本二選一；複本的位址為 host:port (以最後一個 ':' 分開)
+    char *colon = primary ? strrchr(primary, ':') : NULL;
+    if ((repl_port > 0 && primary) || (primary && !colon))
+        usage(argv[0]);
+    if (colon)
+        *colon = '\0';
 
-    // 設定 Socket 選項，允許重用位址 (避免伺服器重啟時 Port 被佔用)
-    int opt = 1;
-    setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    // 大量連線需要大量 file descriptor：把上限調到系統允許的最大值
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    // 對方斷線時 send 不應讓整個伺服器收到 SIGPIPE 而結束
+    signal(SIGPIPE, SIG_IGN);
 
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY; // 監聽所有網卡介面
-    address.sin_port = htons(PORT);
+    // io_uring 需要的操作核心不支援 (或被 seccomp 等限制) 時沿用一般的系統呼叫
+    if (use_uring && !uring_enable())
+        fprintf(stderr, "io_uring 無法使用，改用一般的系統呼叫\n");
 
-    // 綁定 Port
-    if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0)
+    // 載入群組設定
+    if (principal_load_groups(group_config) < 0)
     {
-        perror("Bind failed");
+        fprintf(stderr, "無法載入群組設定檔 %s\n", group_config);
         exit(1);
     }
-    // 開始監聽，最大等待佇列為 5
-    if (listen(server_fd, 5) < 0)
+
+    // 初始化檔案目錄 (雜湊索引與持久目錄)、fd 快取與附加寫入的 group commit
+    // 持久目錄的 WAL 在 none 以外的持久化策略下都會在回覆前落地
+    if (catalog_init(store_path, durability != DURABILITY_NONE) < 0)
     {
-        perror("Listen failed");
+        perror("無法開啟持久目錄");
         exit(1);
     }
+    fdcache_init(fd_capacity);
+    content_init(content_mb > 0 ? (size_t)content_mb << 20 : 0);
+    commit_init(durability, sync_interval, WRITE_DELAY_SEC);
+    filelock_set_policy(lock_policy);
+
+    // 統計：-S 指定間隔時由背景執行緒定期寫到檔案 (預設 stats.json 或 stats.prom)
+    stats_init();
+    if (stats_interval > 0)
+    {
+        if (!stats_path)
+            stats_path = stats_format == STATS_PROMETHEUS ? "stats.prom" : "stats.json";
+        stats_start_dump(stats_path, stats_interval, stats_format);
+    }
 
-    printf("伺服器啟動 (Port %d)...\n", PORT);
+    printf("伺服器啟動 (Port %d, %d 個事件迴圈, %d 個工作執行緒)...\n", port, nloops, nworkers);
+    if (unix_path)
+        printf("本機客戶端可連線至 unix socket %s\n", unix_path);
 
-    // 主迴圈：等待連線並產生 Thread
-    while (1)
+    // 主迴圈：每個事件迴圈各自監聽並接受連線，驅動每條連線的狀態機
+    pool_init(nworkers, max_queued);
+
+    // 複寫：主伺服器在 -R 的 port 等待複本連線；複本在背景套用主伺服器的變更 (取得鎖需要工作執行緒)
+    if (repl_port > 0)
     {
-        ClientInfo *new_client = malloc(sizeof(ClientInfo));
-        if ((new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t *)&addrlen)) < 0)
+        if (replica_start_primary(repl_port, port) < 0)
         {
-            perror("Accept failed");
-            free(new_client);
-            continue;
+            perror("無法監聽複寫 port");
+            exit(1);
         }
-        new_client->sockfd = new_socket;
-
-        // 建立執行緒處理新的客戶端
-        pthread_t tid;
-        pthread_create(&tid, NULL, client_handler, (void *)new_client);
-        pthread_detach(tid); // 分離執行緒，結束時自動回收資源
+        printf("主伺服器：複本可連線至 port %d\n", repl_port);
+    }
+    else if (primary)
+    {
+        replica_start_follower(primary, atoi(colon + 1), max_lag_ms);
+        printf("唯讀複本：跟隨主伺服器 %s:%s (容許落後 %d ms)\n", primary, colon + 1, max_lag_ms);
     }
+    reactor_run(port, unix_path, backlog, nloops, pin_cpus, on_message, on_close);
     return 0;
-}
\ No newline at end of file
+}
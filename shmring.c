@@ -0,0 +1,216 @@
+/*
+ * shmring.c - 同一台機器上的共享記憶體傳輸
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "shmring.h"
+#include "protocol.h"
+
+#define SHM_MASK (SHM_RING_SIZE - 1)
+
+static void ring_bell(int fd)
+{
+    uint64_t one = 1;
+    // 計數器滿 (EAGAIN) 代表對方本來就會醒來
+    if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        perror("eventfd write");
+}
+
+// 保留 2 倍大小的位址空間，再把 memfd 的同一段固定映射到前後兩半
+static int map_ring(ShmRing *r, ShmRingHeader *hdr, int fd, off_t offset)
+{
+    char *addr = mmap(NULL, 2 * (size_t)SHM_RING_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (addr == MAP_FAILED)
+        return -1;
+    if (mmap(addr, SHM_RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, offset) == MAP_FAILED ||
+        mmap(addr + SHM_RING_SIZE, SHM_RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, offset) ==
+            MAP_FAILED)
+    {
+        munmap(addr, 2 * (size_t)SHM_RING_SIZE);
+        return -1;
+    }
+    r->hdr = hdr;
+    r->data = addr;
+    return 0;
+}
+
+// 映射 memfd：伺服器讀請求 ring、寫回應 ring，客戶端相反
+static int map_channel(ShmChannel *ch, int fd, int server)
+{
+    ShmRing req, resp;
+
+    ch->base = mmap(NULL, SHM_HEADER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ch->base == MAP_FAILED)
+        return -1;
+    ShmRingHeader *hdrs = ch->base;
+    if (map_ring(&req, &hdrs[0], fd, SHM_HEADER_SIZE) < 0)
+    {
+        munmap(ch->base, SHM_HEADER_SIZE);
+        return -1;
+    }
+    if (map_ring(&resp, &hdrs[1], fd, SHM_HEADER_SIZE + SHM_RING_SIZE) < 0)
+    {
+        munmap(req.data, 2 * (size_t)SHM_RING_SIZE);
+        munmap(ch->base, SHM_HEADER_SIZE);
+        return -1;
+    }
+    ch->in = server ? req : resp;
+    ch->out = server ? resp : req;
+    return 0;
+}
+
+int shm_connect(int sock, ShmChannel *ch)
+{
+    int fds[3] = {-1, -1, -1}; // memfd, 伺服器的門鈴, 客戶端的門鈴
+
+    fds[0] = memfd_create("fileserver-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    // 封住大小：伺服器只接受無法再縮小的 memfd，否則客戶端截短檔案就能讓伺服器存取時收到 SIGBUS
+    if (fds[0] < 0 || fds[1] < 0 || fds[2] < 0 || ftruncate(fds[0], SHM_TOTAL_SIZE) < 0 ||
+        fcntl(fds[0], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0 || map_channel(ch, fds[0], 0) < 0)
+        goto fail;
+    ch->bell = fds[2];
+    ch->peer_bell = fds[1];
+
+    // 交握：1 byte 的 PROTO_SHM_MAGIC，隨附三個 fd
+    unsigned char magic = PROTO_SHM_MAGIC;
+    struct iovec iov = {&magic, 1};
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr mh;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = control.buf;
+    mh.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+    if (sendmsg(sock, &mh, MSG_NOSIGNAL) != 1)
+    {
+        shm_close(ch); // 關閉映射與兩個門鈴，memfd 由這裡關閉
+        close(fds[0]);
+        return -1;
+    }
+    close(fds[0]); // 映射持有 memfd 的參照
+    return 0;
+
+fail:
+    for (int i = 0; i < 3; i++)
+        if (fds[i] >= 0)
+            close(fds[i]);
+    return -1;
+}
+
+int shm_attach(ShmChannel *ch, int memfd, int bell, int peer_bell)
+{
+    struct stat st;
+    int seals = fcntl(memfd, F_GET_SEALS);
+
+    if (fstat(memfd, &st) < 0 || (size_t)st.st_size != SHM_TOTAL_SIZE || seals < 0 || !(seals & F_SEAL_SHRINK))
+        return -1;
+    if (map_channel(ch, memfd, 1) < 0)
+        return -1;
+    // 門鈴一律非阻塞：即使客戶端傳來的不是 eventfd，事件迴圈也不會卡在讀寫上
+    fcntl(bell, F_SETFL, fcntl(bell, F_GETFL) | O_NONBLOCK);
+    fcntl(peer_bell, F_SETFL, fcntl(peer_bell, F_GETFL) | O_NONBLOCK);
+    close(memfd);
+    ch->bell = bell;
+    ch->peer_bell = peer_bell;
+    return 0;
+}
+
+void shm_close(ShmChannel *ch)
+{
+    munmap(ch->in.data, 2 * (size_t)SHM_RING_SIZE);
+    munmap(ch->out.data, 2 * (size_t)SHM_RING_SIZE);
+    munmap(ch->base, SHM_HEADER_SIZE);
+    close(ch->bell);
+    close(ch->peer_bell);
+}
+
+ssize_t shm_readable(ShmChannel *ch, const char **data)
+{
+    uint64_t head = atomic_load_explicit(&ch->in.hdr->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ch->in.hdr->tail, memory_order_acquire);
+
+    if (tail - head > SHM_RING_SIZE)
+        return -1;
+    *data = ch->in.data + (head & SHM_MASK);
+    return tail - head;
+}
+
+void shm_consume(ShmChannel *ch, size_t n)
+{
+    uint64_t head = atomic_load_explicit(&ch->in.hdr->head, memory_order_relaxed);
+
+    // 先移動 head 再檢查 blocked (與 shm_wait_space 的「先設定 blocked 再檢查空間」配對，不會兩邊都錯過)
+    atomic_store(&ch->in.hdr->head, head + n);
+    if (atomic_load(&ch->in.hdr->blocked))
+    {
+        atomic_store(&ch->in.hdr->blocked, 0);
+        ring_bell(ch->peer_bell);
+    }
+}
+
+ssize_t shm_writable(ShmChannel *ch, char **data)
+{
+    uint64_t head = atomic_load_explicit(&ch->out.hdr->head, memory_order_acquire);
+    uint64_t tail = atomic_load_explicit(&ch->out.hdr->tail, memory_order_relaxed);
+
+    if (tail - head > SHM_RING_SIZE)
+        return -1;
+    *data = ch->out.data + (tail & SHM_MASK);
+    return SHM_RING_SIZE - (tail - head);
+}
+
+void shm_produce(ShmChannel *ch, size_t n)
+{
+    uint64_t tail = atomic_load_explicit(&ch->out.hdr->tail, memory_order_relaxed);
+
+    atomic_store(&ch->out.hdr->tail, tail + n);
+    if (atomic_load(&ch->out.hdr->waiting))
+    {
+        atomic_store(&ch->out.hdr->waiting, 0);
+        ring_bell(ch->peer_bell);
+    }
+}
+
+int shm_idle(ShmChannel *ch)
+{
+    const char *data;
+
+    atomic_store(&ch->in.hdr->waiting, 1);
+    if (shm_readable(ch, &data) == 0)
+        return 0;
+    atomic_store(&ch->in.hdr->waiting, 0);
+    return 1;
+}
+
+int shm_wait_space(ShmChannel *ch)
+{
+    char *data;
+
+    atomic_store(&ch->out.hdr->blocked, 1);
+    if (shm_writable(ch, &data) == 0)
+        return 0;
+    atomic_store(&ch->out.hdr->blocked, 0);
+    return 1;
+}
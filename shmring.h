@@ -0,0 +1,73 @@
+/*
+ * shmring.h - 同一台機器上的共享記憶體傳輸 (server 與 client 共用)
+ * 功能：客戶端建立一塊 memfd 與兩個 eventfd (門鈴)，透過 unix socket 以 SCM_RIGHTS 交給伺服器。
+ *       memfd 內有兩個單一生產者/單一消費者的 byte ring：請求 (客戶端 -> 伺服器) 與回應 (伺服器 -> 客戶端)，
+ *       內容與 socket 上的 frame 串流完全相同，只是不經過核心複製。
+ *       每個 ring 的資料區連續映射兩次，跨過結尾的 frame 在記憶體中仍然連續，可以直接原地解析。
+ *       只有對方表明要睡眠 (waiting) 或在等空間 (blocked) 時才敲門鈴，持續有流量時不需要任何系統呼叫。
+ */
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#define SHM_RING_SIZE (1 << 20)   // 每個方向的 ring 大小 (2 的次方且為頁面大小的倍數，需大於最大的 frame)
+#define SHM_HEADER_SIZE (1 << 16) // memfd 開頭放兩個 ring 標頭的區域 (涵蓋常見的頁面大小)
+#define SHM_TOTAL_SIZE (SHM_HEADER_SIZE + 2 * (size_t)SHM_RING_SIZE)
+
+// 放在共享記憶體中的 ring 標頭：head/tail 為累計的 bytes 數，兩者分開在不同的 cache line
+typedef struct ShmRingHeader
+{
+    _Alignas(64) atomic_uint_least64_t head; // 消費者已讀到的位置
+    atomic_int blocked;                      // 1: 生產者在等空間，消費者讀取後要敲門鈴
+    _Alignas(64) atomic_uint_least64_t tail; // 生產者已寫到的位置
+    atomic_int waiting;                      // 1: 消費者準備睡眠，生產者寫入後要敲門鈴
+} ShmRingHeader;
+
+typedef struct ShmRing
+{
+    ShmRingHeader *hdr;
+    char *data; // 2 * SHM_RING_SIZE 的連續位址，後半與前半映射到同一塊記憶體
+} ShmRing;
+
+// 一端的通道：in 是自己讀的 ring，out 是自己寫的 ring
+typedef struct ShmChannel
+{
+    void *base;    // memfd 標頭區的映射
+    ShmRing in, out;
+    int bell;      // 自己等待的門鈴 (對方寫入資料或讓出空間後敲)
+    int peer_bell; // 對方的門鈴
+} ShmChannel;
+
+// 客戶端：在已連線的 unix socket 上建立通道並送出交握，失敗回傳 -1
+int shm_connect(int sock, ShmChannel *ch);
+
+// 伺服器端：以收到的 memfd 與兩個門鈴建立通道 (fd 交由通道管理)，memfd 不符規格時回傳 -1 (呼叫者關閉 fd)
+int shm_attach(ShmChannel *ch, int memfd, int bell, int peer_bell);
+
+// 解除映射並關閉門鈴
+void shm_close(ShmChannel *ch);
+
+// 可讀的資料 (*data 指向 ring 內部，連續 n bytes)；索引不合理 (對方破壞了標頭) 時回傳 -1
+ssize_t shm_readable(ShmChannel *ch, const char **data);
+
+// 讀完 n bytes：讓出空間，對方在等空間時敲門鈴
+void shm_consume(ShmChannel *ch, size_t n);
+
+// 可寫入的空間 (*data 指向 ring 內部，連續 n bytes)；索引不合理時回傳 -1
+ssize_t shm_writable(ShmChannel *ch, char **data);
+
+// 寫完 n bytes：公開資料，對方準備睡眠時敲門鈴
+void shm_produce(ShmChannel *ch, size_t n);
+
+// 讀乾淨後呼叫：表明要等門鈴，回傳 1 表示期間又有資料 (不必等待)
+int shm_idle(ShmChannel *ch);
+
+// 寫滿時呼叫：表明在等空間，回傳 1 表示期間已經有空間
+int shm_wait_space(ShmChannel *ch);
+
+#endif
@@ -0,0 +1,417 @@
+/*
+ * stats.c - 伺服器統計 (指令延遲、檔案鎖等待、佇列深度)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "stats.h"
+#include "catalog.h"
+#include "pool.h"
+#include "reactor.h"
+#include "content.h"
+#include "replica.h"
+
+// 單一項目的計數 (每個執行緒一份，只有該執行緒寫入；讀取者以 relaxed 讀取，數值可能差幾筆但不會撕裂)
+typedef struct
+{
+    atomic_uint_least64_t count;
+    atomic_uint_least64_t errors;
+    atomic_uint_least64_t sum_us;
+    atomic_uint_least64_t max_us;
+    atomic_uint_least64_t buckets[STATS_BUCKETS];
+} Counter;
+
+typedef struct StatsShard
+{
+    struct StatsShard *next;
+    Counter kinds[STAT_KINDS];
+} StatsShard;
+
+// 加總後的結果
+typedef struct
+{
+    uint64_t count, errors, sum_us, max_us;
+    uint64_t buckets[STATS_BUCKETS];
+} Totals;
+
+// 鎖等待最多的檔案
+typedef struct
+{
+    FileEntry *file;
+    uint64_t acquires, waits, wait_us;
+} HotFile;
+
+typedef struct
+{
+    HotFile top[STATS_HOT_FILES];
+    int n;
+} HotList;
+
+// 可擴充的輸出緩衝區
+typedef struct
+{
+    char *p;
+    size_t len, cap;
+} Buf;
+
+static const char *kind_names[STAT_KINDS] = {"new",  "read",  "write", "change", "stats",
+                                             "list", "stat", "mread", "mwrite", "lock_wait"};
+
+static const char *role_names[] = {"standalone", "primary", "replica"};
+static pthread_mutex_t shard_mutex = PTHREAD_MUTEX_INITIALIZER; // 保護 shard 清單 (每個執行緒只加入一次)
+static StatsShard *shards;
+static __thread StatsShard *self;
+static uint64_t start_us;
+
+uint64_t stats_now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void stats_init(void)
+{
+    start_us = stats_now_us();
+}
+
+// 第 i 格包含 (2^(i-1), 2^i] 微秒 (第 0 格為 0 與 1)
+static int bucket_of(uint64_t usec)
+{
+    if (usec <= 1)
+        return 0;
+    int b = 64 - __builtin_clzll(usec - 1);
+    return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+// 只有擁有者寫入，不需要 read-modify-write 的 atomic 指令
+static void add(atomic_uint_least64_t *v, uint64_t n)
+{
+    atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static StatsShard *my_shard(void)
+{
+    if (!self)
+    {
+        self = calloc(1, sizeof(StatsShard));
+        pthread_mutex_lock(&shard_mutex);
+        self->next = shards;
+        shards = self;
+        pthread_mutex_unlock(&shard_mutex);
+    }
+    return self;
+}
+
+void stats_record(StatKind kind, uint64_t usec, int error)
+{
+    Counter *c = &my_shard()->kinds[kind];
+
+    add(&c->count, 1);
+    if (error)
+        add(&c->errors, 1);
+    add(&c->sum_us, usec);
+    add(&c->buckets[bucket_of(usec)], 1);
+    if (usec > atomic_load_explicit(&c->max_us, memory_order_relaxed))
+        atomic_store_explicit(&c->max_us, usec, memory_order_relaxed);
+}
+
+static void collect(Totals *t)
+{
+    memset(t, 0, sizeof(Totals) * STAT_KINDS);
+    pthread_mutex_lock(&shard_mutex);
+    for (StatsShard *s = shards; s; s = s->next)
+    {
+        for (int k = 0; k < STAT_KINDS; k++)
+        {
+            Counter *c = &s->kinds[k];
+            t[k].count += atomic_load_explicit(&c->count, memory_order_relaxed);
+            t[k].errors += atomic_load_explicit(&c->errors, memory_order_relaxed);
+            t[k].sum_us += atomic_load_explicit(&c->sum_us, memory_order_relaxed);
+            uint64_t max = atomic_load_explicit(&c->max_us, memory_order_relaxed);
+            if (max > t[k].max_us)
+                t[k].max_us = max;
+            for (int b = 0; b < STATS_BUCKETS; b++)
+                t[k].buckets[b] += atomic_load_explicit(&c->buckets[b], memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&shard_mutex);
+}
+
+// 百分位數：取所在格的上界 (不超過最大值)，誤差在 2 倍以內
+static uint64_t percentile(const Totals *t, double q)
+{
+    uint64_t target = (uint64_t)(t->count * q), seen = 0;
+    if (t->count == 0)
+        return 0;
+    for (int b = 0; b < STATS_BUCKETS; b++)
+    {
+        seen += t->buckets[b];
+        if (seen > target)
+            return (1ULL << b) < t->max_us ? (1ULL << b) : t->max_us;
+    }
+    return t->max_us;
+}
+
+static void collect_hot(FileEntry *file, void *arg)
+{
+    HotList *h = arg;
+    HotFile f = {file,
+                 atomic_load_explicit(&file->lock.acquires, memory_order_relaxed),
+                 atomic_load_explicit(&file->lock.waits, memory_order_relaxed),
+                 atomic_load_explicit(&file->lock.wait_us, memory_order_relaxed)};
+
+    if (f.waits == 0)
+        return;
+    if (h->n == STATS_HOT_FILES && f.wait_us <= h->top[h->n - 1].wait_us)
+        return;
+
+    // 依等待時間遞減插入
+    int i = h->n < STATS_HOT_FILES ? h->n++ : h->n - 1;
+    while (i > 0 && h->top[i - 1].wait_us < f.wait_us)
+    {
+        h->top[i] = h->top[i - 1];
+        i--;
+    }
+    h->top[i] = f;
+}
+
+static void bprintf(Buf *b, const char *fmt, ...)
+{
+    va_list ap;
+    while (1)
+    {
+        va_start(ap, fmt);
+        int n = vsnprintf(b->p + b->len, b->cap - b->len, fmt, ap);
+        va_end(ap);
+        if (b->len + n < b->cap)
+        {
+            b->len += n;
+            return;
+        }
+        b->cap = (b->len + n + 1) * 2;
+        b->p = realloc(b->p, b->cap);
+    }
+}
+
+// 輸出帶引號的字串 (檔名由客戶端決定，JSON 與 Prometheus label 都需要跳脫 \ 與 ")
+static void bquote(Buf *b, const char *s)
+{
+    bprintf(b, "\"");
+    for (; *s; s++)
+    {
+        if (*s == '"' || *s == '\\')
+            bprintf(b, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            bprintf(b, "\\u%04x", *s);
+        else
+            bprintf(b, "%c", *s);
+    }
+    bprintf(b, "\"");
+}
+
+static void render_json(Buf *b, const Totals *t, const HotList *hot)
+{
+    bprintf(b, "{\n  \"uptime_sec\": %llu,\n", (unsigned long long)((stats_now_us() - start_us) / 1000000));
+    bprintf(b, "  \"connections\": %d,\n  \"catalog_files\": %zu,\n", reactor_connections(), catalog_size());
+    bprintf(b, "  \"pool_queued\": %d,\n  \"pool_rejected\": %llu,\n", pool_queued(),
+            (unsigned long long)pool_rejected());
+    uint64_t hits, misses;
+    size_t bytes;
+    content_stats(&hits, &misses, &bytes);
+    bprintf(b, "  \"content_cache\": {\"hits\": %llu, \"misses\": %llu, \"bytes\": %zu},\n",
+            (unsigned long long)hits, (unsigned long long)misses, bytes);
+    // 複寫：主伺服器為最新序號與複本數，複本為已套用的序號與落後時間 (-1: 尚未與主伺服器一致過)
+    ReplicaRole role;
+    uint64_t seq, lag_ms;
+    int replicas;
+    replica_stats(&role, &seq, &replicas, &lag_ms);
+    bprintf(b, "  \"replication\": {\"role\": \"%s\", \"seq\": %llu, \"replicas\": %d, \"lag_ms\": %lld},\n",
+            role_names[role], (unsigned long long)seq, replicas, lag_ms == UINT64_MAX ? -1LL : (long long)lag_ms);
+
+    for (int k = 0; k < STAT_KINDS; k++)
+    {
+        bprintf(b, "  \"%s\": {\"count\": %llu, \"errors\": %llu, \"sum_us\": %llu, \"max_us\": %llu, "
+                   "\"p50_us\": %llu, \"p90_us\": %llu, \"p99_us\": %llu},\n",
+                kind_names[k], (unsigned long long)t[k].count, (unsigned long long)t[k].errors,
+                (unsigned long long)t[k].sum_us, (unsigned long long)t[k].max_us,
+                (unsigned long long)percentile(&t[k], 0.5), (unsigned long long)percentile(&t[k], 0.9),
+                (unsigned long long)percentile(&t[k], 0.99));
+    }
+
+    bprintf(b, "  \"hot_files\": [");
+    for (int i = 0; i < hot->n; i++)
+    {
+        bprintf(b, "%s\n    {\"name\": ", i ? "," : "");
+        bquote(b, hot->top[i].file->name);
+        bprintf(b, ", \"acquires\": %llu, \"waits\": %llu, \"wait_us\": %llu}",
+                (unsigned long long)hot->top[i].acquires, (unsigned long long)hot->top[i].waits,
+                (unsigned long long)hot->top[i].wait_us);
+    }
+    bprintf(b, "%s]\n}\n", hot->n ? "\n  " : "");
+}
+
+static void prom_histogram(Buf *b, const char *name, const char *label, const Totals *t)
+{
+    const char *sep = label[0] ? "," : "";
+    uint64_t cumulative = 0;
+
+    for (int i = 0; i < STATS_BUCKETS - 1; i++)
+    {
+        cumulative += t->buckets[i];
+        bprintf(b, "%s_bucket{%s%sle=\"%llu\"} %llu\n", name, label, sep, 1ULL << i, (unsigned long long)cumulative);
+    }
+    bprintf(b, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, label, sep, (unsigned long long)t->count);
+    const char *open = label[0] ? "{" : "", *close = label[0] ? "}" : "";
+    bprintf(b, "%s_sum%s%s%s %llu\n", name, open, label, close, (unsigned long long)t->sum_us);
+    bprintf(b, "%s_count%s%s%s %llu\n", name, open, label, close, (unsigned long long)t->count);
+}
+
+static void render_prometheus(Buf *b, const Totals *t, const HotList *hot)
+{
+    char label[64];
+
+    bprintf(b, "# HELP fs_uptime_seconds Seconds since the server started.\n# TYPE fs_uptime_seconds gauge\n");
+    bprintf(b, "fs_uptime_seconds %llu\n", (unsigned long long)((stats_now_us() - start_us) / 1000000));
+    bprintf(b, "# HELP fs_connections Open client connections.\n# TYPE fs_connections gauge\n");
+    bprintf(b, "fs_connections %d\n", reactor_connections());
+    bprintf(b, "# HELP fs_catalog_files Files in the catalog.\n# TYPE fs_catalog_files gauge\n");
+    bprintf(b, "fs_catalog_files %zu\n", catalog_size());
+    bprintf(b, "# HELP fs_pool_queued Tasks waiting for a worker thread.\n# TYPE fs_pool_queued gauge\n");
+    bprintf(b, "fs_pool_queued %d\n", pool_queued());
+    bprintf(b, "# HELP fs_pool_rejected_total Tasks rejected because the queue was full.\n"
+               "# TYPE fs_pool_rejected_total counter\n");
+    bprintf(b, "fs_pool_rejected_total %llu\n", (unsigned long long)pool_rejected());
+    uint64_t hits, misses;
+    size_t bytes;
+    content_stats(&hits, &misses, &bytes);
+    bprintf(b, "# HELP fs_content_cache_hits_total Reads served from the content cache.\n"
+               "# TYPE fs_content_cache_hits_total counter\n");
+    bprintf(b, "fs_content_cache_hits_total %llu\n", (unsigned long long)hits);
+    bprintf(b, "# HELP fs_content_cache_misses_total Reads that missed the content cache.\n"
+               "# TYPE fs_content_cache_misses_total counter\n");
+    bprintf(b, "fs_content_cache_misses_total %llu\n", (unsigned long long)misses);
+    bprintf(b, "# HELP fs_content_cache_bytes Bytes held by the content cache.\n# TYPE fs_content_cache_bytes gauge\n");
+    bprintf(b, "fs_content_cache_bytes %zu\n", bytes);
+    ReplicaRole role;
+    uint64_t seq, lag_ms;
+    int replicas;
+    replica_stats(&role, &seq, &replicas, &lag_ms);
+    bprintf(b, "# HELP fs_replication_role Replication role (0 standalone, 1 primary, 2 replica).\n"
+               "# TYPE fs_replication_role gauge\n");
+    bprintf(b, "fs_replication_role %d\n", (int)role);
+    bprintf(b, "# HELP fs_replication_seq Latest log sequence (primary) or last applied sequence (replica).\n"
+               "# TYPE fs_replication_seq gauge\n");
+    bprintf(b, "fs_replication_seq %llu\n", (unsigned long long)seq);
+    bprintf(b, "# HELP fs_replication_replicas Replicas connected to this primary.\n"
+               "# TYPE fs_replication_replicas gauge\n");
+    bprintf(b, "fs_replication_replicas %d\n", replicas);
+    bprintf(b, "# HELP fs_replication_lag_milliseconds Time since the replica was last caught up (-1: never).\n"
+               "# TYPE fs_replication_lag_milliseconds gauge\n");
+    bprintf(b, "fs_replication_lag_milliseconds %lld\n", lag_ms == UINT64_MAX ? -1LL : (long long)lag_ms);
+
+    bprintf(b, "# HELP fs_request_duration_microseconds Request latency from parse to final reply.\n"
+               "# TYPE fs_request_duration_microseconds histogram\n");
+    for (int k = 0; k < STAT_LOCK_WAIT; k++)
+    {
+        snprintf(label, sizeof(label), "command=\"%s\"", kind_names[k]);
+        prom_histogram(b, "fs_request_duration_microseconds", label, &t[k]);
+    }
+    bprintf(b, "# HELP fs_request_errors_total Requests that ended with an error status.\n"
+               "# TYPE fs_request_errors_total counter\n");
+    for (int k = 0; k < STAT_LOCK_WAIT; k++)
+        bprintf(b, "fs_request_errors_total{command=\"%s\"} %llu\n", kind_names[k], (unsigned long long)t[k].errors);
+
+    bprintf(b, "# HELP fs_lock_wait_microseconds Time spent queued for a file lock.\n"
+               "# TYPE fs_lock_wait_microseconds histogram\n");
+    prom_histogram(b, "fs_lock_wait_microseconds", "", &t[STAT_LOCK_WAIT]);
+
+    static const char *file_metrics[][2] = {
+        {"fs_file_lock_acquires_total", "File lock acquisitions (files with the most lock wait time)."},
+        {"fs_file_lock_waits_total", "File lock requests that had to queue."},
+        {"fs_file_lock_wait_microseconds_total", "Total time spent queued for the file lock."}};
+    for (int m = 0; m < 3; m++)
+    {
+        bprintf(b, "# HELP %s %s\n# TYPE %s counter\n", file_metrics[m][0], file_metrics[m][1], file_metrics[m][0]);
+        for (int i = 0; i < hot->n; i++)
+        {
+            uint64_t v = m == 0 ? hot->top[i].acquires : m == 1 ? hot->top[i].waits : hot->top[i].wait_us;
+            bprintf(b, "%s{file=", file_metrics[m][0]);
+            bquote(b, hot->top[i].file->name);
+            bprintf(b, "} %llu\n", (unsigned long long)v);
+        }
+    }
+}
+
+char *stats_render(StatsFormat fmt, size_t *len)
+{
+    Totals t[STAT_KINDS];
+    HotList hot = {.n = 0};
+    Buf b = {malloc(4096), 0, 4096};
+
+    collect(t);
+    catalog_foreach(collect_hot, &hot);
+    if (fmt == STATS_PROMETHEUS)
+        render_prometheus(&b, t, &hot);
+    else
+        render_json(&b, t, &hot);
+    *len = b.len;
+    return b.p;
+}
+
+int stats_parse_format(const char *name)
+{
+    if (strcmp(name, "json") == 0)
+        return STATS_JSON;
+    if (strcmp(name, "prom") == 0)
+        return STATS_PROMETHEUS;
+    return -1;
+}
+
+typedef struct
+{
+    char path[256];
+    int interval;
+    StatsFormat fmt;
+} DumpConfig;
+
+static void *dump_thread(void *arg)
+{
+    DumpConfig *cfg = arg;
+    char tmp[sizeof(cfg->path) + 8];
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", cfg->path);
+    while (1)
+    {
+        sleep(cfg->interval);
+        size_t len;
+        char *text = stats_render(cfg->fmt, &len);
+        FILE *fp = fopen(tmp, "w");
+        int ok = fp && fwrite(text, 1, len, fp) == len;
+        if (fp && fclose(fp) != 0)
+            ok = 0;
+        if (!ok || rename(tmp, cfg->path) < 0)
+            perror("stats dump");
+        free(text);
+    }
+    return NULL;
+}
+
+void stats_start_dump(const char *path, int interval_sec, StatsFormat fmt)
+{
+    DumpConfig *cfg = malloc(sizeof(DumpConfig));
+    pthread_t tid;
+
+    snprintf(cfg->path, sizeof(cfg->path), "%s", path);
+    cfg->interval = interval_sec > 0 ? interval_sec : 1;
+    cfg->fmt = fmt;
+    pthread_create(&tid, NULL, dump_thread, cfg);
+    pthread_detach(tid);
+}
@@ -0,0 +1,58 @@
+/*
+ * stats.h - 伺服器統計 (指令延遲、檔案鎖等待、佇列深度)
+ * 功能：每個執行緒各自累計計數與延遲直方圖 (只有自己寫入，不需要鎖也沒有快取行競爭)，
+ *       需要時才把所有執行緒的資料加總，輸出成 JSON 或 Prometheus 文字格式。
+ *       可以由 stats 指令查詢，或由背景執行緒定期寫到檔案。
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define STATS_BUCKETS 32   // 延遲直方圖的格數：第 i 格為 (2^(i-1), 2^i] 微秒，最後一格包含所有更大的值
+#define STATS_HOT_FILES 10 // 輸出鎖等待時間最長的檔案數
+
+// 統計的項目
+typedef enum
+{
+    STAT_NEW,
+    STAT_READ,
+    STAT_WRITE,
+    STAT_CHANGE,
+    STAT_STATS,
+    STAT_LIST,
+    STAT_STAT,
+    STAT_MREAD,
+    STAT_MWRITE,
+    STAT_LOCK_WAIT, // 檔案鎖從排隊到取得的時間
+    STAT_KINDS
+} StatKind;
+
+// 輸出格式
+typedef enum
+{
+    STATS_JSON,
+    STATS_PROMETHEUS
+} StatsFormat;
+
+// 記錄啟動時間 (啟動時呼叫一次)
+void stats_init(void);
+
+// 單調時鐘 (微秒)
+uint64_t stats_now_us(void);
+
+// 記錄一次耗時 usec 的事件；error = 1 表示以錯誤結束
+void stats_record(StatKind kind, uint64_t usec, int error);
+
+// 加總所有執行緒的統計並輸出成字串 (呼叫者 free)，長度存到 *len
+char *stats_render(StatsFormat fmt, size_t *len);
+
+// 解析格式名稱 "json" / "prom"，不認識時回傳 -1
+int stats_parse_format(const char *name);
+
+// 建立背景執行緒，每隔 interval_sec 秒把統計寫到 path (先寫暫存檔再 rename，讀取者不會看到寫到一半的檔案)
+void stats_start_dump(const char *path, int interval_sec, StatsFormat fmt);
+
+#endif
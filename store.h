@@ -0,0 +1,62 @@
+/*
+ * store.h - 持久化的檔案目錄 (mmap 記錄檔 + write-ahead log)
+ * 功能：每個檔案的擁有者、群組與權限存成固定大小、帶 CRC 的記錄，記錄檔與雜湊索引都以 mmap 存取；
+ *       new/change 先寫進 WAL 再套用到對應的記錄，WAL 累積到一定大小時 msync 並清空 (checkpoint，
+ *       期間新的項目寫進另一個 WAL，不必等待)。
+ *       重新啟動只需要 mmap 兩個檔案並重播上次 checkpoint 之後的 WAL，不必解析或掃描整個目錄，
+ *       記錄在第一次被查詢時才載入 (catalog.c)，啟動時間與目錄大小無關。
+ *       檔案：<路徑>.db (標頭 + 記錄)、<路徑>.idx (依目錄分片切開的雜湊索引)、
+ *       <路徑>.wal 與 <路徑>.wal.1 (輪流使用)
+ */
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define STORE_DEFAULT_PATH ".catalog"
+
+// 一筆檔案記錄 (磁碟格式)
+typedef struct
+{
+    uint32_t crc;   // 以下欄位的 CRC32 (0 表示未使用的記錄)
+    uint32_t flags; // STORE_LIVE
+    uint64_t hash;  // 檔名的雜湊值 (重建索引時不需要知道雜湊函式)
+    char name[50];
+    char owner[50];
+    char group[50];
+    char perms[10];
+} StoreRecord;
+
+#define STORE_LIVE 1
+
+// 開啟 (不存在時建立) 持久目錄並從 WAL 復原；sync = 1 時 store_sync 會等待 WAL 落地
+// 失敗回傳 -1
+int store_open(const char *path, int sync);
+
+// 目前的記錄數
+size_t store_count(void);
+
+// 依檔名查詢記錄編號，找不到回傳 -1 (hash 為 catalog.c 的檔名雜湊值)
+// 索引依雜湊值最高 6 位元分片，與目錄分片一致：呼叫者必須持有該檔名所在的目錄分片鎖
+int64_t store_find(const char *name, uint64_t hash);
+
+// 讀出一筆記錄並檢查 CRC，損毀時回傳 -1 (不持有鎖；讀到套用到一半的記錄時在 WAL 的鎖內重讀)
+int store_get(int64_t rec, StoreRecord *out);
+
+// 新增記錄 (呼叫者持有目錄分片鎖)：寫入 WAL 後套用，*rec 為新記錄的編號；回傳 WAL 序號，失敗回傳 0
+uint64_t store_insert(const char *name, uint64_t hash, const char *owner, const char *group, const char *perms,
+                      int64_t *rec);
+
+// 變更記錄的權限 (呼叫者持有目錄分片鎖)；回傳 WAL 序號，失敗回傳 0
+uint64_t store_set_perms(int64_t rec, const char *perms);
+
+// 逐一走訪開始時已存在的有效記錄，fn 收到記錄編號與一份副本 (不持有 WAL 的鎖，走訪期間 new/change 不必等待)
+void store_foreach(void (*fn)(int64_t rec, const StoreRecord *r, void *arg), void *arg);
+
+// 等待序號 lsn 之前的 WAL 都已落地 (fdatasync，同時等待的呼叫者共用一次)；開啟時 sync = 0 則直接返回
+// 不可在持有目錄分片鎖時呼叫
+void store_sync(uint64_t lsn);
+
+#endif
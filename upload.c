@@ -0,0 +1,241 @@
+/*
+ * upload.c - write 指令的資料暫存
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+
+#include "upload.h"
+#include "uring.h"
+
+struct Upload
+{
+    char path[PATH_MAX];      // 目標檔案
+    char tmp_path[PATH_MAX];  // 暫存檔 ("目錄/.檔名.pid.序號.tmp")
+    int tmp_fd;               // 暫存檔 (-1: 資料仍全部在記憶體)
+    struct iovec *iov;        // 記憶體中的資料區段
+    int iovcnt;
+    int iovcap;
+    size_t mem_bytes;         // 記憶體中的 bytes 數
+    size_t total;             // 全部的 bytes 數
+};
+
+static atomic_uint tmp_seq;
+
+Upload *upload_new(const char *path)
+{
+    Upload *u = calloc(1, sizeof(Upload));
+    snprintf(u->path, sizeof(u->path), "%s", path);
+    u->tmp_fd = -1;
+    return u;
+}
+
+size_t upload_size(Upload *u)
+{
+    return u->total;
+}
+
+int pwritev_full(int fd, const struct iovec *iov, int cnt, off_t off)
+{
+    // 部分寫入時才複製剩下的區段再調整，呼叫者的陣列 (例如之後要 free 的指標) 不會被修改
+    struct iovec *rest = NULL, *cur = (struct iovec *)iov;
+
+    while (cnt > 0)
+    {
+        // 啟用 io_uring 時超過 IOV_MAX 的區段也在同一次系統呼叫中送出
+        ssize_t n = uring_pwritev(fd, cur, cnt, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            if (n == 0)
+                errno = EIO; // 沒有任何進展，不要無限重試
+            free(rest);
+            return -1;
+        }
+        off += n;
+        // 跳過已寫完的區段，最後一個可能只寫了一部分
+        while (cnt > 0 && (size_t)n >= cur->iov_len)
+        {
+            n -= cur->iov_len;
+            cur++;
+            cnt--;
+        }
+        if (cnt > 0 && n > 0)
+        {
+            if (!rest)
+            {
+                rest = malloc(cnt * sizeof(struct iovec));
+                memcpy(rest, cur, cnt * sizeof(struct iovec));
+                cur = rest;
+            }
+            cur->iov_base = (char *)cur->iov_base + n;
+            cur->iov_len -= n;
+        }
+    }
+    free(rest);
+    return 0;
+}
+
+static void release_memory(Upload *u)
+{
+    for (int i = 0; i < u->iovcnt; i++)
+        free(u->iov[i].iov_base);
+    u->iovcnt = 0;
+    u->mem_bytes = 0;
+}
+
+// 把記憶體中的資料寫到暫存檔的尾端 (第一次時建立暫存檔)
+static int spill_to_file(Upload *u)
+{
+    if (u->tmp_fd < 0)
+    {
+        const char *slash = strrchr(u->path, '/');
+        int dirlen = slash ? (int)(slash - u->path + 1) : 0;
+
+        snprintf(u->tmp_path, sizeof(u->tmp_path), "%.*s.%s.%d.%u.tmp", dirlen, u->path,
+                 u->path + dirlen, (int)getpid(), atomic_fetch_add(&tmp_seq, 1));
+        u->tmp_fd = open(u->tmp_path, O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (u->tmp_fd < 0)
+            return -1;
+    }
+    if (pwritev_full(u->tmp_fd, u->iov, u->iovcnt, u->total - u->mem_bytes) < 0)
+        return -1;
+    release_memory(u);
+    return 0;
+}
+
+int upload_buffer(Upload *u, const char *data, size_t len)
+{
+    if (len > 0)
+    {
+        if (u->iovcnt == u->iovcap)
+        {
+            u->iovcap = u->iovcap ? u->iovcap * 2 : 8;
+            u->iov = realloc(u->iov, u->iovcap * sizeof(struct iovec));
+        }
+        char *copy = malloc(len);
+        memcpy(copy, data, len);
+        u->iov[u->iovcnt].iov_base = copy;
+        u->iov[u->iovcnt].iov_len = len;
+        u->iovcnt++;
+        u->mem_bytes += len;
+        u->total += len;
+    }
+    return u->mem_bytes > UPLOAD_MEM_LIMIT;
+}
+
+int upload_spill(Upload *u)
+{
+    return u->mem_bytes > 0 ? spill_to_file(u) : 0;
+}
+
+int upload_append(Upload *u, const char *data, size_t len)
+{
+    if (len == 0)
+        return 0;
+    if (u->tmp_fd >= 0)
+    {
+        // 先寫出 upload_buffer 留在記憶體的部分，維持資料順序
+        if (upload_spill(u) < 0)
+            return -1;
+        struct iovec iov = {(void *)data, len};
+        off_t off = u->total;
+        u->total += len;
+        return pwritev_full(u->tmp_fd, &iov, 1, off);
+    }
+    if (upload_buffer(u, data, len))
+        return spill_to_file(u);
+    return 0;
+}
+
+int upload_prepare_replace(Upload *u)
+{
+    if ((u->tmp_fd < 0 || u->mem_bytes > 0) && spill_to_file(u) < 0)
+        return -1;
+    return 0;
+}
+
+int upload_commit_replace(Upload *u)
+{
+    if (rename(u->tmp_path, u->path) < 0)
+        return -1;
+    u->tmp_path[0] = '\0'; // 暫存檔已成為目標檔案，fd 交給呼叫者
+    int fd = u->tmp_fd;
+    u->tmp_fd = -1;
+    return fd;
+}
+
+int upload_memory_iov(Upload *u, struct iovec **iov, int *cnt)
+{
+    if (u->tmp_fd >= 0)
+        return 0;
+    *iov = u->iov;
+    *cnt = u->iovcnt;
+    return 1;
+}
+
+int upload_write_at(Upload *u, int fd, off_t offset)
+{
+    if (u->tmp_fd < 0)
+        return pwritev_full(fd, u->iov, u->iovcnt, offset);
+    if (upload_spill(u) < 0)
+        return -1;
+
+    // 暫存檔的內容在核心內直接複製，不經過使用者空間
+    // fd 是 fdcache 共用的 fd，其他區段的寫入可能同時進行：一律使用明確的位置，不移動檔案位置
+    loff_t in_off = 0, out_off = offset;
+    size_t left = u->total;
+    char *bounce = NULL;
+    while (left > 0)
+    {
+        ssize_t n = bounce ? -1 : copy_file_range(u->tmp_fd, &in_off, fd, &out_off, left, 0);
+        if (n < 0 && (bounce || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP))
+        {
+            // 檔案系統不支援時改以 pread / pwrite 經由緩衝區複製
+            if (!bounce)
+                bounce = malloc(UPLOAD_MEM_LIMIT);
+            n = pread(u->tmp_fd, bounce, left < UPLOAD_MEM_LIMIT ? left : UPLOAD_MEM_LIMIT, in_off);
+            if (n > 0)
+            {
+                struct iovec iov = {bounce, n};
+                if (pwritev_full(fd, &iov, 1, out_off) < 0)
+                    n = -1;
+                else
+                {
+                    in_off += n;
+                    out_off += n;
+                }
+            }
+        }
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+                continue;
+            free(bounce);
+            return -1;
+        }
+        left -= n;
+    }
+    free(bounce);
+    return 0;
+}
+
+void upload_free(Upload *u)
+{
+    release_memory(u);
+    free(u->iov);
+    if (u->tmp_fd >= 0)
+        close(u->tmp_fd);
+    if (u->tmp_path[0] != '\0')
+        unlink(u->tmp_path);
+    free(u);
+}
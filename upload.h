@@ -0,0 +1,55 @@
+/*
+ * upload.h - write 指令的資料暫存
+ * 功能：客戶端分段送來的寫入資料先存在記憶體，超過門檻後改存同目錄下的暫存檔；
+ *       資料收齊後才取得檔案鎖，以 writev / rename / copy_file_range 一次提交。
+ *       事件迴圈只把資料放進記憶體 (upload_buffer)，建立與寫入暫存檔都在工作執行緒上進行。
+ */
+
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define UPLOAD_MEM_LIMIT (1 << 20) // 記憶體暫存上限，超過後改寫入暫存檔
+
+typedef struct Upload Upload;
+
+// 建立空的暫存區，path 為最後要寫入的檔案 (暫存檔建立在同一目錄，才能 rename)
+Upload *upload_new(const char *path);
+
+// 附加一段資料，I/O 錯誤回傳 -1
+int upload_append(Upload *u, const char *data, size_t len);
+
+// 只附加到記憶體 (不做任何 I/O，事件迴圈使用)；記憶體中的資料超過 UPLOAD_MEM_LIMIT 時回傳 1，
+// 呼叫者應在事件迴圈之外以 upload_spill 寫進暫存檔，期間不可再附加
+int upload_buffer(Upload *u, const char *data, size_t len);
+
+// 把記憶體中的資料寫進暫存檔 (第一次時建立)，I/O 錯誤回傳 -1
+int upload_spill(Upload *u);
+
+// 目前暫存的總 bytes 數
+size_t upload_size(Upload *u);
+
+// 覆蓋模式第一步 (不需持有檔案鎖)：確保所有資料都已寫入暫存檔
+int upload_prepare_replace(Upload *u);
+
+// 覆蓋模式第二步 (持有檔案鎖)：以 rename 原子地取代目標檔案
+// 成功時回傳新檔案的 fd (O_RDWR，所有權交給呼叫者)，失敗回傳 -1
+int upload_commit_replace(Upload *u);
+
+// 附加模式 (持有檔案鎖)：把資料寫到 fd 的 offset 位置
+// 記憶體資料以 pwritev 一次寫入，暫存檔則以 copy_file_range 在核心內複製
+int upload_write_at(Upload *u, int fd, off_t offset);
+
+// 資料全部在記憶體時回傳 1 並給出 iovec 陣列 (group commit 用來合併多個請求的寫入)；已存入暫存檔回傳 0
+int upload_memory_iov(Upload *u, struct iovec **iov, int *cnt);
+
+// 從 offset 開始寫完整個 iovec 陣列 (處理部分寫入，不修改 iov 的內容)
+int pwritev_full(int fd, const struct iovec *iov, int cnt, off_t offset);
+
+// 釋放記憶體並刪除尚未使用的暫存檔
+void upload_free(Upload *u);
+
+#endif
@@ -0,0 +1,282 @@
+/*
+ * uring.c - io_uring 執行後端 (直接使用系統呼叫，不依賴 liburing)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+#define DISK_RING_ENTRIES 64 // 工作執行緒寫檔用的 ring 大小
+
+struct Uring
+{
+    int fd;
+    unsigned entries;
+    // SQ ring (與核心共用)
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local_tail; // 已填寫但尚未公開給核心的 SQE 的下一個位置
+    // CQ ring
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ptr, *cq_ptr;
+    size_t sq_len, cq_len;
+};
+
+static int enabled;
+static __thread Uring *disk_ring;     // 工作執行緒各自的 ring
+static __thread int disk_ring_failed; // 1: 這個執行緒無法建立 ring，之後直接使用 pwritev
+static __thread uint32_t disk_gen;    // uring_pwritev 的呼叫序號 (user_data 的高 32 位元)
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned nr)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+int uring_enable(void)
+{
+    static const int needed[] = {IORING_OP_READ_FIXED, IORING_OP_WRITEV};
+    struct io_uring_params p;
+    size_t len = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+
+    memset(&p, 0, sizeof(p));
+    int fd = sys_setup(4, &p);
+    int ok = fd >= 0 && sys_register(fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0;
+    for (size_t i = 0; ok && i < sizeof(needed) / sizeof(needed[0]); i++)
+        ok = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    if (fd >= 0)
+        close(fd);
+    free(probe);
+    enabled = ok;
+    return ok;
+}
+
+int uring_enabled(void)
+{
+    return enabled;
+}
+
+Uring *uring_new(unsigned entries)
+{
+    struct io_uring_params p;
+    Uring *r = calloc(1, sizeof(Uring));
+
+    memset(&p, 0, sizeof(p));
+    if ((r->fd = sys_setup(entries, &p)) < 0)
+    {
+        free(r);
+        return NULL;
+    }
+    r->entries = p.sq_entries;
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->sq_len = r->cq_len = r->sq_len > r->cq_len ? r->sq_len : r->cq_len;
+
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->cq_ptr = p.features & IORING_FEAT_SINGLE_MMAP
+                    ? r->sq_ptr
+                    : mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    if (r->sq_ptr == MAP_FAILED || r->cq_ptr == MAP_FAILED || r->sqes == MAP_FAILED)
+    {
+        close(r->fd);
+        free(r);
+        return NULL;
+    }
+
+    char *sq = r->sq_ptr, *cq = r->cq_ptr;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->sq_local_tail = *r->sq_tail;
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return r;
+}
+
+void uring_free(Uring *r)
+{
+    munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+    if (r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_len);
+    munmap(r->sq_ptr, r->sq_len);
+    close(r->fd);
+    free(r);
+}
+
+struct io_uring_sqe *uring_sqe(Uring *r)
+{
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sq_local_tail - head >= r->entries)
+        return NULL;
+
+    unsigned idx = r->sq_local_tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    r->sq_local_tail++;
+    return sqe;
+}
+
+int uring_submit(Uring *r, unsigned wait_nr)
+{
+    // 先公開 SQE 內容再移動 tail，核心看到新的 tail 時 SQE 已填好
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+    for (;;)
+    {
+        // 送出所有還沒被核心取走的 SQE (被中斷時可能一個都還沒送出)
+        unsigned to_submit = r->sq_local_tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        int n = sys_enter(r->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+        if (n >= 0)
+            return n;
+        if (errno != EINTR)
+            return -errno;
+    }
+}
+
+int uring_cancel_pending(Uring *r)
+{
+    // 沒有 SQPOLL 時核心只在 io_uring_enter 中讀取 SQ，把 tail 移回 head 就不會再被送出
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    int n = r->sq_local_tail - head;
+    __atomic_store_n(r->sq_tail, head, __ATOMIC_RELEASE);
+    r->sq_local_tail = head;
+    return n;
+}
+
+int uring_cqe(Uring *r, uint64_t *user_data, int *res)
+{
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+
+    struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+int uring_register_buffer(Uring *r, void *buf, size_t len)
+{
+    struct iovec iov = {buf, len};
+    return sys_register(r->fd, IORING_REGISTER_BUFFERS, &iov, 1);
+}
+
+int uring_register_files(Uring *r, unsigned count)
+{
+    int *fds = malloc(count * sizeof(int));
+    for (unsigned i = 0; i < count; i++)
+        fds[i] = -1; // 空槽位
+    int ret = sys_register(r->fd, IORING_REGISTER_FILES, fds, count);
+    free(fds);
+    return ret;
+}
+
+int uring_set_file(Uring *r, unsigned slot, int fd)
+{
+    struct io_uring_files_update up;
+    memset(&up, 0, sizeof(up));
+    up.offset = slot;
+    up.fds = (uint64_t)(uintptr_t)&fd;
+    return sys_register(r->fd, IORING_REGISTER_FILES_UPDATE, &up, 1) == 1 ? 0 : -1;
+}
+
+ssize_t uring_pwritev(int fd, const struct iovec *iov, int cnt, off_t off)
+{
+    if (enabled && !disk_ring && !disk_ring_failed && !(disk_ring = uring_new(DISK_RING_ENTRIES)))
+        disk_ring_failed = 1;
+    if (!disk_ring)
+        return pwritev(fd, iov, cnt < IOV_MAX ? cnt : IOV_MAX, off);
+
+    // 每個 SQE 最多 IOV_MAX 個區段，依序寫在前一段之後
+    // user_data 帶有這次呼叫的序號，不會把其他呼叫的完成事件當成自己的
+    Uring *r = disk_ring;
+    size_t want[DISK_RING_ENTRIES];
+    int res[DISK_RING_ENTRIES], n = 0;
+    uint64_t gen = (uint64_t)++disk_gen << 32;
+    off_t pos = off;
+    for (int i = 0; i < cnt && n < (int)r->entries; n++)
+    {
+        int batch = cnt - i < IOV_MAX ? cnt - i : IOV_MAX;
+        struct io_uring_sqe *sqe = uring_sqe(r);
+        sqe->opcode = IORING_OP_WRITEV;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)(iov + i);
+        sqe->len = batch;
+        sqe->off = pos;
+        sqe->user_data = gen | n;
+        want[n] = 0;
+        res[n] = INT_MIN; // 尚未完成
+        for (int k = i; k < i + batch; k++)
+            want[n] += iov[k].iov_len;
+        pos += want[n];
+        i += batch;
+    }
+
+    // 送出失敗或只送出一部分 (核心此時不會等待)：收回沒被取走的 SQE，只等待已送出的部分；
+    // 一個都沒送出時改用 pwritev
+    uring_submit(r, n);
+    n -= uring_cancel_pending(r);
+    if (n == 0)
+        return pwritev(fd, iov, cnt < IOV_MAX ? cnt : IOV_MAX, off);
+
+    // 等到所有已送出的 SQE 都完成才返回：核心仍在讀呼叫者的 iovec，之後也不能留下完成事件
+    int done = 0;
+    while (done < n)
+    {
+        uint64_t id;
+        int rv;
+        while (uring_cqe(r, &id, &rv))
+        {
+            if ((id & ~0xffffffffULL) != gen || (id & 0xffffffff) >= (uint64_t)n)
+                continue;
+            res[id & 0xffffffff] = rv;
+            done++;
+        }
+        if (done < n && uring_submit(r, n - done) < 0)
+            sched_yield(); // 只等待完成事件，失敗 (例如暫時缺少資源) 時稍後重試
+    }
+
+    // 回傳從 off 起連續寫成功的長度 (之後的部分由呼叫者重試)；第一段沒有寫入任何資料時視為錯誤
+    ssize_t total = 0;
+    for (int k = 0; k < n; k++)
+    {
+        if (res[k] < 0)
+            break;
+        total += res[k];
+        if ((size_t)res[k] < want[k])
+            break;
+    }
+    if (total == 0)
+    {
+        errno = res[0] < 0 ? -res[0] : EIO;
+        return -1;
+    }
+    return total;
+}
@@ -0,0 +1,56 @@
+/*
+ * uring.h - io_uring 執行後端 (直接使用系統呼叫，不依賴 liburing)
+ * 功能：把許多小的 I/O 合併成一批 SQE，以一次 io_uring_enter 送出並等待完成，減少系統呼叫次數。
+ *       事件迴圈用它一次讀取同一輪 epoll 中所有可讀的連線 (socket 與接收緩衝區預先註冊)，
+ *       工作執行緒用它送出檔案寫入。核心不支援時 (probe 失敗) 呼叫者沿用原本的系統呼叫。
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+typedef struct Uring Uring;
+
+// 檢查核心是否支援需要的操作，支援時啟用 io_uring 後端並回傳 1 (啟動時呼叫一次)
+int uring_enable(void);
+
+// 是否已啟用
+int uring_enabled(void);
+
+// 建立有 entries 個 SQE 的 ring (只由建立它的執行緒使用)，失敗回傳 NULL
+Uring *uring_new(unsigned entries);
+
+// 關閉 ring (同時取消所有註冊)
+void uring_free(Uring *r);
+
+// 取得下一個可以填寫的 SQE (已清為 0)，ring 已滿時回傳 NULL
+struct io_uring_sqe *uring_sqe(Uring *r);
+
+// 送出所有已填寫的 SQE，並等待至少 wait_nr 個完成事件；失敗回傳 -errno
+int uring_submit(Uring *r, unsigned wait_nr);
+
+// 收回已填寫但還沒被核心取走的 SQE (例如 uring_submit 失敗時)，回傳收回的數量
+int uring_cancel_pending(Uring *r);
+
+// 取出一個完成事件，沒有時回傳 0
+int uring_cqe(Uring *r, uint64_t *user_data, int *res);
+
+// 註冊一塊固定緩衝區 (IORING_OP_READ_FIXED 的 buf_index 0)
+int uring_register_buffer(Uring *r, void *buf, size_t len);
+
+// 註冊 count 個空的 fd 槽位 (IOSQE_FIXED_FILE)，之後以 uring_set_file 填入
+int uring_register_files(Uring *r, unsigned count);
+
+// 把 fd 放進槽位 slot (fd = -1 清除)
+int uring_set_file(Uring *r, unsigned slot, int fd);
+
+// 在 off 寫入 iov (超過 IOV_MAX 的部分分成多個 SQE 一次送出)，回傳從 off 起連續寫入的 bytes 數
+// 使用目前執行緒自己的 ring；未啟用或無法建立 ring 時直接呼叫 pwritev
+ssize_t uring_pwritev(int fd, const struct iovec *iov, int cnt, off_t off);
+
+#endif